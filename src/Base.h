@@ -7,6 +7,8 @@
 // Platform defines
 #ifdef _MSC_VER
 	#define PLATFORM_WINDOWS 1
+#elif defined(__unix__) || defined(__APPLE__)
+	#define PLATFORM_POSIX 1
 #else
 	#error "Define current platform"
 #endif
@@ -16,6 +18,11 @@
 	#define CONFIG_DEBUG 1
 #endif
 
+// Set by builds that don't link with SDL: no window and no keyboard input
+#if !defined(CONFIG_HEADLESS)
+	#define CONFIG_HEADLESS 0
+#endif
+
 // Disable warnings
 #if PLATFORM_WINDOWS
 	#pragma warning(disable : 4201) // nonstandard extension used : nameless struct/union
@@ -66,9 +73,9 @@ static_assert(sizeof(float64)==8, "Invalid type size");
 namespace Internal
 {
 	template <size_t value> struct ShiftLeft1 { static const size_t Result = 1 << value; };
-	template <> struct ShiftLeft1<~0> { static const size_t Result = 0; };
+	template <> struct ShiftLeft1<~size_t(0)> { static const size_t Result = 0; };
 
-	template <size_t b0, size_t b1 = ~0, size_t b2 = ~0, size_t b3 = ~0, size_t b4 = ~0> struct BitMask
+	template <size_t b0, size_t b1 = ~size_t(0), size_t b2 = ~size_t(0), size_t b3 = ~size_t(0), size_t b4 = ~size_t(0)> struct BitMask
 	{
 		static const size_t Result =
 			ShiftLeft1<b0>::Result |
@@ -132,7 +139,11 @@ inline void FailHandler(const char* msg)
 	throw std::logic_error(msg);
 }
 
-#define FAIL(msg, ...) FailHandler(FormattedString<>(msg, __VA_ARGS__))
+#if PLATFORM_WINDOWS
+	#define FAIL(msg, ...) FailHandler(FormattedString<>(msg, __VA_ARGS__))
+#else
+	#define FAIL(msg, ...) FailHandler(FormattedString<>(msg, ##__VA_ARGS__)) // Removes comma if no arguments
+#endif
 
 // Bit operations
 
@@ -11,6 +11,8 @@
 #include "Mapper3.h"
 #include "Mapper4.h"
 #include "Mapper7.h"
+#include "StateSerializer.h"
+#include <algorithm>
 
 namespace
 {
@@ -24,6 +26,31 @@ namespace
 	{
 		return address & (bankSize - 1);
 	}
+
+	// Standard CRC32 (as used by zip and rom databases), crc is the result for the previous data
+	uint32 Crc32(uint32 crc, const uint8* data, size_t size)
+	{
+		static uint32 table[256] = {0};
+		if (table[1] == 0)
+		{
+			for (uint32 i = 0; i < 256; ++i)
+			{
+				uint32 value = i;
+				for (int bit = 0; bit < 8; ++bit)
+				{
+					value = (value & 1)? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+				}
+				table[i] = value;
+			}
+		}
+
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+		{
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
 }
 
 void Cartridge::Initialize(Nes& nes)
@@ -57,6 +84,7 @@ RomHeader Cartridge::LoadRom(const char* file)
 	std::for_each(begin(m_prgBanks), end(m_prgBanks), [] (PrgBankMemory& m) { m.Initialize(); });
 	std::for_each(begin(m_chrBanks), end(m_chrBanks), [] (ChrBankMemory& m) { m.Initialize(); });
 	std::for_each(begin(m_savBanks), end(m_savBanks), [] (SavBankMemory& m) { m.Initialize(); });
+	m_fourScreenVRam.Initialize();
 
 	// PRG-ROM
 	const size_t prgRomSize = romHeader.GetPrgRomSizeBytes();
@@ -96,9 +124,26 @@ RomHeader Cartridge::LoadRom(const char* file)
 	m_mapper = m_mapperHolder.get();
 
 	m_mapper->Initialize(numPrgBanks, numChrBanks, numSavBanks);
+	m_mapperNumber = romHeader.GetMapperNumber();
+
+	// Identifies the rom for save states (CHR-RAM carts have no CHR-ROM banks)
+	m_romCrc = 0;
+	for (size_t i = 0; i < numPrgBanks; ++i)
+	{
+		m_romCrc = Crc32(m_romCrc, m_prgBanks[i].RawPtr(), kPrgBankSize);
+	}
+	for (size_t i = 0; i < (chrRomSize > 0? numChrBanks : 0); ++i)
+	{
+		m_romCrc = Crc32(m_romCrc, m_chrBanks[i].RawPtr(), kChrBankSize);
+	}
 
 	m_cartNameTableMirroring = romHeader.GetNameTableMirroring();
 
+	// Tiles get decoded on first use
+	DecodedChrBank emptyDecodedChrBank;
+	emptyDecodedChrBank.tileDecoded.fill(false);
+	m_decodedChrBanks.assign(m_mapper->NumChrBanks1k(), emptyDecodedChrBank);
+
 	LoadSaveRamFile();
 
 	return romHeader;
@@ -162,9 +207,28 @@ void Cartridge::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 	}
 }
 
-uint8 Cartridge::HandlePpuRead(uint16 ppuAddress)
+uint8* Cartridge::GetCpuReadPtr(uint16 cpuAddress)
 {
-	return AccessChrMem(ppuAddress);
+	if (cpuAddress >= CpuMemory::kPrgRomBase)
+	{
+		return &AccessPrgMem(cpuAddress);
+	}
+	else if (cpuAddress >= CpuMemory::kSaveRamBase)
+	{
+		return &AccessSavMem(cpuAddress);
+	}
+	return nullptr;
+}
+
+uint8* Cartridge::GetCpuWritePtr(uint16 cpuAddress)
+{
+	// Writes to PRG must be seen by the mapper. Mappers don't have registers in save RAM range,
+	// so they don't need to see those writes.
+	if (cpuAddress >= CpuMemory::kSaveRamBase && cpuAddress < CpuMemory::kPrgRomBase && m_mapper->CanWriteSavMemory())
+	{
+		return &AccessSavMem(cpuAddress);
+	}
+	return nullptr;
 }
 
 void Cartridge::HandlePpuWrite(uint16 ppuAddress, uint8 value)
@@ -172,9 +236,31 @@ void Cartridge::HandlePpuWrite(uint16 ppuAddress, uint8 value)
 	if (m_mapper->CanWriteChrMemory())
 	{
 		AccessChrMem(ppuAddress) = value;
+
+		// Only the tile that contains this byte needs to be decoded again
+		const uint16 offset = GetBankOffset(ppuAddress, kChrBankSize);
+		m_decodedChrBanks[GetChrBankIndex1k(ppuAddress)].tileDecoded[offset / kChrTileSize] = false;
 	}
 }
 
+const uint8* Cartridge::GetDecodedChrRow(uint16 ppuAddress, bool flipHorz)
+{
+	const size_t bankIndex = GetChrBankIndex1k(ppuAddress);
+	const uint16 offset = GetBankOffset(ppuAddress, kChrBankSize);
+	const size_t tileIndex = offset / kChrTileSize;
+	const size_t row = offset % kChrTileSize;
+	assert(row < 8 && "Address must be in low bit plane");
+
+	DecodedChrBank& bank = m_decodedChrBanks[bankIndex];
+	if (!bank.tileDecoded[tileIndex])
+	{
+		DecodeChrTile(bankIndex, tileIndex);
+	}
+
+	const size_t pixelOffset = tileIndex * kChrPixelsPerTile + row * 8;
+	return flipHorz? &bank.flippedPixels[pixelOffset] : &bank.pixels[pixelOffset];
+}
+
 void Cartridge::WriteSaveRamFile()
 {
 	if (!IsRomLoaded())
@@ -198,6 +284,58 @@ void Cartridge::WriteSaveRamFile()
 	}
 }
 
+void Cartridge::SerializeRomId(StateSerializer& serializer)
+{
+	uint8 mapperNumber = m_mapperNumber;
+	uint32 numPrgBanks = static_cast<uint32>(m_mapper->NumPrgBanks4k());
+	uint32 numChrBanks = static_cast<uint32>(m_mapper->NumChrBanks1k());
+	uint32 romCrc = m_romCrc;
+	serializer.Value(mapperNumber);
+	serializer.Value(numPrgBanks);
+	serializer.Value(numChrBanks);
+	serializer.Value(romCrc);
+
+	if (mapperNumber != m_mapperNumber || numPrgBanks != m_mapper->NumPrgBanks4k() || numChrBanks != m_mapper->NumChrBanks1k() || romCrc != m_romCrc)
+		FAIL("Save state is for a different rom (mapper %d, CRC32 %08X)", mapperNumber, romCrc);
+}
+
+void Cartridge::Serialize(StateSerializer& serializer)
+{
+	m_mapper->Serialize(serializer);
+
+	if (m_mapper->CanWritePrgMemory())
+	{
+		for (size_t i = 0; i < m_mapper->NumPrgBanks4k(); ++i)
+		{
+			serializer.Memory(m_prgBanks[i]);
+		}
+	}
+
+	if (m_mapper->CanWriteChrMemory())
+	{
+		for (size_t i = 0; i < m_mapper->NumChrBanks1k(); ++i)
+		{
+			serializer.Memory(m_chrBanks[i]);
+
+			if (serializer.IsLoading())
+			{
+				m_decodedChrBanks[i].tileDecoded.fill(false);
+			}
+		}
+	}
+
+	// Bank 0 is mapped even if the cartridge has no save RAM
+	for (size_t i = 0; i < std::max<size_t>(m_mapper->NumSavBanks8k(), 1); ++i)
+	{
+		serializer.Memory(m_savBanks[i]);
+	}
+
+	if (GetNameTableMirroring() == NameTableMirroring::FourScreen)
+	{
+		serializer.Memory(m_fourScreenVRam);
+	}
+}
+
 void Cartridge::HACK_OnScanline()
 {
 	if (auto* mapper4 = dynamic_cast<Mapper4*>(m_mapper))
@@ -231,11 +369,46 @@ void Cartridge::LoadSaveRamFile()
 	}
 }
 
-size_t Cartridge::GetPrgBankIndex16k(uint16 cpuAddress) const
+size_t Cartridge::GetPrgBankIndex4k(uint16 cpuAddress) const
 {
 	const size_t bankIndex4k = GetBankIndex(cpuAddress, CpuMemory::kPrgRomBase, kPrgBankSize);
-	const size_t mappedBankIndex4k = m_mapper->GetMappedPrgBankIndex(bankIndex4k);
-	return mappedBankIndex4k * KB(4) / KB(16);
+	return m_mapper->GetMappedPrgBankIndex(bankIndex4k);
+}
+
+size_t Cartridge::GetPrgBankIndex16k(uint16 cpuAddress) const
+{
+	return GetPrgBankIndex4k(cpuAddress) * KB(4) / KB(16);
+}
+
+size_t Cartridge::GetChrBankIndex1k(uint16 ppuAddress) const
+{
+	const size_t bankIndex = GetBankIndex(ppuAddress, PpuMemory::kChrRomBase, kChrBankSize);
+	return m_mapper->GetMappedChrBankIndex(bankIndex);
+}
+
+void Cartridge::DecodeChrTile(size_t chrBankIndex, size_t tileIndex)
+{
+	// Each row is stored as 2 bit planes 8 bytes apart: low bits of the 8 pixels, then high bits.
+	// Leftmost pixel is in the high bit.
+	const uint8* tileData = m_chrBanks[chrBankIndex].RawPtr(TO16(tileIndex * kChrTileSize));
+	DecodedChrBank& bank = m_decodedChrBanks[chrBankIndex];
+	uint8* pixels = &bank.pixels[tileIndex * kChrPixelsPerTile];
+	uint8* flippedPixels = &bank.flippedPixels[tileIndex * kChrPixelsPerTile];
+
+	for (size_t row = 0; row < 8; ++row)
+	{
+		const uint8 bmpLow = tileData[row];
+		const uint8 bmpHigh = tileData[row + 8];
+
+		for (size_t i = 0; i < 8; ++i)
+		{
+			const uint8 pixel = (((bmpHigh >> (7 - i)) & 1) << 1) | ((bmpLow >> (7 - i)) & 1);
+			pixels[row * 8 + i] = pixel;
+			flippedPixels[row * 8 + (7 - i)] = pixel;
+		}
+	}
+
+	bank.tileDecoded[tileIndex] = true;
 }
 
 uint8& Cartridge::AccessPrgMem(uint16 cpuAddress)
@@ -5,8 +5,10 @@
 #include "Mapper.h"
 #include <memory>
 #include <string>
+#include <vector>
 
 class Nes;
+class StateSerializer;
 
 class Cartridge
 {
@@ -20,12 +22,39 @@ public:
 
 	uint8 HandleCpuRead(uint16 cpuAddress);
 	void HandleCpuWrite(uint16 cpuAddress, uint8 value);
-	uint8 HandlePpuRead(uint16 ppuAddress);
 	void HandlePpuWrite(uint16 ppuAddress, uint8 value);
 
+	// Returns the 8 pixel values (0-3) of the tile row whose low bit plane byte is at ppuAddress, from left to right,
+	// or right to left if flipHorz is set. Tiles are decoded on first use and cached per physical CHR bank.
+	const uint8* GetDecodedChrRow(uint16 ppuAddress, bool flipHorz);
+
 	void WriteSaveRamFile();
 	void HACK_OnScanline();
+	uint32 GetScanlinesToIrq() const { return m_mapper->GetScanlinesToIrq(); } // See Mapper::GetScanlinesToIrq
+
+	// Serializes mapper state and writable cartridge memory. ROM data is not serialized, so states can only be
+	// loaded with the same rom loaded, which SerializeRomId checks: it serializes the mapper number, bank counts and
+	// a CRC32 of the ROM data, and fails without loading anything if they differ from the loaded rom's.
+	void SerializeRomId(StateSerializer& serializer);
+	void Serialize(StateSerializer& serializer);
 	
+	bool CanWritePrgMemory() const { return m_mapper->CanWritePrgMemory(); }
+
+	// Return pointer to the memory mapped at this CPU address (valid up to the end of its 256 byte page),
+	// or nullptr if accesses must go through HandleCpuRead/HandleCpuWrite. Pointers must be fetched again
+	// when TestAndClearPrgMappingChanged returns true.
+	uint8* GetCpuReadPtr(uint16 cpuAddress);
+	uint8* GetCpuWritePtr(uint16 cpuAddress);
+	bool TestAndClearPrgMappingChanged() { return m_mapper->TestAndClearPrgMappingChanged(); }
+
+	// Return pointer to the CHR memory mapped at this PPU address (valid up to the end of its 1K bank), or to the
+	// extra name table memory of four-screen carts at this offset. Pointers must be fetched again when
+	// TestAndClearPpuMappingChanged returns true.
+	uint8* GetChrPtr(uint16 ppuAddress) { return &AccessChrMem(ppuAddress); }
+	uint8* GetFourScreenVRamPtr(uint16 vramOffset) { return m_fourScreenVRam.RawPtr(vramOffset); }
+	bool TestAndClearPpuMappingChanged() { return m_mapper->TestAndClearPpuMappingChanged(); }
+
+	size_t GetPrgBankIndex4k(uint16 cpuAddress) const;
 	size_t GetPrgBankIndex16k(uint16 cpuAddress) const;
 	
 private:
@@ -35,6 +64,9 @@ private:
 	uint8& AccessChrMem(uint16 ppuAddress);
 	uint8& AccessSavMem(uint16 cpuAddress);
 
+	size_t GetChrBankIndex1k(uint16 ppuAddress) const;
+	void DecodeChrTile(size_t chrBankIndex, size_t tileIndex);
+
 	Nes* m_nes;
 	
 	std::string m_romDirectory;
@@ -42,6 +74,8 @@ private:
 	std::string m_saveRamPath;
 
 	NameTableMirroring m_cartNameTableMirroring;
+	uint8 m_mapperNumber;
+	uint32 m_romCrc; // PRG-ROM and CHR-ROM data
 	std::shared_ptr<Mapper> m_mapperHolder;
 	Mapper* m_mapper;
 
@@ -57,4 +91,21 @@ private:
 	std::array<PrgBankMemory, kMaxPrgBanks> m_prgBanks;
 	std::array<ChrBankMemory, kMaxChrBanks> m_chrBanks;
 	std::array<SavBankMemory, kMaxSavBanks> m_savBanks;
+
+	// Four-screen carts supply the memory for name tables 2 and 3
+	typedef Memory<FixedSizeStorage<KB(2)>> FourScreenVRamMemory;
+	FourScreenVRamMemory m_fourScreenVRam;
+
+	// CHR tiles decoded to one byte per pixel, per physical CHR bank
+	static const size_t kChrTileSize = 16;
+	static const size_t kChrTilesPerBank = kChrBankSize / kChrTileSize;
+	static const size_t kChrPixelsPerTile = 8 * 8;
+
+	struct DecodedChrBank
+	{
+		std::array<uint8, kChrTilesPerBank * kChrPixelsPerTile> pixels;
+		std::array<uint8, kChrTilesPerBank * kChrPixelsPerTile> flippedPixels; // Rows flipped horizontally
+		std::array<bool, kChrTilesPerBank> tileDecoded;
+	};
+	std::vector<DecodedChrBank> m_decodedChrBanks;
 };
@@ -2,8 +2,10 @@
 #include "MemoryMap.h"
 #include "Debugger.h"
 #include "Input.h"
+#include "StateSerializer.h"
 #include <string>
 #include <algorithm>
+#include <cstring>
 
 namespace
 {
@@ -47,6 +49,14 @@ void ControllerPorts::Reset()
 	memset(m_lastIsButtonDown, 0, sizeof(m_lastIsButtonDown));
 }
 
+void ControllerPorts::Serialize(StateSerializer& serializer)
+{
+	serializer.Value(m_strobe);
+	serializer.Value(m_ports);
+	serializer.Value(m_readIndex);
+	serializer.Value(m_lastIsButtonDown);
+}
+
 uint8 ControllerPorts::HandleCpuRead(uint16 cpuAddress)
 {
 	const uint16 controllerIndex = MapCpuToPorts(cpuAddress);
@@ -2,6 +2,8 @@
 
 #include "Base.h"
 
+class StateSerializer;
+
 namespace ControllerButtons
 {
 	enum Type
@@ -41,6 +43,8 @@ public:
 	uint8 HandleCpuRead(uint16 cpuAddress);
 	void HandleCpuWrite(uint16 cpuAddress, uint8 value);
 
+	void Serialize(StateSerializer& serializer);
+
 private:
 	uint16 MapCpuToPorts(uint16 cpuAddress);
 
@@ -2,7 +2,9 @@
 #include "Nes.h"
 #include "OpCodeTable.h"
 #include "MemoryMap.h"
+#include "Cartridge.h"
 #include "Debugger.h"
+#include "StateSerializer.h"
 
 // Some retail games overflow (on purpose?) like Battletoads
 // so we can't leave this on
@@ -12,65 +14,125 @@ namespace
 {
 	OpCodeEntry** g_opCodeTable = GetOpCodeTable();
 
-	FORCEINLINE uint16 GetPageAddress(uint16 address)
+	// Instruction size in bytes for an addressing mode (see ValidateOpCodeTable)
+	template <AddressMode::Type addrMode>
+	struct InstructionSize
 	{
-		return (address & 0xFF00);
-	}
-
-	FORCEINLINE uint8 CalcNegativeFlag(uint16 v)
+		static const uint8 Result =
+			(addrMode & (AddressMode::Implid | AddressMode::Accumu))? 1 :
+			(addrMode & (AddressMode::Absolu | AddressMode::AbIdxX | AddressMode::AbIdxY | AddressMode::Indrct))? 3 :
+			2;
+	};
+
+	// Returns true for instructions that write to their memory operand
+	bool IsMemoryWriteInstruction(OpCodeName::Type opCodeName)
 	{
-		// Check if bit 7 is set
-		return (v & 0x0080) != 0;
+		using namespace OpCodeName;
+		switch (opCodeName)
+		{
+		case STA: case STX: case STY:
+		case ASL: case LSR: case ROL: case ROR:
+		case INC: case DEC:
+			return true;
+		}
+		return false;
 	}
 
-	FORCEINLINE uint8 CalcNegativeFlag(uint8 v)
+	// Returns true for instructions that may not continue to the next instruction
+	bool EndsBlock(OpCodeName::Type opCodeName)
 	{
-		// Check if bit 7 is set
-		return (v & 0x80) != 0;
+		using namespace OpCodeName;
+		switch (opCodeName)
+		{
+		case BCC: case BCS: case BEQ: case BMI: case BNE: case BPL: case BVC: case BVS:
+		case BRK: case JMP: case JSR: case RTI: case RTS:
+			return true;
+		}
+		return false;
 	}
 
-	FORCEINLINE uint8 CalcZeroFlag(uint16 v)
+	// Returns true if the instruction cannot have side effects on other components: it may only write to
+	// internal RAM, and only read from internal RAM or cartridge. Instructions with indirect operands
+	// can access any address, so they are never part of a block.
+	bool CanExecuteInBlock(OpCodeName::Type opCodeName, AddressMode::Type addrMode, uint16 rawOperand)
 	{
-		// Check that lower 8 bits are all 0
-		return (v & 0x00FF) == 0;
-	}
+		const bool writesMemory = IsMemoryWriteInstruction(opCodeName);
 
-	FORCEINLINE uint8 CalcZeroFlag(uint8 v)
-	{
-		return v == 0;
-	}
+		auto IsSafeRange = [writesMemory] (uint32 firstAddress, uint32 lastAddress) -> bool
+		{
+			if (lastAddress < CpuMemory::kPpuRegistersBase)
+				return true;
 
-	FORCEINLINE uint8 CalcCarryFlag(uint16 v)
-	{
-		// Check if upper 8 bits are non-zero to know if a carry occured
-		return (v & 0xFF00) != 0;
-	}
+			// Reads that wrap past $FFFF end up in internal RAM, which is fine
+			return !writesMemory && firstAddress >= CpuMemory::kExpansionRomBase;
+		};
 
-	// Force link time error: need 16 bit to compute carry
-	FORCEINLINE uint8 CalcCarryFlag(uint8 v);
+		switch (addrMode)
+		{
+		case AddressMode::Immedt:
+		case AddressMode::Implid:
+		case AddressMode::Accumu:
+		case AddressMode::Relatv:
+		case AddressMode::ZeroPg:
+		case AddressMode::ZPIdxX:
+		case AddressMode::ZPIdxY:
+			return true;
+
+		case AddressMode::Absolu:
+			if (opCodeName == OpCodeName::JMP || opCodeName == OpCodeName::JSR)
+				return true;
+			return IsSafeRange(rawOperand, rawOperand);
+
+		case AddressMode::AbIdxX:
+		case AddressMode::AbIdxY:
+			return IsSafeRange(rawOperand, rawOperand + 0xFF);
+
+		case AddressMode::Indrct: // Reads target address from same page
+			return IsSafeRange(rawOperand & 0xFF00, rawOperand | 0x00FF);
+		}
 
-	FORCEINLINE uint8 CalcOverflowFlag(uint8 a, uint8 b, uint16 r)
-	{
-		// With r = a + b, overflow occurs if both a and b are negative and r is positive,
-		// or both a and b are positive and r is negative. Looking at sign bits of a, b, r,
-		// overflow occurs when 0 0 1 or 1 1 0, so we can use simple xor logic to figure it out.
-		return ((uint16)a ^ r) & ((uint16)b ^ r) & 0x0080;
+		return false;
 	}
 
-	// Force link time error: need 16 bit result to compute overflow
-	FORCEINLINE uint8 CalcOverflowFlag(uint8 a, uint8 b, uint8 r);
+	FORCEINLINE uint16 GetPageAddress(uint16 address)
+	{
+		return (address & 0xFF00);
+	}
 }
 
 Cpu::Cpu()
 	: m_cpuMemoryBus(nullptr)
+	, m_cartridge(nullptr)
 	, m_opCodeEntry(nullptr)
 {
 }
 
-void Cpu::Initialize(CpuMemoryBus& cpuMemoryBus)
+void Cpu::Initialize(CpuMemoryBus& cpuMemoryBus, Cartridge& cartridge)
 {
 	m_cpuMemoryBus = &cpuMemoryBus;
+	m_cartridge = &cartridge;
 	m_controllerPorts.Initialize();
+
+#if CONFIG_DEBUG
+	// Make sure handler table matches opcode table
+	for (size_t opCode = 0; opCode < ARRAYSIZE(kOpCodeHandlerTable); ++opCode)
+	{
+		const OpCodeEntry* entry = g_opCodeTable[opCode];
+		const OpCodeHandlerEntry& handlerEntry = kOpCodeHandlerTable[opCode];
+
+		if (entry == nullptr)
+		{
+			assert(handlerEntry.handler == &Cpu::ExecuteUnknownOpCode);
+			continue;
+		}
+
+		assert(handlerEntry.opCodeName == entry->opCodeName);
+		assert(handlerEntry.addrMode == entry->addrMode);
+		assert(handlerEntry.numBytes == entry->numBytes);
+		assert(handlerEntry.numCycles == entry->numCycles);
+		assert(handlerEntry.pageCrossCycles == entry->pageCrossCycles);
+	}
+#endif
 }
 
 void Cpu::Reset()
@@ -80,8 +142,7 @@ void Cpu::Reset()
 	A = X = Y = 0;
 	SP = 0xFF; // Should be FD, but for improved compatibility set to FF
 	
-	P.ClearAll();
-	P.Set(StatusFlag::IrqDisabled);
+	SetProcessorStatus(StatusFlag::IrqDisabled);
 
 	// Entry point is located at the Reset interrupt location
 	PC = Read16(CpuMemory::kResetVector);
@@ -89,10 +150,67 @@ void Cpu::Reset()
 	m_cycles = 0;
 	m_totalCycles = 0;	 
 	m_pendingNmi = m_pendingIrq = false;
+	m_idleLoopCandidate = false;
+	m_spriteDmaStarted = false;
+
+	// Cartridge may have changed
+	m_prgDecodeCache.clear();
+	m_prgBlockCache.clear();
+	for (auto& instruction : m_ramDecodeCache)
+	{
+		instruction.handler = nullptr;
+	}
 
 	m_controllerPorts.Reset();
 }
 
+void Cpu::Serialize(StateSerializer& serializer)
+{
+	serializer.Value(PC);
+	serializer.Value(SP);
+	serializer.Value(A);
+	serializer.Value(X);
+	serializer.Value(Y);
+	serializer.Value(P);
+
+	serializer.Value(m_negativeFlagResult);
+	serializer.Value(m_zeroFlagResult);
+	serializer.Value(m_carryFlagResult);
+	serializer.Value(m_overflowFlagA);
+	serializer.Value(m_overflowFlagB);
+	serializer.Value(m_overflowFlagResult);
+
+	serializer.Value(m_cycles);
+	serializer.Value(m_totalCycles);
+	serializer.Value(m_pendingNmi);
+	serializer.Value(m_pendingIrq);
+	serializer.Value(m_idleLoopCandidate);
+	serializer.Value(m_rawOperand);
+	serializer.Value(m_operandAddress);
+	serializer.Value(m_operandReadCrossedPage);
+	serializer.Value(m_spriteDmaRegister);
+	serializer.Value(m_spriteDmaStarted);
+
+	m_controllerPorts.Serialize(serializer);
+
+	if (serializer.IsLoading())
+	{
+		m_opCodeEntry = nullptr; // Set again by the next instruction executed
+
+		// Internal RAM was replaced. PRG-ROM decode and block caches are per physical bank, so they remain valid.
+		for (auto& instruction : m_ramDecodeCache)
+		{
+			instruction.handler = nullptr;
+		}
+
+		if (m_cartridge->CanWritePrgMemory())
+		{
+			m_prgDecodeCache.clear();
+			m_prgBlockCache.clear();
+		}
+	}
+}
+
 void Cpu::Nmi()
 {
 	assert(!m_pendingNmi && "Interrupt already pending");
@@ -115,18 +233,23 @@ void Cpu::Execute(uint32& cpuCyclesElapsed)
 	
 	m_cycles = 0;
 
-	const uint8 opCode = Read8(PC);
-	m_opCodeEntry = g_opCodeTable[opCode];
+	const DecodedInstruction& instruction = FetchInstruction();
+
+#if DEBUGGING_ENABLED
+	m_opCodeEntry = g_opCodeTable[Read8(PC)];
+#endif
+
+	m_rawOperand = instruction.rawOperand;
+	(this->*instruction.handler)(); // Calls Debugger::PreCpuInstruction
 
-	if (m_opCodeEntry == nullptr)
+	// Sprite DMA waits 1 cycle for the write to complete, 1 more if it would start on an odd cycle,
+	// then takes 512 cycles of alternating reads and writes.
+	if (m_spriteDmaStarted)
 	{
-		FAIL("Unknown opcode");
+		m_spriteDmaStarted = false;
+		m_cycles += 513 + ((m_totalCycles + m_cycles) & 1);
 	}
 
-	UpdateOperandAddress();
-
-	Debugger::PreCpuInstruction();
-	ExecuteInstruction();
 	ExecutePendingInterrupts(); // Handle when instruction (memory read) causes interrupt
 	Debugger::PostCpuInstruction();		
 
@@ -134,6 +257,131 @@ void Cpu::Execute(uint32& cpuCyclesElapsed)
 	m_totalCycles += m_cycles;
 }
 
+void Cpu::ExecuteBlock(uint32 maxCpuCycles, uint32& cpuCyclesElapsed)
+{
+	ExecutePendingInterrupts();
+
+	const InstructionBlock* block = FetchInstructionBlock();
+	if (block == nullptr)
+	{
+		Execute(cpuCyclesElapsed);
+		return;
+	}
+
+	m_cycles = 0;
+
+	for (auto iter = block->instructions.begin(); iter != block->instructions.end(); ++iter)
+	{
+#if DEBUGGING_ENABLED
+		m_opCodeEntry = g_opCodeTable[Read8(PC)];
+#endif
+
+		m_rawOperand = iter->rawOperand;
+		(this->*iter->handler)(); // Calls Debugger::PreCpuInstruction
+		Debugger::PostCpuInstruction(); // Per instruction so traces and breakpoints see every instruction of the block
+
+		if (m_cycles > maxCpuCycles || m_pendingNmi || m_pendingIrq)
+			break;
+	}
+
+	cpuCyclesElapsed = m_cycles;
+	m_totalCycles += m_cycles;
+}
+
+bool Cpu::IsInIdleLoop(uint32& loopCpuCycles)
+{
+	using namespace OpCodeName;
+
+	if (!m_idleLoopCandidate)
+		return false;
+
+	m_idleLoopCandidate = false;
+
+	// Interrupt will be executed before the next iteration
+	if (m_pendingNmi || m_pendingIrq)
+		return false;
+
+	// Only look at code we can read without side effects (at most 5 bytes: load and branch)
+	const bool isCodeInRam = PC < CpuMemory::kInternalRamEnd - 4;
+	const bool isCodeInPrg = PC >= CpuMemory::kPrgRomBase && PC <= 0xFFFF - 4;
+	if (!isCodeInRam && !isCodeInPrg)
+		return false;
+
+	const OpCodeHandlerEntry& entry = kOpCodeHandlerTable[Read8(PC)];
+
+	// JMP to itself
+	if (entry.opCodeName == JMP && entry.addrMode == AddressMode::Absolu)
+	{
+		if (Read16(PC + 1) != PC)
+			return false;
+
+		loopCpuCycles = entry.numCycles;
+		return true;
+	}
+
+	// Load followed by branch back to the load
+	if (entry.opCodeName != LDA && entry.opCodeName != LDX && entry.opCodeName != LDY && entry.opCodeName != BIT)
+		return false;
+
+	uint16 address = 0;
+	switch (entry.addrMode)
+	{
+	case AddressMode::ZeroPg: address = TO16(Read8(PC + 1)); break;
+	case AddressMode::Absolu: address = Read16(PC + 1); break;
+	default: return false;
+	}
+
+	const uint16 branchPC = PC + entry.numBytes;
+	const OpCodeHandlerEntry& branchEntry = kOpCodeHandlerTable[Read8(branchPC)];
+	if (branchEntry.addrMode != AddressMode::Relatv)
+		return false;
+
+	const int8 offset = Read8(branchPC + 1); // Signed offset in [-128,127]
+	if (TO16(branchPC + branchEntry.numBytes + offset) != PC)
+		return false;
+
+	uint8 value;
+	if (!m_cpuMemoryBus->Peek(address, value))
+		return false;
+
+	// The load must leave registers and flags unchanged (i.e. same value as last iteration)
+	bool unchanged = false;
+	switch (entry.opCodeName)
+	{
+	case LDA: unchanged = (A == value); break;
+	case LDX: unchanged = (X == value); break;
+	case LDY: unchanged = (Y == value); break;
+	}
+
+	if (entry.opCodeName == BIT)
+	{
+		const uint8 overflowFlagResult = (value & StatusFlag::Overflow)? 0x80 : 0;
+		unchanged = m_negativeFlagResult == value && m_zeroFlagResult == (A & value)
+			&& m_overflowFlagA == 0 && m_overflowFlagB == 0 && m_overflowFlagResult == overflowFlagResult;
+	}
+	else
+	{
+		unchanged = unchanged && m_negativeFlagResult == value && m_zeroFlagResult == value;
+	}
+
+	if (!unchanged || !IsBranchTaken(branchEntry.opCodeName))
+		return false;
+
+	// Taken branch takes an extra cycle, and another if branching to a different page
+	loopCpuCycles = entry.numCycles + branchEntry.numCycles + 1;
+	if (GetPageAddress(branchPC) != GetPageAddress(PC))
+	{
+		++loopCpuCycles;
+	}
+	return true;
+}
+
+void Cpu::SkipIdleLoopIteration(uint32 loopCpuCycles)
+{
+	m_totalCycles += loopCpuCycles;
+	m_idleLoopCandidate = true; // Still at the start of the loop
+}
+
 uint8 Cpu::HandleCpuRead(uint16 cpuAddress)
 {
 	switch (cpuAddress)
@@ -158,25 +406,16 @@ void Cpu::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 	case CpuMemory::kSpriteDmaReg: // $4014
 		{
 			// Initiate a DMA transfer from the input page to sprite ram.
-
-			static auto SpriteDmaTransfer = [&] (uint16 cpuAddress)
-			{
-				for (uint16 i = 0; i < 256; ++i) //@TODO: Use constant for 256 (kSpriteMemorySize?)
-				{
-					const uint8 value = m_cpuMemoryBus->Read(cpuAddress + i);
-					m_cpuMemoryBus->Write(CpuMemory::kPpuSprRamIoReg, value);
-				}
-
-				// While DMA transfer occurs, the memory bus is in use, preventing CPU from fetching memory
-				m_cycles += 512;
-			};
-
 			m_spriteDmaRegister = value;
 			const uint16 srcCpuAddress = m_spriteDmaRegister * 0x100;
 
 			// Note: we perform the full DMA transfer right here instead of emulating the transfers over multiple frames.
 			// If we need to do it right, see http://wiki.nesdev.com/w/index.php/PPU_programmer_reference#DMA
-			SpriteDmaTransfer(srcCpuAddress);
+			m_cpuMemoryBus->SpriteDmaTransfer(srcCpuAddress);
+
+			// While DMA transfer occurs, the memory bus is in use, preventing CPU from fetching memory.
+			// The stall depends on the cycle the instruction ends on, so it's added once it completes (see Execute).
+			m_spriteDmaStarted = true;
 
 			return;
 		}
@@ -193,6 +432,187 @@ void Cpu::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 	}
 }
 
+void Cpu::InvalidateDecodedInstructions(uint16 cpuAddress)
+{
+	// Invalidate any instruction that may include this address, which includes
+	// the ones starting up to 2 bytes before it.
+	DecodedInstruction* instructions = nullptr;
+	size_t offset = 0;
+
+	if (cpuAddress >= CpuMemory::kPrgRomBase)
+	{
+		const size_t bankIndex = m_cartridge->GetPrgBankIndex4k(cpuAddress);
+
+		// Blocks may span the whole bank, so just drop them all
+		if (bankIndex < m_prgBlockCache.size())
+		{
+			m_prgBlockCache[bankIndex].clear();
+		}
+
+		if (bankIndex >= m_prgDecodeCache.size() || m_prgDecodeCache[bankIndex].empty())
+			return;
+
+		instructions = &m_prgDecodeCache[bankIndex][0];
+		offset = cpuAddress & (kPrgBankSize - 1);
+	}
+	else if (cpuAddress < CpuMemory::kInternalRamEnd)
+	{
+		instructions = &m_ramDecodeCache[0];
+		offset = cpuAddress % CpuMemory::kInternalRamSize;
+	}
+	else
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < 3 && i <= offset; ++i)
+	{
+		instructions[offset - i].handler = nullptr;
+	}
+}
+
+FORCEINLINE const Cpu::DecodedInstruction& Cpu::FetchInstruction()
+{
+	// Cached instructions must be entirely contained in the bank, so we skip
+	// the last 2 bytes rather than decoding to find out the instruction size.
+	if (PC >= CpuMemory::kPrgRomBase)
+	{
+		const size_t offset = PC & (kPrgBankSize - 1);
+		if (offset < kPrgBankSize - 2)
+		{
+			const size_t bankIndex = m_cartridge->GetPrgBankIndex4k(PC);
+			if (bankIndex >= m_prgDecodeCache.size())
+			{
+				m_prgDecodeCache.resize(bankIndex + 1);
+			}
+
+			DecodedInstructionBank& bank = m_prgDecodeCache[bankIndex];
+			if (bank.empty())
+			{
+				DecodedInstruction emptyInstruction = {};
+				bank.resize(kPrgBankSize, emptyInstruction);
+			}
+
+			DecodedInstruction& instruction = bank[offset];
+			if (instruction.handler == nullptr)
+			{
+				DecodeInstruction(PC, instruction);
+			}
+			return instruction;
+		}
+	}
+	else if (PC < CpuMemory::kInternalRamEnd)
+	{
+		const size_t offset = PC % CpuMemory::kInternalRamSize;
+		if (offset < CpuMemory::kInternalRamSize - 2)
+		{
+			DecodedInstruction& instruction = m_ramDecodeCache[offset];
+			if (instruction.handler == nullptr)
+			{
+				DecodeInstruction(PC, instruction);
+			}
+			return instruction;
+		}
+	}
+
+	// Not cacheable (e.g. executing from save RAM)
+	DecodeInstruction(PC, m_uncachedInstruction);
+	return m_uncachedInstruction;
+}
+
+void Cpu::DecodeInstruction(uint16 address, DecodedInstruction& instruction) const
+{
+	const OpCodeHandlerEntry& handlerEntry = kOpCodeHandlerTable[Read8(address)];
+
+	instruction.handler = handlerEntry.handler;
+	instruction.numBytes = handlerEntry.numBytes;
+	instruction.numCycles = handlerEntry.numCycles;
+
+	switch (handlerEntry.numBytes)
+	{
+	case 2: instruction.rawOperand = TO16(Read8(address + 1)); break;
+	case 3: instruction.rawOperand = Read16(address + 1); break;
+	default: instruction.rawOperand = 0; break;
+	}
+}
+
+const Cpu::InstructionBlock* Cpu::FetchInstructionBlock()
+{
+	if (PC < CpuMemory::kPrgRomBase)
+		return nullptr;
+
+	const size_t bankIndex = m_cartridge->GetPrgBankIndex4k(PC);
+	if (bankIndex >= m_prgBlockCache.size())
+	{
+		m_prgBlockCache.resize(bankIndex + 1);
+	}
+
+	InstructionBlockBank& bank = m_prgBlockCache[bankIndex];
+	if (bank.empty())
+	{
+		bank.resize(kPrgBankSize);
+	}
+
+	InstructionBlock& block = bank[PC & (kPrgBankSize - 1)];
+	if (!block.translated)
+	{
+		TranslateInstructionBlock(block);
+	}
+
+	return block.instructions.empty()? nullptr : &block;
+}
+
+void Cpu::TranslateInstructionBlock(InstructionBlock& block) const
+{
+	assert(PC >= CpuMemory::kPrgRomBase);
+
+	block.translated = true;
+	block.instructions.clear();
+
+	uint16 address = PC;
+
+	// Like the decode cache, stop before instructions that may straddle the bank boundary
+	while ((address & (kPrgBankSize - 1)) < kPrgBankSize - 2)
+	{
+		const OpCodeHandlerEntry& handlerEntry = kOpCodeHandlerTable[Read8(address)];
+
+		if (handlerEntry.handler == &Cpu::ExecuteUnknownOpCode)
+			break;
+
+		DecodedInstruction instruction;
+		DecodeInstruction(address, instruction);
+
+		if (!CanExecuteInBlock(handlerEntry.opCodeName, handlerEntry.addrMode, instruction.rawOperand))
+			break;
+
+		block.instructions.push_back(instruction);
+
+		if (EndsBlock(handlerEntry.opCodeName))
+			break;
+
+		address += instruction.numBytes;
+	}
+}
+
+uint8 Cpu::GetProcessorStatus() const
+{
+	uint8 result = P.Value();
+	result |= TestNegativeFlag()? StatusFlag::Negative : 0;
+	result |= TestZeroFlag()? StatusFlag::Zero : 0;
+	result |= TestCarryFlag01()? StatusFlag::Carry : 0;
+	result |= TestOverflowFlag()? StatusFlag::Overflow : 0;
+	return result;
+}
+
+void Cpu::SetProcessorStatus(uint8 value)
+{
+	P.SetValue(value & ~(StatusFlag::Negative | StatusFlag::Zero | StatusFlag::Carry | StatusFlag::Overflow));
+	m_negativeFlagResult = value;
+	m_zeroFlagResult = (value & StatusFlag::Zero)? 0 : 1;
+	SetCarryFlagResult(TO16(value & StatusFlag::Carry) << 8);
+	SetOverflowFlag((value & StatusFlag::Overflow) != 0);
+}
+
 uint8 Cpu::Read8(uint16 address) const
 {
 	return m_cpuMemoryBus->Read(address);
@@ -208,7 +628,8 @@ void Cpu::Write8(uint16 address, uint8 value)
 	m_cpuMemoryBus->Write(address, value);
 }
 
-void Cpu::UpdateOperandAddress()
+template <AddressMode::Type addrMode>
+FORCEINLINE void Cpu::UpdateOperandAddress()
 {
 #if CONFIG_DEBUG
 	m_operandAddress = 0; // Reset to help find bugs
@@ -216,7 +637,7 @@ void Cpu::UpdateOperandAddress()
 
 	m_operandReadCrossedPage = false;
 
-	switch (m_opCodeEntry->addrMode)
+	switch (addrMode)
 	{
 	case AddressMode::Immedt:
 		m_operandAddress = PC + 1; // Set to address of immediate value in code segment
@@ -233,30 +654,30 @@ void Cpu::UpdateOperandAddress()
 			//@OPT: Lazily compute if branch condition succeeds
 
 			// For branch instructions, resolve the target address
-			const int8 offset = Read8(PC+1); // Signed offset in [-128,127]
-			m_operandAddress = PC + m_opCodeEntry->numBytes + offset;
+			const int8 offset = TO8(m_rawOperand); // Signed offset in [-128,127]
+			m_operandAddress = PC + InstructionSize<addrMode>::Result + offset;
 		}
 		break;
 
 	case AddressMode::ZeroPg:
-		m_operandAddress = TO16(Read8(PC+1));
+		m_operandAddress = m_rawOperand;
 		break;
 
 	case AddressMode::ZPIdxX:
-		m_operandAddress = TO16((Read8(PC+1) + X)) & 0x00FF; // Wrap around zero-page boundary
+		m_operandAddress = TO16((m_rawOperand + X)) & 0x00FF; // Wrap around zero-page boundary
 		break;
 
 	case AddressMode::ZPIdxY:
-		m_operandAddress = TO16((Read8(PC+1) + Y)) & 0x00FF; // Wrap around zero-page boundary
+		m_operandAddress = TO16((m_rawOperand + Y)) & 0x00FF; // Wrap around zero-page boundary
 		break;
 
 	case AddressMode::Absolu:
-		m_operandAddress = Read16(PC+1);
+		m_operandAddress = m_rawOperand;
 		break;
 
 	case AddressMode::AbIdxX:
 		{
-			const uint16 baseAddress = Read16(PC+1);
+			const uint16 baseAddress = m_rawOperand;
 			const uint16 basePage = GetPageAddress(baseAddress);
 			m_operandAddress = baseAddress + X;
 			m_operandReadCrossedPage = basePage != GetPageAddress(m_operandAddress);
@@ -265,7 +686,7 @@ void Cpu::UpdateOperandAddress()
 
 	case AddressMode::AbIdxY:
 		{
-			const uint16 baseAddress = Read16(PC+1);
+			const uint16 baseAddress = m_rawOperand;
 			const uint16 basePage = GetPageAddress(baseAddress);
 			m_operandAddress = baseAddress + Y;
 			m_operandReadCrossedPage = basePage != GetPageAddress(m_operandAddress);
@@ -274,7 +695,7 @@ void Cpu::UpdateOperandAddress()
 
 	case AddressMode::Indrct: // for JMP only
 		{
-			uint16 low = Read16(PC+1);
+			uint16 low = m_rawOperand;
 
 			// Handle the 6502 bug for when the low-byte of the effective address is FF,
 			// in which case the 2nd byte read does not correctly cross page boundaries.
@@ -287,7 +708,7 @@ void Cpu::UpdateOperandAddress()
 
 	case AddressMode::IdxInd:
 		{
-			uint16 low = TO16((Read8(PC+1) + X)) & 0x00FF; // Zero page low byte of operand address, wrap around zero page
+			uint16 low = TO16((m_rawOperand + X)) & 0x00FF; // Zero page low byte of operand address, wrap around zero page
 			uint16 high = TO16(low + 1) & 0x00FF; // Wrap high byte around zero page
 			m_operandAddress = TO16(Read8(low)) | TO16(Read8(high)) << 8;
 		}
@@ -295,7 +716,7 @@ void Cpu::UpdateOperandAddress()
 
 	case AddressMode::IndIdx:
 		{
-			const uint16 low = TO16(Read8(PC+1)); // Zero page low byte of operand address
+			const uint16 low = m_rawOperand; // Zero page low byte of operand address
 			const uint16 high = TO16(low + 1) & 0x00FF; // Wrap high byte around zero page
 			const uint16 baseAddress = (TO16(Read8(low)) | TO16(Read8(high)) << 8);
 			const uint16 basePage = GetPageAddress(baseAddress);
@@ -310,100 +731,105 @@ void Cpu::UpdateOperandAddress()
 	}
 }
 
-void Cpu::ExecuteInstruction()
+template <OpCodeName::Type opCodeName, AddressMode::Type addrMode, uint8 numCycles, uint8 pageCrossCycles>
+void Cpu::ExecuteOpCode()
 {
 	using namespace OpCodeName;
 	using namespace StatusFlag;
 
+	UpdateOperandAddress<addrMode>();
+
+	Debugger::PreCpuInstruction();
+
 	// By default, next instruction is after current, but can also be changed by a branch or jump
-	uint16 nextPC = PC + m_opCodeEntry->numBytes;
+	uint16 nextPC = PC + InstructionSize<addrMode>::Result;
 	
 	bool branchTaken = false;
 
-	switch (m_opCodeEntry->opCodeName)
+	// Switch on template parameter is resolved at compile time
+	switch (opCodeName)
 	{
 	case ADC: // Add memory to accumulator with carry
 		{
 			// Operation:  A + M + C -> A, C
-			const uint8 value = GetMemValue();
-			const uint16 result = TO16(A) + TO16(value) + TO16(P.Test01(Carry));
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			P.Set(Carry, CalcCarryFlag(result));
-			P.Set(Overflow, CalcOverflowFlag(A, value, result));
+			const uint8 value = GetMemValue<addrMode>();
+			const uint16 result = TO16(A) + TO16(value) + TO16(TestCarryFlag01());
+			SetNegativeAndZeroFlags(TO8(result));
+			SetCarryFlagResult(result);
+			SetOverflowFlagOperands(A, value, TO8(result));
 			A = TO8(result);
 		}
 		break;
 
 	case AND: // "AND" memory with accumulator
-		A &= GetMemValue();
-		P.Set(Negative, CalcNegativeFlag(A));
-		P.Set(Zero, CalcZeroFlag(A));
+		A &= GetMemValue<addrMode>();
+		SetNegativeAndZeroFlags(A);
 		break;
 
 	case ASL: // Shift Left One Bit (Memory or Accumulator)
 		{
-			const uint16 result = TO16(GetAccumOrMemValue()) << 1;
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			P.Set(Carry, CalcCarryFlag(result));
-			SetAccumOrMemValue(TO8(result));
+			const uint16 result = TO16(GetAccumOrMemValue<addrMode>()) << 1;
+			SetNegativeAndZeroFlags(TO8(result));
+			SetCarryFlagResult(result);
+			SetAccumOrMemValue<addrMode>(TO8(result));
 		}
 		break;
 
 	case BCC: // Branch on Carry Clear
-		if (!P.Test(Carry))
+		if (!TestCarryFlag01())
 		{
-			nextPC = GetBranchOrJmpLocation();
+			nextPC = GetBranchOrJmpLocation<addrMode>();
 			branchTaken = true;
 		}
 		break;
 
 	case BCS: // Branch on Carry Set
-		if (P.Test(Carry))
+		if (TestCarryFlag01())
 		{
-			nextPC = GetBranchOrJmpLocation();
+			nextPC = GetBranchOrJmpLocation<addrMode>();
 			branchTaken = true;
 		}
 		break;
 
 	case BEQ: // Branch on result zero (equal means compare difference is 0)
-		if (P.Test(Zero))
+		if (TestZeroFlag())
 		{
-			nextPC = GetBranchOrJmpLocation();
+			nextPC = GetBranchOrJmpLocation<addrMode>();
 			branchTaken = true;
 		}
 		break;
 
 	case BIT: // Test bits in memory with accumulator
 		{
-			uint8 memValue = GetMemValue();
-			uint8 result = A & GetMemValue();
-			P.SetValue( (P.Value() & 0x3F) | (memValue & 0xC0) ); // Copy bits 6 and 7 of mem value to status register
-			P.Set(Zero, CalcZeroFlag(result));
+			uint8 memValue = GetMemValue<addrMode>();
+			uint8 result = A & GetMemValue<addrMode>();
+			// Copy bits 6 and 7 of mem value to status register
+			m_negativeFlagResult = memValue;
+			SetOverflowFlag((memValue & Overflow) != 0);
+			m_zeroFlagResult = result;
 		}
 		break;
 
 	case BMI: // Branch on result minus
-		if (P.Test(Negative))
+		if (TestNegativeFlag())
 		{
-			nextPC = GetBranchOrJmpLocation();
+			nextPC = GetBranchOrJmpLocation<addrMode>();
 			branchTaken = true;
 		}
 		break;
 
 	case BNE:  // Branch on result non-zero
-		if (!P.Test(Zero))
+		if (!TestZeroFlag())
 		{
-			nextPC = GetBranchOrJmpLocation();
+			nextPC = GetBranchOrJmpLocation<addrMode>();
 			branchTaken = true;
 		}
 		break;
 
 	case BPL: // Branch on result plus
-		if (!P.Test(Negative))
+		if (!TestNegativeFlag())
 		{
-			nextPC = GetBranchOrJmpLocation();
+			nextPC = GetBranchOrJmpLocation<addrMode>();
 			branchTaken = true;
 		}
 		break;
@@ -422,23 +848,23 @@ void Cpu::ExecuteInstruction()
 		break;
 
 	case BVC: // Branch on Overflow Clear
-		if (!P.Test(Overflow))
+		if (!TestOverflowFlag())
 		{
-			nextPC = GetBranchOrJmpLocation();
+			nextPC = GetBranchOrJmpLocation<addrMode>();
 			branchTaken = true;
 		}
 		break;
 
 	case BVS: // Branch on Overflow Set
-		if (P.Test(Overflow))
+		if (TestOverflowFlag())
 		{
-			nextPC = GetBranchOrJmpLocation();
+			nextPC = GetBranchOrJmpLocation<addrMode>();
 			branchTaken = true;
 		}
 		break;
 
 	case CLC: // CLC Clear carry flag
-		P.Clear(Carry);
+		SetCarryFlagResult(0);
 		break;
 
 	case CLD: // CLD Clear decimal mode
@@ -450,127 +876,113 @@ void Cpu::ExecuteInstruction()
 		break;
 
 	case CLV: // CLV Clear overflow flag
-		P.Clear(Overflow);
+		SetOverflowFlag(false);
 		break;
 
 	case CMP: // CMP Compare memory and accumulator
 		{
-			const uint8 memValue = GetMemValue();
-			const uint8 result = A - memValue;
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			P.Set(Carry, A >= memValue); // Carry set if result positive or 0
+			const uint8 memValue = GetMemValue<addrMode>();
+			const uint16 result = TO16(A) + TO16(memValue ^ 0xFF) + 1; // A - memValue
+			SetNegativeAndZeroFlags(TO8(result));
+			SetCarryFlagResult(result); // Carry set if result positive or 0 (A >= memValue)
 		}
 		break;
 
 	case CPX: // CPX Compare Memory and Index X
 		{
-			const uint8 memValue = GetMemValue();
-			const uint8 result = X - memValue;
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			P.Set(Carry, X >= memValue); // Carry set if result positive or 0
+			const uint8 memValue = GetMemValue<addrMode>();
+			const uint16 result = TO16(X) + TO16(memValue ^ 0xFF) + 1; // X - memValue
+			SetNegativeAndZeroFlags(TO8(result));
+			SetCarryFlagResult(result); // Carry set if result positive or 0 (X >= memValue)
 		}
 		break;
 
 	case CPY: // CPY Compare memory and index Y
 		{
-			const uint8 memValue = GetMemValue();
-			const uint8 result = Y - memValue;
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			P.Set(Carry, Y >= memValue); // Carry set if result positive or 0
+			const uint8 memValue = GetMemValue<addrMode>();
+			const uint16 result = TO16(Y) + TO16(memValue ^ 0xFF) + 1; // Y - memValue
+			SetNegativeAndZeroFlags(TO8(result));
+			SetCarryFlagResult(result); // Carry set if result positive or 0 (Y >= memValue)
 		}
 		break;
 
 	case DEC: // Decrement memory by one
 		{
-			const uint8 result = GetMemValue() - 1;
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			SetMemValue(result);
+			const uint8 result = GetMemValue<addrMode>() - 1;
+			SetNegativeAndZeroFlags(result);
+			SetMemValue<addrMode>(result);
 		}
 		break;
 
 	case DEX: // Decrement index X by one
 		--X;
-		P.Set(Negative, CalcNegativeFlag(X));
-		P.Set(Zero, CalcZeroFlag(X));
+		SetNegativeAndZeroFlags(X);
 		break;
 
 	case DEY: // Decrement index Y by one
 		--Y;
-		P.Set(Negative, CalcNegativeFlag(Y));
-		P.Set(Zero, CalcZeroFlag(Y));
+		SetNegativeAndZeroFlags(Y);
 		break;
 
 	case EOR: // "Exclusive-Or" memory with accumulator
-		A = A ^ GetMemValue();
-		P.Set(Negative, CalcNegativeFlag(A));
-		P.Set(Zero, CalcZeroFlag(A));
+		A = A ^ GetMemValue<addrMode>();
+		SetNegativeAndZeroFlags(A);
 		break;
 
 	case INC: // Increment memory by one
 		{
-			const uint8 result = GetMemValue() + 1;
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			SetMemValue(result);
+			const uint8 result = GetMemValue<addrMode>() + 1;
+			SetNegativeAndZeroFlags(result);
+			SetMemValue<addrMode>(result);
 		}
 		break;
 
 	case INX: // Increment Index X by one
 		++X;
-		P.Set(Negative, CalcNegativeFlag(X));
-		P.Set(Zero, CalcZeroFlag(X));
+		SetNegativeAndZeroFlags(X);
 		break;
 
 	case INY: // Increment Index Y by one
 		++Y;
-		P.Set(Negative, CalcNegativeFlag(Y));
-		P.Set(Zero, CalcZeroFlag(Y));
+		SetNegativeAndZeroFlags(Y);
 		break;
 
 	case JMP: // Jump to new location
-		nextPC = GetBranchOrJmpLocation();
+		nextPC = GetBranchOrJmpLocation<addrMode>();
 		break;
 
 	case JSR: // Jump to subroutine (used with RTS)
 		{
 			// JSR actually pushes address of the next instruction - 1.
 			// RTS jumps to popped value + 1.
-			const uint16 returnAddr = PC + m_opCodeEntry->numBytes - 1;
+			const uint16 returnAddr = PC + InstructionSize<addrMode>::Result - 1;
 			Push16(returnAddr);
-			nextPC = GetBranchOrJmpLocation();
+			nextPC = GetBranchOrJmpLocation<addrMode>();
 		}
 		break;
 
 	case LDA: // Load accumulator with memory
-		A = GetMemValue();
-		P.Set(Negative, CalcNegativeFlag(A));
-		P.Set(Zero, CalcZeroFlag(A));
+		A = GetMemValue<addrMode>();
+		SetNegativeAndZeroFlags(A);
 		break;
 
 	case LDX: // Load index X with memory
-		X = GetMemValue();
-		P.Set(Negative, CalcNegativeFlag(X));
-		P.Set(Zero, CalcZeroFlag(X));
+		X = GetMemValue<addrMode>();
+		SetNegativeAndZeroFlags(X);
 		break;
 
 	case LDY: // Load index Y with memory
-		Y = GetMemValue();
-		P.Set(Negative, CalcNegativeFlag(Y));
-		P.Set(Zero, CalcZeroFlag(Y));
+		Y = GetMemValue<addrMode>();
+		SetNegativeAndZeroFlags(Y);
 		break;
 
 	case LSR: // Shift right one bit (memory or accumulator)
 		{
-			const uint8 value = GetAccumOrMemValue();
+			const uint8 value = GetAccumOrMemValue<addrMode>();
 			const uint8 result = value >> 1;
-			P.Set(Carry, value & 0x01); // Will get shifted into carry
-			P.Set(Zero, CalcZeroFlag(result));
-			P.Clear(Negative); // 0 is shifted into sign bit position
-			SetAccumOrMemValue(result);
+			SetCarryFlagResult(TO16(value & 0x01) << 8); // Will get shifted into carry
+			SetNegativeAndZeroFlags(result); // 0 is shifted into sign bit position
+			SetAccumOrMemValue<addrMode>(result);
 		}		
 		break;
 
@@ -578,9 +990,8 @@ void Cpu::ExecuteInstruction()
 		break;
 
 	case ORA: // "OR" memory with accumulator
-		A |= GetMemValue();
-		P.Set(Negative, CalcNegativeFlag(A));
-		P.Set(Zero, CalcZeroFlag(A));
+		A |= GetMemValue<addrMode>();
+		SetNegativeAndZeroFlags(A);
 		break;
 
 	case PHA: // Push accumulator on stack
@@ -593,8 +1004,7 @@ void Cpu::ExecuteInstruction()
 
 	case PLA: // Pull accumulator from stack
 		A = Pop8();
-		P.Set(Negative, CalcNegativeFlag(A));
-		P.Set(Zero, CalcZeroFlag(A));
+		SetNegativeAndZeroFlags(A);
 		break;
 
 	case PLP: // Pull processor status from stack
@@ -603,22 +1013,20 @@ void Cpu::ExecuteInstruction()
 
 	case ROL: // Rotate one bit left (memory or accumulator)
 		{
-			const uint16 result = (TO16(GetAccumOrMemValue()) << 1) | TO16(P.Test01(Carry));
-			P.Set(Carry, CalcCarryFlag(result));
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			SetAccumOrMemValue(TO8(result));
+			const uint16 result = (TO16(GetAccumOrMemValue<addrMode>()) << 1) | TO16(TestCarryFlag01());
+			SetCarryFlagResult(result);
+			SetNegativeAndZeroFlags(TO8(result));
+			SetAccumOrMemValue<addrMode>(TO8(result));
 		}
 		break;
 
 	case ROR: // Rotate one bit right (memory or accumulator)
 		{
-			const uint8 value = GetAccumOrMemValue();
-			const uint8 result = (value >> 1) | (P.Test01(Carry) << 7);
-			P.Set(Carry, value & 0x01);
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			SetAccumOrMemValue(result);
+			const uint8 value = GetAccumOrMemValue<addrMode>();
+			const uint8 result = (value >> 1) | (TestCarryFlag01() << 7);
+			SetCarryFlagResult(TO16(value & 0x01) << 8);
+			SetNegativeAndZeroFlags(result);
+			SetAccumOrMemValue<addrMode>(result);
 		}
 		break;
 
@@ -641,19 +1049,18 @@ void Cpu::ExecuteInstruction()
 
 			// Can't simply negate mem value because that results in two's complement
 			// and we want to perform the bitwise add ourself
-			const uint8 value = GetMemValue() ^ 0XFF;
+			const uint8 value = GetMemValue<addrMode>() ^ 0XFF;
 
-			const uint16 result = TO16(A) + TO16(value) + TO16(P.Test01(Carry));
-			P.Set(Negative, CalcNegativeFlag(result));
-			P.Set(Zero, CalcZeroFlag(result));
-			P.Set(Carry, CalcCarryFlag(result));
-			P.Set(Overflow, CalcOverflowFlag(A, value, result));
+			const uint16 result = TO16(A) + TO16(value) + TO16(TestCarryFlag01());
+			SetNegativeAndZeroFlags(TO8(result));
+			SetCarryFlagResult(result);
+			SetOverflowFlagOperands(A, value, TO8(result));
 			A = TO8(result);
 		}
 		break;
 
 	case SEC: // Set carry flag
-		P.Set(Carry);
+		SetCarryFlagResult(0x100);
 		break;
 
 	case SED: // Set decimal mode
@@ -665,39 +1072,35 @@ void Cpu::ExecuteInstruction()
 		break;
 
 	case STA: // Store accumulator in memory
-		SetMemValue(A);
+		SetMemValue<addrMode>(A);
 		break;
 
 	case STX: // Store index X in memory
-		SetMemValue(X);
+		SetMemValue<addrMode>(X);
 		break;
 
 	case STY: // Store index Y in memory
-		SetMemValue(Y);
+		SetMemValue<addrMode>(Y);
 		break;
 
 	case TAX: // Transfer accumulator to index X
 		X = A;
-		P.Set(Negative, CalcNegativeFlag(X));
-		P.Set(Zero, CalcZeroFlag(X));
+		SetNegativeAndZeroFlags(X);
 		break;
 
 	case TAY: // Transfer accumulator to index Y
 		Y = A;
-		P.Set(Negative, CalcNegativeFlag(Y));
-		P.Set(Zero, CalcZeroFlag(Y));
+		SetNegativeAndZeroFlags(Y);
 		break;
 
 	case TSX: // Transfer stack pointer to index X
 		X = SP;
-		P.Set(Negative, CalcNegativeFlag(X));
-		P.Set(Zero, CalcZeroFlag(X));
+		SetNegativeAndZeroFlags(X);
 		break;
 
 	case TXA: // Transfer index X to accumulator
 		A = X;
-		P.Set(Negative, CalcNegativeFlag(A));
-		P.Set(Zero, CalcZeroFlag(A));
+		SetNegativeAndZeroFlags(A);
 		break;
 
 	case TXS: // Transfer index X to stack pointer
@@ -706,18 +1109,17 @@ void Cpu::ExecuteInstruction()
 
 	case TYA: // Transfer index Y to accumulator
 		A = Y;
-		P.Set(Negative, CalcNegativeFlag(A));
-		P.Set(Zero, CalcZeroFlag(A));
+		SetNegativeAndZeroFlags(A);
 		break;
 	}
 
 	// Compute cycles for instruction
 	{
-		uint16 cycles = m_opCodeEntry->numCycles;
+		uint16 cycles = numCycles;
 
 		// Some instructions take an extra cycle when reading operand across page boundary
-		if (m_operandReadCrossedPage)
-			cycles += m_opCodeEntry->pageCrossCycles;
+		if (pageCrossCycles > 0 && m_operandReadCrossedPage)
+			cycles += pageCrossCycles;
 
 		// Extra cycle when branch is taken
 		if (branchTaken)
@@ -734,10 +1136,35 @@ void Cpu::ExecuteInstruction()
 		m_cycles += cycles;
 	}
 
+	// A short backward branch or jump may close an idle loop (see IsInIdleLoop)
+	if ((addrMode == AddressMode::Relatv || (opCodeName == JMP && addrMode == AddressMode::Absolu)) && TO16(PC - nextPC) <= 3)
+	{
+		m_idleLoopCandidate = true;
+	}
+
 	// Move to next instruction
 	PC = nextPC;
 }
 
+bool Cpu::IsBranchTaken(OpCodeName::Type opCodeName) const
+{
+	using namespace OpCodeName;
+	switch (opCodeName)
+	{
+	case BCC: return !TestCarryFlag01();
+	case BCS: return TestCarryFlag01() != 0;
+	case BEQ: return TestZeroFlag();
+	case BMI: return TestNegativeFlag();
+	case BNE: return !TestZeroFlag();
+	case BPL: return !TestNegativeFlag();
+	case BVC: return !TestOverflowFlag();
+	case BVS: return TestOverflowFlag();
+	}
+
+	assert(false && "Not a branch instruction");
+	return false;
+}
+
 void Cpu::ExecutePendingInterrupts()
 {
 	if (m_pendingNmi)
@@ -748,6 +1175,7 @@ void Cpu::ExecutePendingInterrupts()
 		P.Set(StatusFlag::IrqDisabled);
 		PC = Read16(CpuMemory::kNmiVector);
 		m_pendingNmi = false;
+		m_idleLoopCandidate = false;
 	}
 	else if (m_pendingIrq)
 	{
@@ -757,25 +1185,28 @@ void Cpu::ExecutePendingInterrupts()
 		P.Set(StatusFlag::IrqDisabled);
 		PC = Read16(CpuMemory::kIrqVector);
 		m_pendingIrq = false;
+		m_idleLoopCandidate = false;
 	}
 }
 
-uint8 Cpu::GetAccumOrMemValue() const
+template <AddressMode::Type addrMode>
+FORCEINLINE uint8 Cpu::GetAccumOrMemValue() const
 {
-	assert(m_opCodeEntry->addrMode == AddressMode::Accumu || m_opCodeEntry->addrMode & AddressMode::MemoryValueOperand);
+	assert(addrMode == AddressMode::Accumu || addrMode & AddressMode::MemoryValueOperand);
 
-	if (m_opCodeEntry->addrMode == AddressMode::Accumu)
+	if (addrMode == AddressMode::Accumu)
 		return A;
 	
 	uint8 result = Read8(m_operandAddress);
 	return result;
 }
 
-void Cpu::SetAccumOrMemValue(uint8 value)
+template <AddressMode::Type addrMode>
+FORCEINLINE void Cpu::SetAccumOrMemValue(uint8 value)
 {
-	assert(m_opCodeEntry->addrMode == AddressMode::Accumu || m_opCodeEntry->addrMode & AddressMode::MemoryValueOperand);
+	assert(addrMode == AddressMode::Accumu || addrMode & AddressMode::MemoryValueOperand);
 
-	if (m_opCodeEntry->addrMode == AddressMode::Accumu)
+	if (addrMode == AddressMode::Accumu)
 	{
 		A = value;
 	}
@@ -785,22 +1216,30 @@ void Cpu::SetAccumOrMemValue(uint8 value)
 	}
 }
 
-uint8 Cpu::GetMemValue() const
+template <AddressMode::Type addrMode>
+FORCEINLINE uint8 Cpu::GetMemValue() const
 {
-	assert(m_opCodeEntry->addrMode & AddressMode::MemoryValueOperand);
+	assert(addrMode & AddressMode::MemoryValueOperand);
+
+	// Immediate value was already fetched with the instruction
+	if (addrMode == AddressMode::Immedt)
+		return TO8(m_rawOperand);
+
 	uint8 result = Read8(m_operandAddress);
 	return result;
 }
 
-void Cpu::SetMemValue(uint8 value)
+template <AddressMode::Type addrMode>
+FORCEINLINE void Cpu::SetMemValue(uint8 value)
 {
-	assert(m_opCodeEntry->addrMode & AddressMode::MemoryValueOperand);
+	assert(addrMode & AddressMode::MemoryValueOperand);
 	Write8(m_operandAddress, value);
 }
 
-uint16 Cpu::GetBranchOrJmpLocation() const
+template <AddressMode::Type addrMode>
+FORCEINLINE uint16 Cpu::GetBranchOrJmpLocation() const
 {
-	assert(m_opCodeEntry->addrMode & AddressMode::JmpOrBranchOperand);
+	assert(addrMode & AddressMode::JmpOrBranchOperand);
 	return m_operandAddress;
 }
 
@@ -846,11 +1285,287 @@ void Cpu::PushProcessorStatus(bool softwareInterrupt)
 {
 	assert(!P.Test(StatusFlag::Unused) && !P.Test(StatusFlag::BrkExecuted) && "P should never have these set, only on stack");
 	uint8 brkFlag = softwareInterrupt? StatusFlag::BrkExecuted : 0;
-	Push8(P.Value() | StatusFlag::Unused | brkFlag);
+	Push8(GetProcessorStatus() | StatusFlag::Unused | brkFlag);
 }
 
 void Cpu::PopProcessorStatus()
 {
-	P.SetValue(Pop8() & ~StatusFlag::Unused & ~StatusFlag::BrkExecuted);
+	SetProcessorStatus(Pop8() & ~StatusFlag::Unused & ~StatusFlag::BrkExecuted);
 	assert(!P.Test(StatusFlag::Unused) && !P.Test(StatusFlag::BrkExecuted) && "P should never have these set, only on stack");
 }
+
+void Cpu::ExecuteUnknownOpCode()
+{
+	FAIL("Unknown opcode");
+}
+
+#define OPCODE(name, mode, cycles, pageCrossCycles) \
+	{ &Cpu::ExecuteOpCode<OpCodeName::name, AddressMode::mode, cycles, pageCrossCycles>, OpCodeName::name, AddressMode::mode, \
+		InstructionSize<AddressMode::mode>::Result, cycles, pageCrossCycles }
+
+#define UNKNOWN_OPCODE \
+	{ &Cpu::ExecuteUnknownOpCode, OpCodeName::NumTypes, AddressMode::Implid, 1, 0, 0 }
+
+// Must match opcode table (see OpCodeTable.cpp), validated in Cpu::Initialize
+const Cpu::OpCodeHandlerEntry Cpu::kOpCodeHandlerTable[256] =
+{
+	/* 0x00 */ OPCODE(BRK, Implid, 7, 0),
+	/* 0x01 */ OPCODE(ORA, IdxInd, 6, 0),
+	/* 0x02 */ UNKNOWN_OPCODE,
+	/* 0x03 */ UNKNOWN_OPCODE,
+	/* 0x04 */ UNKNOWN_OPCODE,
+	/* 0x05 */ OPCODE(ORA, ZeroPg, 3, 0),
+	/* 0x06 */ OPCODE(ASL, ZeroPg, 5, 0),
+	/* 0x07 */ UNKNOWN_OPCODE,
+	/* 0x08 */ OPCODE(PHP, Implid, 3, 0),
+	/* 0x09 */ OPCODE(ORA, Immedt, 2, 0),
+	/* 0x0A */ OPCODE(ASL, Accumu, 2, 0),
+	/* 0x0B */ UNKNOWN_OPCODE,
+	/* 0x0C */ UNKNOWN_OPCODE,
+	/* 0x0D */ OPCODE(ORA, Absolu, 4, 0),
+	/* 0x0E */ OPCODE(ASL, Absolu, 6, 0),
+	/* 0x0F */ UNKNOWN_OPCODE,
+	/* 0x10 */ OPCODE(BPL, Relatv, 2, 0),
+	/* 0x11 */ OPCODE(ORA, IndIdx, 5, 1),
+	/* 0x12 */ UNKNOWN_OPCODE,
+	/* 0x13 */ UNKNOWN_OPCODE,
+	/* 0x14 */ UNKNOWN_OPCODE,
+	/* 0x15 */ OPCODE(ORA, ZPIdxX, 4, 0),
+	/* 0x16 */ OPCODE(ASL, ZPIdxX, 6, 0),
+	/* 0x17 */ UNKNOWN_OPCODE,
+	/* 0x18 */ OPCODE(CLC, Implid, 2, 0),
+	/* 0x19 */ OPCODE(ORA, AbIdxY, 4, 1),
+	/* 0x1A */ UNKNOWN_OPCODE,
+	/* 0x1B */ UNKNOWN_OPCODE,
+	/* 0x1C */ UNKNOWN_OPCODE,
+	/* 0x1D */ OPCODE(ORA, AbIdxX, 4, 1),
+	/* 0x1E */ OPCODE(ASL, AbIdxX, 7, 0),
+	/* 0x1F */ UNKNOWN_OPCODE,
+	/* 0x20 */ OPCODE(JSR, Absolu, 6, 0),
+	/* 0x21 */ OPCODE(AND, IdxInd, 6, 0),
+	/* 0x22 */ UNKNOWN_OPCODE,
+	/* 0x23 */ UNKNOWN_OPCODE,
+	/* 0x24 */ OPCODE(BIT, ZeroPg, 3, 0),
+	/* 0x25 */ OPCODE(AND, ZeroPg, 3, 0),
+	/* 0x26 */ OPCODE(ROL, ZeroPg, 5, 0),
+	/* 0x27 */ UNKNOWN_OPCODE,
+	/* 0x28 */ OPCODE(PLP, Implid, 4, 0),
+	/* 0x29 */ OPCODE(AND, Immedt, 2, 0),
+	/* 0x2A */ OPCODE(ROL, Accumu, 2, 0),
+	/* 0x2B */ UNKNOWN_OPCODE,
+	/* 0x2C */ OPCODE(BIT, Absolu, 4, 0),
+	/* 0x2D */ OPCODE(AND, Absolu, 4, 0),
+	/* 0x2E */ OPCODE(ROL, Absolu, 6, 0),
+	/* 0x2F */ UNKNOWN_OPCODE,
+	/* 0x30 */ OPCODE(BMI, Relatv, 2, 0),
+	/* 0x31 */ OPCODE(AND, IndIdx, 5, 1),
+	/* 0x32 */ UNKNOWN_OPCODE,
+	/* 0x33 */ UNKNOWN_OPCODE,
+	/* 0x34 */ UNKNOWN_OPCODE,
+	/* 0x35 */ OPCODE(AND, ZPIdxX, 4, 0),
+	/* 0x36 */ OPCODE(ROL, ZPIdxX, 6, 0),
+	/* 0x37 */ UNKNOWN_OPCODE,
+	/* 0x38 */ OPCODE(SEC, Implid, 2, 0),
+	/* 0x39 */ OPCODE(AND, AbIdxY, 4, 1),
+	/* 0x3A */ UNKNOWN_OPCODE,
+	/* 0x3B */ UNKNOWN_OPCODE,
+	/* 0x3C */ UNKNOWN_OPCODE,
+	/* 0x3D */ OPCODE(AND, AbIdxX, 4, 1),
+	/* 0x3E */ OPCODE(ROL, AbIdxX, 7, 0),
+	/* 0x3F */ UNKNOWN_OPCODE,
+	/* 0x40 */ OPCODE(RTI, Implid, 6, 0),
+	/* 0x41 */ OPCODE(EOR, IdxInd, 6, 0),
+	/* 0x42 */ UNKNOWN_OPCODE,
+	/* 0x43 */ UNKNOWN_OPCODE,
+	/* 0x44 */ UNKNOWN_OPCODE,
+	/* 0x45 */ OPCODE(EOR, ZeroPg, 3, 0),
+	/* 0x46 */ OPCODE(LSR, ZeroPg, 5, 0),
+	/* 0x47 */ UNKNOWN_OPCODE,
+	/* 0x48 */ OPCODE(PHA, Implid, 3, 0),
+	/* 0x49 */ OPCODE(EOR, Immedt, 2, 0),
+	/* 0x4A */ OPCODE(LSR, Accumu, 2, 0),
+	/* 0x4B */ UNKNOWN_OPCODE,
+	/* 0x4C */ OPCODE(JMP, Absolu, 3, 0),
+	/* 0x4D */ OPCODE(EOR, Absolu, 4, 0),
+	/* 0x4E */ OPCODE(LSR, Absolu, 6, 0),
+	/* 0x4F */ UNKNOWN_OPCODE,
+	/* 0x50 */ OPCODE(BVC, Relatv, 2, 0),
+	/* 0x51 */ OPCODE(EOR, IndIdx, 5, 1),
+	/* 0x52 */ UNKNOWN_OPCODE,
+	/* 0x53 */ UNKNOWN_OPCODE,
+	/* 0x54 */ UNKNOWN_OPCODE,
+	/* 0x55 */ OPCODE(EOR, ZPIdxX, 4, 0),
+	/* 0x56 */ OPCODE(LSR, ZPIdxX, 6, 0),
+	/* 0x57 */ UNKNOWN_OPCODE,
+	/* 0x58 */ OPCODE(CLI, Implid, 2, 0),
+	/* 0x59 */ OPCODE(EOR, AbIdxY, 4, 1),
+	/* 0x5A */ UNKNOWN_OPCODE,
+	/* 0x5B */ UNKNOWN_OPCODE,
+	/* 0x5C */ UNKNOWN_OPCODE,
+	/* 0x5D */ OPCODE(EOR, AbIdxX, 4, 1),
+	/* 0x5E */ OPCODE(LSR, AbIdxX, 7, 0),
+	/* 0x5F */ UNKNOWN_OPCODE,
+	/* 0x60 */ OPCODE(RTS, Implid, 6, 0),
+	/* 0x61 */ OPCODE(ADC, IdxInd, 6, 0),
+	/* 0x62 */ UNKNOWN_OPCODE,
+	/* 0x63 */ UNKNOWN_OPCODE,
+	/* 0x64 */ UNKNOWN_OPCODE,
+	/* 0x65 */ OPCODE(ADC, ZeroPg, 3, 0),
+	/* 0x66 */ OPCODE(ROR, ZeroPg, 5, 0),
+	/* 0x67 */ UNKNOWN_OPCODE,
+	/* 0x68 */ OPCODE(PLA, Implid, 4, 0),
+	/* 0x69 */ OPCODE(ADC, Immedt, 2, 0),
+	/* 0x6A */ OPCODE(ROR, Accumu, 2, 0),
+	/* 0x6B */ UNKNOWN_OPCODE,
+	/* 0x6C */ OPCODE(JMP, Indrct, 5, 0),
+	/* 0x6D */ OPCODE(ADC, Absolu, 4, 0),
+	/* 0x6E */ OPCODE(ROR, Absolu, 6, 0),
+	/* 0x6F */ UNKNOWN_OPCODE,
+	/* 0x70 */ OPCODE(BVS, Relatv, 2, 0),
+	/* 0x71 */ OPCODE(ADC, IndIdx, 5, 1),
+	/* 0x72 */ UNKNOWN_OPCODE,
+	/* 0x73 */ UNKNOWN_OPCODE,
+	/* 0x74 */ UNKNOWN_OPCODE,
+	/* 0x75 */ OPCODE(ADC, ZPIdxX, 4, 0),
+	/* 0x76 */ OPCODE(ROR, ZPIdxX, 6, 0),
+	/* 0x77 */ UNKNOWN_OPCODE,
+	/* 0x78 */ OPCODE(SEI, Implid, 2, 0),
+	/* 0x79 */ OPCODE(ADC, AbIdxY, 4, 1),
+	/* 0x7A */ UNKNOWN_OPCODE,
+	/* 0x7B */ UNKNOWN_OPCODE,
+	/* 0x7C */ UNKNOWN_OPCODE,
+	/* 0x7D */ OPCODE(ADC, AbIdxX, 4, 1),
+	/* 0x7E */ OPCODE(ROR, AbIdxX, 7, 0),
+	/* 0x7F */ UNKNOWN_OPCODE,
+	/* 0x80 */ UNKNOWN_OPCODE,
+	/* 0x81 */ OPCODE(STA, IdxInd, 6, 0),
+	/* 0x82 */ UNKNOWN_OPCODE,
+	/* 0x83 */ UNKNOWN_OPCODE,
+	/* 0x84 */ OPCODE(STY, ZeroPg, 3, 0),
+	/* 0x85 */ OPCODE(STA, ZeroPg, 3, 0),
+	/* 0x86 */ OPCODE(STX, ZeroPg, 3, 0),
+	/* 0x87 */ UNKNOWN_OPCODE,
+	/* 0x88 */ OPCODE(DEY, Implid, 2, 0),
+	/* 0x89 */ UNKNOWN_OPCODE,
+	/* 0x8A */ OPCODE(TXA, Implid, 2, 0),
+	/* 0x8B */ UNKNOWN_OPCODE,
+	/* 0x8C */ OPCODE(STY, Absolu, 4, 0),
+	/* 0x8D */ OPCODE(STA, Absolu, 4, 0),
+	/* 0x8E */ OPCODE(STX, Absolu, 4, 0),
+	/* 0x8F */ UNKNOWN_OPCODE,
+	/* 0x90 */ OPCODE(BCC, Relatv, 2, 0),
+	/* 0x91 */ OPCODE(STA, IndIdx, 6, 0),
+	/* 0x92 */ UNKNOWN_OPCODE,
+	/* 0x93 */ UNKNOWN_OPCODE,
+	/* 0x94 */ OPCODE(STY, ZPIdxX, 4, 0),
+	/* 0x95 */ OPCODE(STA, ZPIdxX, 4, 0),
+	/* 0x96 */ OPCODE(STX, ZPIdxY, 4, 0),
+	/* 0x97 */ UNKNOWN_OPCODE,
+	/* 0x98 */ OPCODE(TYA, Implid, 2, 0),
+	/* 0x99 */ OPCODE(STA, AbIdxY, 5, 0),
+	/* 0x9A */ OPCODE(TXS, Implid, 2, 0),
+	/* 0x9B */ UNKNOWN_OPCODE,
+	/* 0x9C */ UNKNOWN_OPCODE,
+	/* 0x9D */ OPCODE(STA, AbIdxX, 5, 0),
+	/* 0x9E */ UNKNOWN_OPCODE,
+	/* 0x9F */ UNKNOWN_OPCODE,
+	/* 0xA0 */ OPCODE(LDY, Immedt, 2, 0),
+	/* 0xA1 */ OPCODE(LDA, IdxInd, 6, 0),
+	/* 0xA2 */ OPCODE(LDX, Immedt, 2, 0),
+	/* 0xA3 */ UNKNOWN_OPCODE,
+	/* 0xA4 */ OPCODE(LDY, ZeroPg, 3, 0),
+	/* 0xA5 */ OPCODE(LDA, ZeroPg, 3, 0),
+	/* 0xA6 */ OPCODE(LDX, ZeroPg, 3, 0),
+	/* 0xA7 */ UNKNOWN_OPCODE,
+	/* 0xA8 */ OPCODE(TAY, Implid, 2, 0),
+	/* 0xA9 */ OPCODE(LDA, Immedt, 2, 0),
+	/* 0xAA */ OPCODE(TAX, Implid, 2, 0),
+	/* 0xAB */ UNKNOWN_OPCODE,
+	/* 0xAC */ OPCODE(LDY, Absolu, 4, 0),
+	/* 0xAD */ OPCODE(LDA, Absolu, 4, 0),
+	/* 0xAE */ OPCODE(LDX, Absolu, 4, 0),
+	/* 0xAF */ UNKNOWN_OPCODE,
+	/* 0xB0 */ OPCODE(BCS, Relatv, 2, 0),
+	/* 0xB1 */ OPCODE(LDA, IndIdx, 5, 1),
+	/* 0xB2 */ UNKNOWN_OPCODE,
+	/* 0xB3 */ UNKNOWN_OPCODE,
+	/* 0xB4 */ OPCODE(LDY, ZPIdxX, 4, 0),
+	/* 0xB5 */ OPCODE(LDA, ZPIdxX, 4, 0),
+	/* 0xB6 */ OPCODE(LDX, ZPIdxY, 4, 0),
+	/* 0xB7 */ UNKNOWN_OPCODE,
+	/* 0xB8 */ OPCODE(CLV, Implid, 2, 0),
+	/* 0xB9 */ OPCODE(LDA, AbIdxY, 4, 1),
+	/* 0xBA */ OPCODE(TSX, Implid, 2, 0),
+	/* 0xBB */ UNKNOWN_OPCODE,
+	/* 0xBC */ OPCODE(LDY, AbIdxX, 4, 1),
+	/* 0xBD */ OPCODE(LDA, AbIdxX, 4, 1),
+	/* 0xBE */ OPCODE(LDX, AbIdxY, 4, 1),
+	/* 0xBF */ UNKNOWN_OPCODE,
+	/* 0xC0 */ OPCODE(CPY, Immedt, 2, 0),
+	/* 0xC1 */ OPCODE(CMP, IdxInd, 6, 0),
+	/* 0xC2 */ UNKNOWN_OPCODE,
+	/* 0xC3 */ UNKNOWN_OPCODE,
+	/* 0xC4 */ OPCODE(CPY, ZeroPg, 3, 0),
+	/* 0xC5 */ OPCODE(CMP, ZeroPg, 3, 0),
+	/* 0xC6 */ OPCODE(DEC, ZeroPg, 5, 0),
+	/* 0xC7 */ UNKNOWN_OPCODE,
+	/* 0xC8 */ OPCODE(INY, Implid, 2, 0),
+	/* 0xC9 */ OPCODE(CMP, Immedt, 2, 0),
+	/* 0xCA */ OPCODE(DEX, Implid, 2, 0),
+	/* 0xCB */ UNKNOWN_OPCODE,
+	/* 0xCC */ OPCODE(CPY, Absolu, 4, 0),
+	/* 0xCD */ OPCODE(CMP, Absolu, 4, 0),
+	/* 0xCE */ OPCODE(DEC, Absolu, 6, 0),
+	/* 0xCF */ UNKNOWN_OPCODE,
+	/* 0xD0 */ OPCODE(BNE, Relatv, 2, 0),
+	/* 0xD1 */ OPCODE(CMP, IndIdx, 5, 1),
+	/* 0xD2 */ UNKNOWN_OPCODE,
+	/* 0xD3 */ UNKNOWN_OPCODE,
+	/* 0xD4 */ UNKNOWN_OPCODE,
+	/* 0xD5 */ OPCODE(CMP, ZPIdxX, 4, 0),
+	/* 0xD6 */ OPCODE(DEC, ZPIdxX, 6, 0),
+	/* 0xD7 */ UNKNOWN_OPCODE,
+	/* 0xD8 */ OPCODE(CLD, Implid, 2, 0),
+	/* 0xD9 */ OPCODE(CMP, AbIdxY, 4, 1),
+	/* 0xDA */ UNKNOWN_OPCODE,
+	/* 0xDB */ UNKNOWN_OPCODE,
+	/* 0xDC */ UNKNOWN_OPCODE,
+	/* 0xDD */ OPCODE(CMP, AbIdxX, 4, 1),
+	/* 0xDE */ OPCODE(DEC, AbIdxX, 7, 0),
+	/* 0xDF */ UNKNOWN_OPCODE,
+	/* 0xE0 */ OPCODE(CPX, Immedt, 2, 0),
+	/* 0xE1 */ OPCODE(SBC, IdxInd, 6, 0),
+	/* 0xE2 */ UNKNOWN_OPCODE,
+	/* 0xE3 */ UNKNOWN_OPCODE,
+	/* 0xE4 */ OPCODE(CPX, ZeroPg, 3, 0),
+	/* 0xE5 */ OPCODE(SBC, ZeroPg, 3, 0),
+	/* 0xE6 */ OPCODE(INC, ZeroPg, 5, 0),
+	/* 0xE7 */ UNKNOWN_OPCODE,
+	/* 0xE8 */ OPCODE(INX, Implid, 2, 0),
+	/* 0xE9 */ OPCODE(SBC, Immedt, 2, 0),
+	/* 0xEA */ OPCODE(NOP, Implid, 2, 0),
+	/* 0xEB */ UNKNOWN_OPCODE,
+	/* 0xEC */ OPCODE(CPX, Absolu, 4, 0),
+	/* 0xED */ OPCODE(SBC, Absolu, 4, 0),
+	/* 0xEE */ OPCODE(INC, Absolu, 6, 0),
+	/* 0xEF */ UNKNOWN_OPCODE,
+	/* 0xF0 */ OPCODE(BEQ, Relatv, 2, 0),
+	/* 0xF1 */ OPCODE(SBC, IndIdx, 5, 1),
+	/* 0xF2 */ UNKNOWN_OPCODE,
+	/* 0xF3 */ UNKNOWN_OPCODE,
+	/* 0xF4 */ UNKNOWN_OPCODE,
+	/* 0xF5 */ OPCODE(SBC, ZPIdxX, 4, 0),
+	/* 0xF6 */ OPCODE(INC, ZPIdxX, 6, 0),
+	/* 0xF7 */ UNKNOWN_OPCODE,
+	/* 0xF8 */ OPCODE(SED, Implid, 2, 0),
+	/* 0xF9 */ OPCODE(SBC, AbIdxY, 4, 1),
+	/* 0xFA */ UNKNOWN_OPCODE,
+	/* 0xFB */ UNKNOWN_OPCODE,
+	/* 0xFC */ UNKNOWN_OPCODE,
+	/* 0xFD */ OPCODE(SBC, AbIdxX, 4, 1),
+	/* 0xFE */ OPCODE(INC, AbIdxX, 7, 0),
+	/* 0xFF */ UNKNOWN_OPCODE,
+};
+
+#undef OPCODE
+#undef UNKNOWN_OPCODE
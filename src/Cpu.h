@@ -3,9 +3,13 @@
 #include "Base.h"
 #include "Bitfield.h"
 #include "ControllerPorts.h"
+#include "OpCodeTable.h"
+#include <array>
+#include <vector>
 
 class CpuMemoryBus;
-struct OpCodeEntry;
+class Cartridge;
+class StateSerializer;
 
 namespace StatusFlag
 {
@@ -26,7 +30,7 @@ class Cpu
 {
 public:
 	Cpu();
-	void Initialize(CpuMemoryBus& cpuMemoryBus);
+	void Initialize(CpuMemoryBus& cpuMemoryBus, Cartridge& cartridge);
 
 	void Reset();
 	void Nmi();
@@ -34,9 +38,32 @@ public:
 
 	void Execute(uint32& cpuCyclesElapsed);
 
+	// Alternative to Execute() that runs a translated block of straight-line PRG-ROM instructions. Instructions
+	// are executed as long as no more than maxCpuCycles have elapsed, so that the last one is the one that would
+	// reach a PPU event when executed one at a time. Falls back to Execute() when no block can be translated at PC.
+	void ExecuteBlock(uint32 maxCpuCycles, uint32& cpuCyclesElapsed);
+
+	// Returns true if PC is at the start of an idle loop and the next iteration would leave the CPU and memory
+	// exactly as they are now, so it can be skipped: either a jump to itself, or a load from internal RAM or the
+	// PPU status register followed by a branch back to it, that would read the same value without side effects.
+	// Only checked right after a short backward branch or jump was taken. Sets loopCpuCycles to the cycles of
+	// one iteration.
+	bool IsInIdleLoop(uint32& loopCpuCycles);
+
+	// Accounts for one idle loop iteration that was not executed (see IsInIdleLoop)
+	void SkipIdleLoopIteration(uint32 loopCpuCycles);
+
 	uint8 HandleCpuRead(uint16 cpuAddress);
 	void HandleCpuWrite(uint16 cpuAddress, uint8 value);
 
+	// Must be called when internal RAM or PRG memory is written to so that decoded instructions
+	// that include this address get decoded again.
+	void InvalidateDecodedInstructions(uint16 cpuAddress);
+
+	// Serializes registers and the state of an instruction in progress. Instructions decoded from memory that
+	// the state may change are decoded again after loading.
+	void Serialize(StateSerializer& serializer);
+
 private:
 	friend class DebuggerImpl;
 
@@ -44,26 +71,73 @@ private:
 	uint16 Read16(uint16 address) const;
 	void Write8(uint16 address, uint8 value);
 
-	// Updates m_operandAddress for current instruction based on addressing mode. Operand data is assumed to be at PC + 1 if it exists.
+	struct DecodedInstruction;
+
+	// Returns decoded instruction at PC, from the decode cache if possible
+	const DecodedInstruction& FetchInstruction();
+	void DecodeInstruction(uint16 address, DecodedInstruction& instruction) const;
+
+	struct InstructionBlock;
+
+	// Returns translated block at PC, or nullptr if PC is not in PRG-ROM or no instruction at PC can be part of a block
+	const InstructionBlock* FetchInstructionBlock();
+	void TranslateInstructionBlock(InstructionBlock& block) const;
+
+	// Updates m_operandAddress for current instruction based on addressing mode. Operand data is taken from m_rawOperand.
+	template <AddressMode::Type addrMode>
 	void UpdateOperandAddress();
 
-	// Executes current instruction and updates PC
-	void ExecuteInstruction();
+	// Executes current instruction and updates PC. One instance per opcode is stored in kOpCodeHandlerTable,
+	// so every addressing mode and operation dependent branch is resolved at compile time.
+	template <OpCodeName::Type opCodeName, AddressMode::Type addrMode, uint8 numCycles, uint8 pageCrossCycles>
+	void ExecuteOpCode();
+
+	// Handler for opcodes not in the opcode table
+	void ExecuteUnknownOpCode();
 
 	// Executes pending interrupts (if any)
 	void ExecutePendingInterrupts();
 
 	// For instructions that work on accumulator (A) or memory location
+	template <AddressMode::Type addrMode>
 	uint8 GetAccumOrMemValue() const;
+	template <AddressMode::Type addrMode>
 	void SetAccumOrMemValue(uint8 value);
 
 	// For instructions that work on memory location
+	template <AddressMode::Type addrMode>
 	uint8 GetMemValue() const;
+	template <AddressMode::Type addrMode>
 	void SetMemValue(uint8 value);
 
 	// Returns the target location for branch or jmp instructions
+	template <AddressMode::Type addrMode>
 	uint16 GetBranchOrJmpLocation() const;
 
+	// Processor status with lazily evaluated flags (N, Z, C, V) computed from last results
+	uint8 GetProcessorStatus() const;
+	void SetProcessorStatus(uint8 value);
+
+	// Lazy flag helpers: instructions store results and operands, and flags are only computed when tested
+	FORCEINLINE void SetNegativeAndZeroFlags(uint8 result) { m_negativeFlagResult = m_zeroFlagResult = result; }
+	FORCEINLINE void SetCarryFlagResult(uint16 result) { m_carryFlagResult = result; } // Carry is bit 8 of result
+	FORCEINLINE void SetOverflowFlagOperands(uint8 a, uint8 b, uint8 result) { m_overflowFlagA = a; m_overflowFlagB = b; m_overflowFlagResult = result; }
+	FORCEINLINE void SetOverflowFlag(bool enabled) { SetOverflowFlagOperands(0, 0, enabled? 0x80 : 0); }
+
+	FORCEINLINE bool TestNegativeFlag() const { return (m_negativeFlagResult & 0x80) != 0; }
+	FORCEINLINE bool TestZeroFlag() const { return m_zeroFlagResult == 0; }
+	FORCEINLINE uint8 TestCarryFlag01() const { return TO8(m_carryFlagResult >> 8); }
+	FORCEINLINE bool TestOverflowFlag() const
+	{
+		// With r = a + b, overflow occurs if both a and b are negative and r is positive,
+		// or both a and b are positive and r is negative. Looking at sign bits of a, b, r,
+		// overflow occurs when 0 0 1 or 1 1 0, so we can use simple xor logic to figure it out.
+		return ((m_overflowFlagA ^ m_overflowFlagResult) & (m_overflowFlagB ^ m_overflowFlagResult) & 0x80) != 0;
+	}
+
+	// Returns true if branch instruction would branch given current flags
+	bool IsBranchTaken(OpCodeName::Type opCodeName) const;
+
 	// Stack manipulation functions, modify SP
 	void Push8(uint8 value);
 	void Push16(uint16 value);
@@ -72,10 +146,55 @@ private:
 	void PushProcessorStatus(bool softwareInterrupt);
 	void PopProcessorStatus();
 
+	typedef void (Cpu::*OpCodeHandler)();
+
+	struct OpCodeHandlerEntry
+	{
+		OpCodeHandler handler;
+		OpCodeName::Type opCodeName; // Remaining fields only used to validate against the opcode table
+		AddressMode::Type addrMode;
+		uint8 numBytes;
+		uint8 numCycles;
+		uint8 pageCrossCycles;
+	};
+
+	// Indexed by opcode
+	static const OpCodeHandlerEntry kOpCodeHandlerTable[256];
+
+	struct DecodedInstruction
+	{
+		OpCodeHandler handler; // nullptr if not decoded yet
+		uint16 rawOperand; // Operand bytes following opcode (little endian)
+		uint8 numBytes;
+		uint8 numCycles; // Base cycles, not including page cross or branch taken cycles
+	};
+
+	// Decoded instructions per physical 4K PRG bank (allocated on first use), and for internal RAM.
+	// Instructions that straddle a bank (or RAM mirror) boundary are never cached.
+	typedef std::vector<DecodedInstruction> DecodedInstructionBank;
+	std::vector<DecodedInstructionBank> m_prgDecodeCache;
+	std::array<DecodedInstruction, KB(2)> m_ramDecodeCache;
+	DecodedInstruction m_uncachedInstruction;
+
+	// Instructions in a block never access PPU/APU/IO registers or mapper registers, and only the last one
+	// may change the flow of execution. Blocks are stored per physical 4K PRG bank and offset of the first
+	// instruction, and are only valid within that bank, so remapping a bank does not invalidate them.
+	struct InstructionBlock
+	{
+		InstructionBlock() : translated(false) {}
+
+		std::vector<DecodedInstruction> instructions; // Empty if no block could be translated
+		bool translated;
+	};
+
+	typedef std::vector<InstructionBlock> InstructionBlockBank;
+	std::vector<InstructionBlockBank> m_prgBlockCache;
+
 	// Data members
 
 	CpuMemoryBus* m_cpuMemoryBus;
-	OpCodeEntry* m_opCodeEntry; // Current opcode entry
+	Cartridge* m_cartridge;
+	OpCodeEntry* m_opCodeEntry; // Current opcode entry (only updated when debugging is enabled)
 	
 	// Registers - not using the usual m_ prefix because I find the code looks
 	// more straightforward when using the typical register names
@@ -84,7 +203,15 @@ private:
 	uint8 A;		// Accumulator
 	uint8 X;		// X register
 	uint8 Y;		// Y register
-	Bitfield8 P;	// Processor status (flags)
+	Bitfield8 P;	// Processor status flags that are not lazily evaluated (use GetProcessorStatus for all flags)
+
+	// Lazily evaluated flags (see flag helpers)
+	uint8 m_negativeFlagResult;
+	uint8 m_zeroFlagResult;
+	uint16 m_carryFlagResult;
+	uint8 m_overflowFlagA;
+	uint8 m_overflowFlagB;
+	uint8 m_overflowFlagResult;
 
 	uint16 m_cycles; // Elapsed cycles of each fetch and execute of an instruction
 	uint64 m_totalCycles;
@@ -92,11 +219,17 @@ private:
 	bool m_pendingNmi;
 	bool m_pendingIrq;
 
+	bool m_idleLoopCandidate; // Set when a short backward branch or jump is taken
+
+	// Raw operand bytes of current instruction
+	uint16 m_rawOperand;
+
 	// Operand address is either the operand's memory location, or the target for a branch or jmp
 	uint16 m_operandAddress;
 	bool m_operandReadCrossedPage;
 
 	uint8 m_spriteDmaRegister; // $4014
+	bool m_spriteDmaStarted; // Set by $4014 write until the CPU stall is applied
 
 	ControllerPorts m_controllerPorts;
 };
@@ -0,0 +1,92 @@
+#include "CpuFeatures.h"
+
+#if CPU_X86
+	#if defined(__GNUC__)
+		#include <cpuid.h>
+	#else
+		#include <intrin.h>
+	#endif
+#endif
+
+namespace
+{
+#if CPU_X86
+	void CpuId(int leaf, int regs[4])
+	{
+	#if defined(__GNUC__)
+		__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+	#else
+		__cpuidex(regs, leaf, 0);
+	#endif
+	}
+
+	uint64 ReadXcr0()
+	{
+	#if defined(__GNUC__)
+		uint32 lo, hi;
+		__asm__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		return (static_cast<uint64>(hi) << 32) | lo;
+	#else
+		return _xgetbv(0);
+	#endif
+	}
+
+	bool DetectSSE2()
+	{
+		int regs[4];
+		CpuId(1, regs);
+		return (regs[3] & BIT(26)) != 0;
+	}
+
+	bool DetectAVX2()
+	{
+		int regs[4];
+		CpuId(0, regs);
+		if (regs[0] < 7)
+			return false;
+
+		// The OS must also save the YMM registers on context switches (OSXSAVE and XCR0 bits 1-2)
+		CpuId(1, regs);
+		if ((regs[2] & BIT(27)) == 0 || (regs[2] & BIT(28)) == 0)
+			return false;
+
+		if ((ReadXcr0() & 0x6) != 0x6)
+			return false;
+
+		CpuId(7, regs);
+		return (regs[1] & BIT(5)) != 0;
+	}
+#endif // CPU_X86
+}
+
+namespace CpuFeatures
+{
+	bool HasSSE2()
+	{
+	#if CPU_X86
+		static const bool result = DetectSSE2();
+		return result;
+	#else
+		return false;
+	#endif
+	}
+
+	bool HasAVX2()
+	{
+	#if CPU_X86
+		static const bool result = DetectAVX2();
+		return result;
+	#else
+		return false;
+	#endif
+	}
+
+	bool HasNEON()
+	{
+	#if CPU_NEON
+		return true;
+	#else
+		return false;
+	#endif
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "Base.h"
+
+// Instruction set extensions of the host CPU, used to select vectorized code paths at runtime
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	#define CPU_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define CPU_NEON 1
+#endif
+
+// Functions using AVX2 intrinsics must be marked with TARGET_AVX2, as GCC and Clang only allow them in
+// functions compiled for AVX2. They must only be called when CpuFeatures::HasAVX2() returns true.
+#if CPU_X86 && defined(__GNUC__)
+	#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+	#define TARGET_AVX2
+#endif
+
+namespace CpuFeatures
+{
+	bool HasSSE2();
+	bool HasAVX2(); // Also checks that the OS saves AVX registers
+	bool HasNEON(); // Known at compile time
+}
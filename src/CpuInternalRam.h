@@ -1,6 +1,7 @@
 #pragma once
 #include "Memory.h"
 #include "MemoryMap.h"
+#include "StateSerializer.h"
 
 class CpuInternalRam
 {
@@ -8,6 +9,8 @@ public:
 	void Initialize()										{ m_memory.Initialize(); }
 	uint8 HandleCpuRead(uint16 cpuAddress)					{ return m_memory.Read(MapCpuToInternalRam(cpuAddress)); }
 	void HandleCpuWrite(uint16 cpuAddress, uint8 value)		{ m_memory.Write(MapCpuToInternalRam(cpuAddress), value); }
+	uint8* GetCpuPtr(uint16 cpuAddress)						{ return m_memory.RawPtr(MapCpuToInternalRam(cpuAddress)); }
+	void Serialize(StateSerializer& serializer)				{ serializer.Memory(m_memory); }
 
 private:
 	uint16 MapCpuToInternalRam(uint16 cpuAddress)
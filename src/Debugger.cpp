@@ -268,7 +268,9 @@ private:
 
 		using namespace StatusFlag;
 
-		#define HILO(v) (cpu.P.Test(v) ? StatusFlagNames[BitFlagToPos<v>::Result-1] : tolower(StatusFlagNames[BitFlagToPos<v>::Result-1]))
+		const uint8 P = cpu.GetProcessorStatus();
+
+		#define HILO(v) ((P & v) ? StatusFlagNames[BitFlagToPos<v>::Result-1] : tolower(StatusFlagNames[BitFlagToPos<v>::Result-1]))
 		#define ADDR_8_NO$ "%02X"
 
 		TRACEF("A:" ADDR_8_NO$ " X:" ADDR_8_NO$ " Y:" ADDR_8_NO$ " S:" ADDR_8_NO$ " P:%c%c%c%c%c%c%c%c",
@@ -487,4 +489,11 @@ namespace Debugger
 	bool IsExecuting() { return g_isExecuting; }
 }
 
+#else
+
+namespace Debugger
+{
+	void Shutdown() {}
+}
+
 #endif // DEBUGGING_ENABLED
@@ -19,7 +19,7 @@ namespace Debugger
 	bool IsExecuting();
 #else
 	FORCEINLINE void Initialize(Nes&) {}
-	FORCEINLINE void Shutdown() {}
+	void Shutdown(); // Not inline: called by FailHandler in Base.h, which only sees the extern declaration
 	FORCEINLINE void Update() {};
 	FORCEINLINE void DumpMemory() {}
 	FORCEINLINE void PreCpuInstruction() {}
@@ -1,7 +1,12 @@
 #pragma once
 
 #include "System.h"
+#include <algorithm>
+#include <cmath>
 
+// Paces frames to a target frame time. Sleeps until shortly before each frame's deadline, then spins for the
+// remaining time, so that a core isn't kept busy while waiting. The time kept for spinning (sleep margin) is
+// calibrated from how late the OS wakes us up.
 class FrameTimer
 {
 public:
@@ -10,30 +15,100 @@ public:
 	void Reset()
 	{
 		m_lastTime = System::GetTimeSec();
+		m_deadline = m_lastTime;
 		m_frameTime = 0.0f;
 		m_fps = 60.0f;
+		m_sleepMargin = 0.001;
+		m_jitter = 0.0f;
+		m_maxJitter = 0.0f;
 	}
 
-	void Update(float32 minFrameTime = 0.0f)
+	// Waits until minFrameTime has elapsed since the last deadline. Deadlines are absolute, so a frame that ends late
+	// is compensated by the next one instead of delaying all following frames. Returns immediately if minFrameTime is 0.
+	void Update(float64 minFrameTime = 0.0)
 	{
-		float64 currTime = 0;
-		do
+		float64 currTime = System::GetTimeSec();
+
+		if (minFrameTime > 0.0)
 		{
-			currTime = System::GetTimeSec();
-			m_frameTime = static_cast<float32>(currTime - m_lastTime);
+			m_deadline += minFrameTime;
 
-		} while (m_frameTime < minFrameTime);
+			// Too far behind (e.g. paused, or rom loading) to catch up, start over from now
+			if (currTime - m_deadline > minFrameTime)
+			{
+				m_deadline = currTime;
+			}
 
+			currTime = WaitUntil(m_deadline, minFrameTime);
+		}
+		else
+		{
+			m_deadline = currTime;
+		}
+
+		m_frameTime = static_cast<float32>(currTime - m_lastTime);
 		m_lastTime = currTime;
 
 		m_fps = (m_fps * 0.8f) + (0.2f * (1.0f/(m_frameTime)));
+
+		if (minFrameTime > 0.0)
+		{
+			const float32 jitter = static_cast<float32>(std::fabs(m_frameTime - minFrameTime));
+			m_jitter = (m_jitter * 0.9f) + (0.1f * jitter);
+			m_maxJitter = std::max(m_maxJitter, jitter);
+		}
 	}
 
 	float64 GetFrameTime() const { return m_frameTime; }
 	float64 GetFps() const { return m_fps; }
 
+	// Deviation of frame times from the target frame time, in seconds: smoothed average, and maximum since Reset
+	float64 GetJitter() const { return m_jitter; }
+	float64 GetMaxJitter() const { return m_maxJitter; }
+
 private:
+	// Returns the current time, at or after deadline
+	float64 WaitUntil(float64 deadline, float64 frameTime)
+	{
+		const float64 kMinSleepMargin = 0.0005;
+		const float64 kMaxSleepMargin = 0.010;
+
+		// A margin close to the frame time would leave no time to sleep, so we'd spin for whole frames
+		const float64 maxSleepMargin = std::min(kMaxSleepMargin, frameTime / 2);
+
+		float64 currTime = System::GetTimeSec();
+
+		const float64 sleepTime = deadline - currTime - m_sleepMargin;
+		if (sleepTime >= 0.001)
+		{
+			const uint32 sleepMs = static_cast<uint32>(sleepTime * 1000.0);
+			const float64 wakeTime = currTime + sleepMs / 1000.0;
+			System::Sleep(sleepMs);
+			currTime = System::GetTimeSec();
+
+			// Keep enough margin to absorb the worst recent oversleep, and slowly shrink it back when sleeps are accurate
+			const float64 oversleep = currTime - wakeTime;
+			m_sleepMargin = std::min(maxSleepMargin, std::max(kMinSleepMargin, std::max(oversleep * 1.25, m_sleepMargin * 0.95)));
+		}
+		else
+		{
+			// No oversleep to measure, but still shrink the margin so that a single late wake up (e.g. preemption)
+			// doesn't keep us from sleeping for the rest of the session
+			m_sleepMargin = std::min(maxSleepMargin, std::max(kMinSleepMargin, m_sleepMargin * 0.95));
+		}
+
+		while (currTime < deadline)
+		{
+			currTime = System::GetTimeSec();
+		}
+		return currTime;
+	}
+
 	float64 m_lastTime;
+	float64 m_deadline;
 	float32 m_frameTime;
 	float32 m_fps;
+	float64 m_sleepMargin;
+	float32 m_jitter;
+	float32 m_maxJitter;
 };
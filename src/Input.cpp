@@ -1,6 +1,26 @@
 #include "Input.h"
+
+#if CONFIG_HEADLESS
+
+// No keyboard without SDL, keys are never down
+namespace Input
+{
+	void Update() {}
+	bool KeyDown(SDL_Scancode) { return false; }
+	bool KeyUp(SDL_Scancode) { return true; }
+	bool KeyPressed(SDL_Scancode) { return false; }
+	bool KeyReleased(SDL_Scancode) { return false; }
+	bool AltDown() { return false; }
+	bool CtrlDown() { return false; }
+	bool ShiftDown() { return false; }
+	const char* GetScancodeName(SDL_Scancode) { return ""; }
+}
+
+#else
+
 #include <SDL_keyboard.h>
 #include <SDL_events.h>
+#include <cstring>
 #include <memory>
 
 namespace
@@ -83,3 +103,5 @@ namespace Input
 		return SDL_GetScancodeName(scanCode);
 	}
 }
+
+#endif // CONFIG_HEADLESS
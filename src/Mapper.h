@@ -2,6 +2,7 @@
 
 #include "Base.h"
 #include "Rom.h"
+#include "StateSerializer.h"
 #include <array>
 
 const size_t kPrgBankCount = 8;
@@ -24,6 +25,8 @@ class Mapper
 public:
 	// Public interface mostly for Cartridge
 
+	static const uint32 kNoIrq = 0xFFFFFFFF; // See GetScanlinesToIrq
+
 	void Initialize(size_t numPrgBanks, size_t numChrBanks, size_t numSavBanks)
 	{
 		m_nametableMirroring = NameTableMirroring::Undefined;
@@ -33,6 +36,8 @@ public:
 		m_canWritePrgMemory = false;
 		m_canWriteChrMemory = false;
 		m_canWriteSavMemory = true;
+		m_prgMappingChanged = true;
+		m_ppuMappingChanged = true;
 
 		if (m_numChrBanks == 0)
 		{
@@ -52,8 +57,41 @@ public:
 	virtual void PostInitialize() = 0;
 	virtual void OnCpuWrite(uint16 cpuAddress, uint8 value) = 0;
 
+	// Bank sizes are not serialized, the mapper must have been initialized for the same cartridge
+	void Serialize(StateSerializer& serializer)
+	{
+		serializer.ValueAs<uint8>(m_nametableMirroring);
+		for (size_t i = 0; i < kPrgBankCount; ++i)
+		{
+			serializer.ValueAs<uint32>(m_prgBankIndices[i]);
+		}
+		for (size_t i = 0; i < kChrBankCount; ++i)
+		{
+			serializer.ValueAs<uint32>(m_chrBankIndices[i]);
+		}
+		for (size_t i = 0; i < kSavBankCount; ++i)
+		{
+			serializer.ValueAs<uint32>(m_savBankIndices[i]);
+		}
+		serializer.Value(m_canWritePrgMemory);
+		serializer.Value(m_canWriteChrMemory);
+		serializer.Value(m_canWriteSavMemory);
+
+		SerializeRegisters(serializer);
+
+		if (serializer.IsLoading())
+		{
+			m_prgMappingChanged = true;
+			m_ppuMappingChanged = true;
+		}
+	}
+
 	NameTableMirroring GetNameTableMirroring() const { return m_nametableMirroring; }
 
+	// Returns how many scanline counter clocks (see Cartridge::HACK_OnScanline) are left until the mapper signals an
+	// IRQ, counting the one that signals it, or kNoIrq if it can't signal one without a register write first.
+	virtual uint32 GetScanlinesToIrq() const { return kNoIrq; }
+
 	bool CanWritePrgMemory() const { return m_canWritePrgMemory; }
 	bool CanWriteChrMemory() const { return m_canWriteChrMemory; }
 	bool CanWriteSavMemory() const { return m_canWriteSavMemory; }
@@ -62,6 +100,22 @@ public:
 	size_t GetMappedChrBankIndex(size_t ppuBankIndex) { return m_chrBankIndices[ppuBankIndex]; }
 	size_t GetMappedSavBankIndex(size_t cpuBankIndex) { return m_savBankIndices[cpuBankIndex]; }
 
+	// Returns true if PRG or save RAM banks, or save RAM write access, changed since last call
+	bool TestAndClearPrgMappingChanged()
+	{
+		const bool result = m_prgMappingChanged;
+		m_prgMappingChanged = false;
+		return result;
+	}
+
+	// Returns true if CHR banks or name table mirroring changed since last call
+	bool TestAndClearPpuMappingChanged()
+	{
+		const bool result = m_ppuMappingChanged;
+		m_ppuMappingChanged = false;
+		return result;
+	}
+
 	size_t PrgMemorySize() const { return m_numPrgBanks * kPrgBankSize; }
 	size_t ChrMemorySize() const { return m_numChrBanks * kChrBankSize; }
 	size_t SavMemorySize() const { return m_numSavBanks * kSavBankSize; }
@@ -80,7 +134,10 @@ public:
 protected:
 	// Protected interface for derived Mapper implementations
 
-	void SetNameTableMirroring(NameTableMirroring value) { m_nametableMirroring = value; }
+	// Serializes mapper specific registers, bank mappings and mirroring are serialized by Mapper
+	virtual void SerializeRegisters(StateSerializer& /*serializer*/) {}
+
+	void SetNameTableMirroring(NameTableMirroring value) { m_nametableMirroring = value; m_ppuMappingChanged = true; }
 
 	void SetPrgBankIndex4k(size_t cpuBankIndex, size_t cartBankIndex);
 	void SetPrgBankIndex8k(size_t cpuBankIndex, size_t cartBankIndex);
@@ -95,7 +152,7 @@ protected:
 
 	void SetCanWritePrgMemory(bool enabled) { m_canWritePrgMemory = enabled; }
 	void SetCanWriteChrMemory(bool enabled) { m_canWriteChrMemory = enabled; }
-	void SetCanWriteSavMemory(bool enabled) { m_canWriteSavMemory = enabled; }
+	void SetCanWriteSavMemory(bool enabled) { m_canWriteSavMemory = enabled; m_prgMappingChanged = true; }
 
 private:
 	NameTableMirroring m_nametableMirroring;
@@ -108,12 +165,15 @@ private:
 	bool m_canWritePrgMemory;
 	bool m_canWriteChrMemory;
 	bool m_canWriteSavMemory;
+	bool m_prgMappingChanged;
+	bool m_ppuMappingChanged;
 };
 
 
 FORCEINLINE void Mapper::SetPrgBankIndex4k(size_t cpuBankIndex, size_t cartBankIndex)
 {
 	m_prgBankIndices[cpuBankIndex] = cartBankIndex;
+	m_prgMappingChanged = true;
 }
 
 FORCEINLINE void Mapper::SetPrgBankIndex8k(size_t cpuBankIndex, size_t cartBankIndex)
@@ -122,11 +182,13 @@ FORCEINLINE void Mapper::SetPrgBankIndex8k(size_t cpuBankIndex, size_t cartBankI
 	cartBankIndex *= 2;
 	m_prgBankIndices[cpuBankIndex] = cartBankIndex;
 	m_prgBankIndices[cpuBankIndex + 1] = cartBankIndex + 1;
+	m_prgMappingChanged = true;
 }
 
 FORCEINLINE void Mapper::SetSavBankIndex8k(size_t cpuBankIndex, size_t cartBankIndex)
 {
 	m_savBankIndices[cpuBankIndex] = cartBankIndex;
+	m_prgMappingChanged = true;
 }
 
 FORCEINLINE void Mapper::SetPrgBankIndex16k(size_t cpuBankIndex, size_t cartBankIndex)
@@ -137,6 +199,7 @@ FORCEINLINE void Mapper::SetPrgBankIndex16k(size_t cpuBankIndex, size_t cartBank
 	m_prgBankIndices[cpuBankIndex + 1] = cartBankIndex + 1;
 	m_prgBankIndices[cpuBankIndex + 2] = cartBankIndex + 2;
 	m_prgBankIndices[cpuBankIndex + 3] = cartBankIndex + 3;
+	m_prgMappingChanged = true;
 }
 
 FORCEINLINE void Mapper::SetPrgBankIndex32k(size_t cpuBankIndex, size_t cartBankIndex)
@@ -151,11 +214,13 @@ FORCEINLINE void Mapper::SetPrgBankIndex32k(size_t cpuBankIndex, size_t cartBank
 	m_prgBankIndices[cpuBankIndex + 5] = cartBankIndex + 5;
 	m_prgBankIndices[cpuBankIndex + 6] = cartBankIndex + 6;
 	m_prgBankIndices[cpuBankIndex + 7] = cartBankIndex + 7;
+	m_prgMappingChanged = true;
 }
 
 FORCEINLINE void Mapper::SetChrBankIndex1k(size_t ppuBankIndex, size_t cartBankIndex)
 {
 	m_chrBankIndices[ppuBankIndex] = cartBankIndex;
+	m_ppuMappingChanged = true;
 }
 
 FORCEINLINE void Mapper::SetChrBankIndex4k(size_t ppuBankIndex, size_t cartBankIndex)
@@ -166,6 +231,7 @@ FORCEINLINE void Mapper::SetChrBankIndex4k(size_t ppuBankIndex, size_t cartBankI
 	m_chrBankIndices[ppuBankIndex + 1] = cartBankIndex + 1;
 	m_chrBankIndices[ppuBankIndex + 2] = cartBankIndex + 2;
 	m_chrBankIndices[ppuBankIndex + 3] = cartBankIndex + 3;
+	m_ppuMappingChanged = true;
 }
 
 FORCEINLINE void Mapper::SetChrBankIndex8k(size_t ppuBankIndex, size_t cartBankIndex)
@@ -180,4 +246,5 @@ FORCEINLINE void Mapper::SetChrBankIndex8k(size_t ppuBankIndex, size_t cartBankI
 	m_chrBankIndices[ppuBankIndex + 5] = cartBankIndex + 5;
 	m_chrBankIndices[ppuBankIndex + 6] = cartBankIndex + 6;
 	m_chrBankIndices[ppuBankIndex + 7] = cartBankIndex + 7;
+	m_ppuMappingChanged = true;
 }
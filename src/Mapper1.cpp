@@ -19,6 +19,15 @@ void Mapper1::PostInitialize()
 	UpdateMirroring();
 }
 
+void Mapper1::SerializeRegisters(StateSerializer& serializer)
+{
+	m_loadReg.Serialize(serializer);
+	serializer.Value(m_controlReg);
+	serializer.Value(m_chrReg0);
+	serializer.Value(m_chrReg1);
+	serializer.Value(m_prgReg);
+}
+
 void Mapper1::OnCpuWrite(uint16 cpuAddress, uint8 value)
 {
 	if (cpuAddress < 0x8000)
@@ -14,6 +14,9 @@ public:
 	virtual void PostInitialize();
 	virtual void OnCpuWrite(uint16 cpuAddress, uint8 value);
 
+protected:
+	virtual void SerializeRegisters(StateSerializer& serializer);
+
 private:
 	void UpdatePrgBanks();
 	void UpdateChrBanks();
@@ -45,6 +48,12 @@ private:
 
 		uint8 Value() { return m_value.Value(); }
 
+		void Serialize(StateSerializer& serializer)
+		{
+			serializer.Value(m_value);
+			serializer.Value(m_bitsWritten);
+		}
+
 	private:
 		Bitfield8 m_value;
 		uint8 m_bitsWritten;
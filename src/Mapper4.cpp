@@ -12,6 +12,18 @@ void Mapper4::PostInitialize()
 	m_irqPending = false;
 }
 
+void Mapper4::SerializeRegisters(StateSerializer& serializer)
+{
+	serializer.Value(m_prgBankMode);
+	serializer.Value(m_chrBankMode);
+	serializer.Value(m_nextBankToUpdate);
+	serializer.Value(m_irqEnabled);
+	serializer.Value(m_irqCounter);
+	serializer.Value(m_irqReloadPending);
+	serializer.Value(m_irqReloadValue);
+	serializer.Value(m_irqPending);
+}
+
 void Mapper4::OnCpuWrite(uint16 cpuAddress, uint8 value)
 {
 	const uint16 mask = BITS(15,14,13,0); // Top 3 bits for register, low bit for high/low part of register
@@ -100,6 +112,18 @@ void Mapper4::UpdateBank(uint8 value)
 	}
 }
 
+uint32 Mapper4::GetScanlinesToIrq() const
+{
+	if (!m_irqEnabled)
+		return kNoIrq;
+
+	// Next clock reloads the counter, and a reload value of 0 keeps reloading it (see HACK_OnScanline)
+	if (m_irqCounter == 0 || m_irqReloadPending)
+		return (m_irqReloadValue == 0)? kNoIrq : 1 + m_irqReloadValue;
+
+	return m_irqCounter;
+}
+
 void Mapper4::HACK_OnScanline()
 {
 	if (m_irqCounter == 0 || m_irqReloadPending)
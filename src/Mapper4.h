@@ -21,6 +21,10 @@ public:
 	}
 
 	void HACK_OnScanline();
+	virtual uint32 GetScanlinesToIrq() const;
+
+protected:
+	virtual void SerializeRegisters(StateSerializer& serializer);
 
 private:
 	void UpdateFixedBanks();
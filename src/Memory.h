@@ -39,7 +39,12 @@ protected:
 template <typename StorageType>
 class Memory : public StorageType
 {
+	// Members of a dependent base class must be named explicitly for standard compilers (GCC/Clang)
+	using StorageType::m_memory;
+
 public:
+	using StorageType::Size;
+
 	uint8 Read(uint16 address)
 	{
 		return m_memory[address];
@@ -7,20 +7,33 @@
 
 CpuMemoryBus::CpuMemoryBus()
 	: m_ppu(nullptr)
+	, m_ppuMemoryBus(nullptr)
 	, m_cartridge(nullptr)
 	, m_cpuInternalRam(nullptr)
 {
 }
 
-void CpuMemoryBus::Initialize(Cpu& cpu, Ppu& ppu, Cartridge& cartridge, CpuInternalRam& cpuInternalRam)
+void CpuMemoryBus::Initialize(Cpu& cpu, Ppu& ppu, PpuMemoryBus& ppuMemoryBus, Cartridge& cartridge, CpuInternalRam& cpuInternalRam)
 {
 	m_cpu = &cpu;
 	m_ppu = &ppu;
+	m_ppuMemoryBus = &ppuMemoryBus;
 	m_cartridge = &cartridge;
 	m_cpuInternalRam = &cpuInternalRam;
+
+	m_readPages.fill(nullptr);
+	m_writePages.fill(nullptr);
+
+	// Internal RAM (and its mirrors) is always directly accessible
+	for (size_t page = 0; page < CpuMemory::kInternalRamEnd / kPageSize; ++page)
+	{
+		uint8* memory = m_cpuInternalRam->GetCpuPtr(TO16(page * kPageSize));
+		m_readPages[page] = memory;
+		m_writePages[page] = memory;
+	}
 }
 
-uint8 CpuMemoryBus::Read(uint16 cpuAddress)
+uint8 CpuMemoryBus::ReadSlow(uint16 cpuAddress)
 {
 	if (cpuAddress >= CpuMemory::kExpansionRomBase)
 	{
@@ -39,10 +52,47 @@ uint8 CpuMemoryBus::Read(uint16 cpuAddress)
 }
 
 void CpuMemoryBus::Write(uint16 cpuAddress, uint8 value)
+{
+	if (uint8* page = m_writePages[cpuAddress / kPageSize])
+	{
+		page[cpuAddress & (kPageSize - 1)] = value;
+
+		if (cpuAddress < CpuMemory::kInternalRamEnd)
+		{
+			m_cpu->InvalidateDecodedInstructions(cpuAddress);
+		}
+		return;
+	}
+	WriteSlow(cpuAddress, value);
+}
+
+void CpuMemoryBus::WriteSlow(uint16 cpuAddress, uint8 value)
 {
 	if (cpuAddress >= CpuMemory::kExpansionRomBase)
 	{
+		// Mapper may switch CHR banks or change mirroring, so PPU must render up to this point first
+		m_ppu->CatchUp();
 		m_cartridge->HandleCpuWrite(cpuAddress, value);
+
+		if (cpuAddress >= CpuMemory::kPrgRomBase && m_cartridge->CanWritePrgMemory())
+		{
+			m_cpu->InvalidateDecodedInstructions(cpuAddress);
+		}
+
+		// Write may have switched banks
+		if (m_cartridge->TestAndClearPrgMappingChanged())
+		{
+			UpdateCartridgePages();
+		}
+
+		// Or CHR banks and name table mirroring
+		if (m_cartridge->TestAndClearPpuMappingChanged())
+		{
+			m_ppuMemoryBus->UpdatePages();
+		}
+
+		// Or enable the mapper IRQ, or change when it fires
+		m_ppu->UpdateCyclesToNextEvent();
 		return;
 	}
 	else if (cpuAddress >= CpuMemory::kCpuRegistersBase)
@@ -57,6 +107,56 @@ void CpuMemoryBus::Write(uint16 cpuAddress, uint8 value)
 	}
 
 	m_cpuInternalRam->HandleCpuWrite(cpuAddress, value);
+	m_cpu->InvalidateDecodedInstructions(cpuAddress);
+}
+
+void CpuMemoryBus::UpdateCartridgePages()
+{
+	m_cartridge->TestAndClearPrgMappingChanged();
+
+	for (size_t page = CpuMemory::kSaveRamBase / kPageSize; page < kNumPages; ++page)
+	{
+		const uint16 cpuAddress = TO16(page * kPageSize);
+		m_readPages[page] = m_cartridge->GetCpuReadPtr(cpuAddress);
+		m_writePages[page] = m_cartridge->GetCpuWritePtr(cpuAddress);
+	}
+}
+
+void CpuMemoryBus::SpriteDmaTransfer(uint16 srcCpuAddress)
+{
+	assert(srcCpuAddress % kPageSize == 0);
+
+	// Copy the whole page at once from RAM or cartridge memory
+	if (const uint8* page = m_readPages[srcCpuAddress / kPageSize])
+	{
+		m_ppu->WriteSpriteMemory(page);
+		return;
+	}
+
+	// Page may contain registers with side effects on read
+	for (size_t i = 0; i < kPageSize; ++i)
+	{
+		const uint8 value = Read(TO16(srcCpuAddress + i));
+		Write(CpuMemory::kPpuSprRamIoReg, value);
+	}
+}
+
+bool CpuMemoryBus::Peek(uint16 cpuAddress, uint8& value)
+{
+	if (cpuAddress < CpuMemory::kInternalRamEnd)
+	{
+		value = m_cpuInternalRam->HandleCpuRead(cpuAddress);
+		return true;
+	}
+	else if (cpuAddress < CpuMemory::kPpuRegistersEnd)
+	{
+		if (cpuAddress % CpuMemory::kPpuRegistersSize == CpuMemory::kPpuStatusReg % CpuMemory::kPpuRegistersSize)
+		{
+			return m_ppu->PeekStatusRegister(value);
+		}
+	}
+
+	return false;
 }
 
 
@@ -70,28 +170,93 @@ void PpuMemoryBus::Initialize(Ppu& ppu, Cartridge& cartridge)
 {
 	m_ppu = &ppu;
 	m_cartridge = &cartridge;
+
+	m_pages.fill(nullptr);
 }
 
-uint8 PpuMemoryBus::Read(uint16 ppuAddress)
+void PpuMemoryBus::Write(uint16 ppuAddress, uint8 value)
 {
 	ppuAddress %= PpuMemory::kPpuMemorySize; // Handle mirroring above 16K to 64K
 
+	//@NOTE: The palette can only be accessed directly by the PPU (no address lines go out to Cartridge)
 	if (ppuAddress >= PpuMemory::kVRamBase)
 	{
-		return m_ppu->HandlePpuRead(ppuAddress);
+		m_pages[ppuAddress / kPageSize][ppuAddress & (kPageSize - 1)] = value;
+		return;
 	}
 
-	return m_cartridge->HandlePpuRead(ppuAddress);
+	// Cartridge must see CHR-RAM writes to decode tiles again
+	m_cartridge->HandlePpuWrite(ppuAddress, value);
 }
 
-void PpuMemoryBus::Write(uint16 ppuAddress, uint8 value)
+void PpuMemoryBus::UpdatePages()
 {
-	ppuAddress %= PpuMemory::kPpuMemorySize; // Handle mirroring above 16K to 64K
+	m_cartridge->TestAndClearPpuMappingChanged();
 
-	if (ppuAddress >= PpuMemory::kVRamBase)
+	// Pattern tables
+	for (size_t page = 0; page < PpuMemory::kChrRomEnd / kPageSize; ++page)
 	{
-		return m_ppu->HandlePpuWrite(ppuAddress, value);
+		m_pages[page] = m_cartridge->GetChrPtr(TO16(page * kPageSize));
 	}
 
-	return m_cartridge->HandlePpuWrite(ppuAddress, value);
+	// Name tables: 2K of CIRAM hold 2 of the 4 name tables, the other 2 are mirrored off the first
+	// two, unless the cart supplies an extra 2K.
+	uint8* vram0 = m_ppu->GetVRamPtr(0);
+	uint8* vram1 = m_ppu->GetVRamPtr(KB(1));
+	uint8* nameTables[PpuMemory::kNumMaxNameTables] = {};
+
+	switch (m_cartridge->GetNameTableMirroring())
+	{
+	case NameTableMirroring::Vertical:
+		// Vertical mirroring (horizontal scrolling)
+		// A B
+		// A B
+		nameTables[0] = vram0; nameTables[1] = vram1;
+		nameTables[2] = vram0; nameTables[3] = vram1;
+		break;
+
+	case NameTableMirroring::Horizontal:
+		// Horizontal mirroring (vertical scrolling)
+		// A A
+		// B B
+		nameTables[0] = vram0; nameTables[1] = vram0;
+		nameTables[2] = vram1; nameTables[3] = vram1;
+		break;
+
+	case NameTableMirroring::OneScreenUpper:
+		// A A
+		// A A
+		nameTables[0] = nameTables[1] = nameTables[2] = nameTables[3] = vram0;
+		break;
+
+	case NameTableMirroring::OneScreenLower:
+		// B B
+		// B B
+		nameTables[0] = nameTables[1] = nameTables[2] = nameTables[3] = vram1;
+		break;
+
+	case NameTableMirroring::FourScreen:
+		// A B
+		// C D
+		nameTables[0] = vram0; nameTables[1] = vram1;
+		nameTables[2] = m_cartridge->GetFourScreenVRamPtr(0);
+		nameTables[3] = m_cartridge->GetFourScreenVRamPtr(KB(1));
+		break;
+
+	default:
+		assert(false);
+		break;
+	}
+
+	// $3000-$3FFF mirrors $2000-$2FFF (palettes at $3F00 are handled by the PPU)
+	for (size_t page = PpuMemory::kVRamBase / kPageSize; page < kNumPages; ++page)
+	{
+		m_pages[page] = nameTables[page % PpuMemory::kNumMaxNameTables];
+	}
+}
+
+const uint8* PpuMemoryBus::ReadDecodedChrRow(uint16 ppuAddress, bool flipHorz)
+{
+	assert(ppuAddress < PpuMemory::kChrRomEnd);
+	return m_cartridge->GetDecodedChrRow(ppuAddress, flipHorz);
 }
@@ -2,9 +2,12 @@
 
 #include "Base.h"
 #include "Memory.h"
+#include "MemoryMap.h"
+#include <array>
 
 class Cpu;
 class Ppu;
+class PpuMemoryBus;
 class Cartridge;
 class CpuInternalRam;
 
@@ -12,18 +15,49 @@ class CpuMemoryBus
 {
 public:
 	CpuMemoryBus();
-	void Initialize(Cpu& cpu, Ppu& ppu, Cartridge& cartridge, CpuInternalRam& cpuInternalRam);
+	void Initialize(Cpu& cpu, Ppu& ppu, PpuMemoryBus& ppuMemoryBus, Cartridge& cartridge, CpuInternalRam& cpuInternalRam);
 
 	uint8 Read(uint16 cpuAddress);
 	void Write(uint16 cpuAddress, uint8 value);
 
+	// Must be called when a new cartridge is loaded. Changes to cartridge memory mapping from CPU writes
+	// are detected automatically.
+	void UpdateCartridgePages();
+
+	// Copies the 256 byte page at srcCpuAddress to PPU sprite memory, same as reading each byte and writing it to $2004
+	void SpriteDmaTransfer(uint16 srcCpuAddress);
+
+	// Sets value to what a read at this address would return. Returns false if the read could have side
+	// effects; only internal RAM and the PPU status register are supported, other addresses return false.
+	bool Peek(uint16 cpuAddress, uint8& value);
+
 private:
+	uint8 ReadSlow(uint16 cpuAddress);
+	void WriteSlow(uint16 cpuAddress, uint8 value);
+
 	Cpu* m_cpu;
 	Ppu* m_ppu;
+	PpuMemoryBus* m_ppuMemoryBus;
 	Cartridge* m_cartridge;
 	CpuInternalRam* m_cpuInternalRam;
+
+	// Direct pointers to memory for each 256 byte page of the address space, or nullptr
+	// if accesses to the page must go through the component handlers (registers).
+	static const size_t kPageSize = 256;
+	static const size_t kNumPages = 0x10000 / kPageSize;
+	std::array<uint8*, kNumPages> m_readPages;
+	std::array<uint8*, kNumPages> m_writePages;
 };
 
+FORCEINLINE uint8 CpuMemoryBus::Read(uint16 cpuAddress)
+{
+	if (const uint8* page = m_readPages[cpuAddress / kPageSize])
+	{
+		return page[cpuAddress & (kPageSize - 1)];
+	}
+	return ReadSlow(cpuAddress);
+}
+
 class PpuMemoryBus
 {
 public:
@@ -33,7 +67,26 @@ public:
 	uint8 Read(uint16 ppuAddress);
 	void Write(uint16 ppuAddress, uint8 value);
 
+	// Must be called when a new cartridge is loaded. Changes to CHR banks or name table mirroring from
+	// CPU writes are detected by CpuMemoryBus, which calls this.
+	void UpdatePages();
+
+	// Returns decoded pattern table row (see Cartridge::GetDecodedChrRow)
+	const uint8* ReadDecodedChrRow(uint16 ppuAddress, bool flipHorz);
+
 private:
 	Ppu* m_ppu;
 	Cartridge* m_cartridge;
+
+	// Direct pointers to memory for each 1K page of the address space: pattern table banks, then
+	// name tables (CIRAM or four-screen cartridge memory) with their mirrors.
+	static const size_t kPageSize = KB(1);
+	static const size_t kNumPages = PpuMemory::kPpuMemorySize / kPageSize;
+	std::array<uint8*, kNumPages> m_pages;
 };
+
+FORCEINLINE uint8 PpuMemoryBus::Read(uint16 ppuAddress)
+{
+	ppuAddress %= PpuMemory::kPpuMemorySize; // Handle mirroring above 16K to 64K
+	return m_pages[ppuAddress / kPageSize][ppuAddress & (kPageSize - 1)];
+}
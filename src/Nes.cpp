@@ -3,6 +3,13 @@
 #include "Rom.h"
 #include "System.h"
 #include "Renderer.h"
+#include "Debugger.h"
+#include "StateSerializer.h"
+
+namespace
+{
+	const uint32 kSaveStateMagic = 0x5453454E; // "NEST"
+}
 
 Nes::~Nes()
 {
@@ -12,13 +19,18 @@ Nes::~Nes()
 
 void Nes::Initialize()
 {
-	m_cpu.Initialize(m_cpuMemoryBus);
+	m_cpu.Initialize(m_cpuMemoryBus, m_cartridge);
 	m_ppu.Initialize(m_ppuMemoryBus, *this);
 	m_cartridge.Initialize(*this);
 	m_cpuInternalRam.Initialize();
-	m_cpuMemoryBus.Initialize(m_cpu, m_ppu, m_cartridge, m_cpuInternalRam);
+	m_cpuMemoryBus.Initialize(m_cpu, m_ppu, m_ppuMemoryBus, m_cartridge, m_cpuInternalRam);
 	m_ppuMemoryBus.Initialize(m_ppu, m_cartridge);
+	m_unsyncedCpuCycles = 0;
 	m_turbo = false;
+	m_renderInterval = 1;
+	m_frameCount = 0;
+	m_cpuBlockExecution = false;
+	m_idleLoopSkipping = !DEBUGGING_ENABLED; // Debugger would not see skipped instructions
 }
 
 RomHeader Nes::LoadRom(const char* file)
@@ -27,6 +39,8 @@ RomHeader Nes::LoadRom(const char* file)
 	m_cartridge.WriteSaveRamFile();
 
 	RomHeader romHeader = m_cartridge.LoadRom(file);
+	m_cpuMemoryBus.UpdateCartridgePages();
+	m_ppuMemoryBus.UpdatePages();
 	return romHeader;
 }
 
@@ -35,23 +49,85 @@ void Nes::Reset()
 	m_frameTimer.Reset();
 	m_cpu.Reset();
 	m_ppu.Reset();
+	m_unsyncedCpuCycles = 0;
 	//@TODO: Maybe reset cartridge (and mapper)?
 
 	m_lastSaveRamTime = System::GetTimeSec();
 }
 
+void Nes::SaveState(std::vector<uint8>& state)
+{
+	state.clear();
+	StateSerializer serializer(state);
+	SerializeHeader(serializer);
+	SerializeMachine(serializer);
+}
+
+void Nes::LoadState(const std::vector<uint8>& state)
+{
+	StateSerializer serializer(state.data(), state.size());
+	SerializeHeader(serializer); // Fails if the state is for a different rom
+
+	// States saved with the same rom all have the same size, so check it before overwriting anything: loading can't
+	// then fail half way through and leave the machine partially overwritten.
+	SaveState(m_expectedState);
+	if (state.size() != m_expectedState.size())
+		FAIL("Save state has unexpected size: %d bytes (expected %d)", static_cast<int>(state.size()), static_cast<int>(m_expectedState.size()));
+
+	SerializeMachine(serializer);
+	assert(serializer.IsAtEnd());
+
+	// Memory mapped from the cartridge is rebuilt from the restored mapper state
+	m_cpuMemoryBus.UpdateCartridgePages();
+	m_ppuMemoryBus.UpdatePages();
+}
+
+void Nes::SerializeHeader(StateSerializer& serializer)
+{
+	if (!m_cartridge.IsRomLoaded())
+		FAIL("No rom loaded");
+
+	uint32 magic = kSaveStateMagic;
+	uint32 version = StateSerializer::kVersion;
+	serializer.Value(magic);
+	serializer.Value(version);
+	if (magic != kSaveStateMagic)
+		FAIL("Invalid save state");
+	if (version != StateSerializer::kVersion)
+		FAIL("Unsupported save state version: %d (expected %d)", version, StateSerializer::kVersion);
+
+	m_cartridge.SerializeRomId(serializer);
+}
+
+void Nes::SerializeMachine(StateSerializer& serializer)
+{
+	m_cartridge.Serialize(serializer);
+	serializer.Value(m_unsyncedCpuCycles);
+	m_cpu.Serialize(serializer);
+	m_cpuInternalRam.Serialize(serializer);
+	m_ppu.Serialize(serializer);
+}
+
 void Nes::ExecuteFrame(bool paused)
 {
 	if (!paused)
 	{
+		const bool renderFrame = (m_renderInterval != 0) && (m_frameCount % m_renderInterval == 0);
+		++m_frameCount;
+
+		m_ppu.SetSkipRendering(!renderFrame);
 		ExecuteCpuAndPpuFrame();
-		m_ppu.RenderFrame();
+
+		if (renderFrame)
+		{
+			m_ppu.RenderFrame();
+		}
 	}
 
-	// Just rendered a screen; FrameTimer will wait until we hit 60 FPS (if machine is too fast).
+	// Just rendered a screen; FrameTimer will wait until we hit the NTSC frame rate (if machine is too fast).
 	// If turbo mode is enabled, it won't wait.
-	const float32 minFrameTime = 1.0f/60.0f;
-	m_frameTimer.Update(m_turbo? 0.f: minFrameTime);
+	const float64 minFrameTime = 1.0 / kNtscFrameRate;
+	m_frameTimer.Update(m_turbo? 0.0 : minFrameTime);
 
 	// Auto-save sram at fixed intervals
 	const float64 saveInterval = 5.0;
@@ -63,6 +139,20 @@ void Nes::ExecuteFrame(bool paused)
 	}
 }
 
+uint32 Nes::TakeUnsyncedCpuCycles()
+{
+	const uint32 cpuCycles = m_unsyncedCpuCycles;
+	m_unsyncedCpuCycles = 0;
+	return cpuCycles;
+}
+
+uint32 Nes::GetCpuCyclesToNextPpuEvent() const
+{
+	const uint32 ppuCyclesToNextEvent = m_ppu.GetPpuCyclesToNextEvent();
+	assert(m_unsyncedCpuCycles * 3 <= ppuCyclesToNextEvent);
+	return (ppuCyclesToNextEvent - m_unsyncedCpuCycles * 3) / 3;
+}
+
 void Nes::ExecuteCpuAndPpuFrame()
 {
 	bool completedFrame = false;
@@ -71,10 +161,42 @@ void Nes::ExecuteCpuAndPpuFrame()
 	{
 		// Update CPU, get number of cycles elapsed
 		uint32 cpuCycles;
-		m_cpu.Execute(cpuCycles);
+		if (m_cpuBlockExecution)
+		{
+			m_cpu.ExecuteBlock(GetCpuCyclesToNextPpuEvent(), cpuCycles);
+		}
+		else
+		{
+			m_cpu.Execute(cpuCycles);
+		}
+
+		// Only update the PPU once the CPU goes past its next event. Until then, the PPU is only updated when
+		// the CPU accesses it (or a mapper register) and it catches up with the CPU (see Ppu::CatchUp).
+		m_unsyncedCpuCycles += cpuCycles;
+		if (m_unsyncedCpuCycles * 3 > m_ppu.GetPpuCyclesToNextEvent())
+		{
+			m_ppu.Execute(TakeUnsyncedCpuCycles() * 3, completedFrame);
+		}
+
+		if (m_idleLoopSkipping && !completedFrame)
+		{
+			SkipIdleLoop();
+		}
+	}
+}
+
+void Nes::SkipIdleLoop()
+{
+	// Each skipped iteration only advances time for the PPU. We stop before the iteration that would reach the next PPU
+	// event, and as soon as the loop would read a different value (e.g. sprite 0 hit flag set), so that the loop
+	// exits or gets interrupted at the same cycle as when executing every instruction.
+	uint32 loopCpuCycles;
+	while (m_cpu.IsInIdleLoop(loopCpuCycles))
+	{
+		if (loopCpuCycles > GetCpuCyclesToNextPpuEvent())
+			break;
 
-		// Update PPU with that many cycles
-		const uint32 ppuCycles = cpuCycles * 3;
-		m_ppu.Execute(ppuCycles, completedFrame);
+		m_cpu.SkipIdleLoopIteration(loopCpuCycles);
+		m_unsyncedCpuCycles += loopCpuCycles;
 	}
 }
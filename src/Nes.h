@@ -7,6 +7,12 @@
 #include "CpuInternalRam.h"
 #include "MemoryBus.h"
 #include "FrameTimer.h"
+#include <vector>
+
+class StateSerializer;
+
+// CPU clock rate / CPU cycles per frame (341 * 262 PPU cycles, one less on odd frames when rendering) = 60.0988 Hz
+const float64 kNtscFrameRate = 1789773.0 / 29780.5;
 
 class Nes
 {
@@ -20,19 +26,58 @@ public:
 
 	void ExecuteFrame(bool paused);
 
+	// Saves a snapshot of the whole machine, in the versioned binary format of StateSerializer. The state can only
+	// be loaded with the same rom loaded. The buffer's capacity is reused, so saving to the same buffer repeatedly
+	// (e.g. for rewind) doesn't allocate. LoadState fails without modifying the machine if the state was saved with
+	// a different rom, or doesn't have the expected size.
+	void SaveState(std::vector<uint8>& state);
+	void LoadState(const std::vector<uint8>& state);
+
 	void SetTurboEnabled(bool enabled) { m_turbo = enabled; }
 
+	// Where rendered frames go (see VideoSink). Frames are discarded until a sink is set.
+	void SetVideoSink(std::shared_ptr<VideoSink> videoSink) { m_ppu.SetVideoSink(videoSink); }
+
+	// Only renders and presents one out of every renderInterval frames (e.g. for fast-forward), or none if 0.
+	// Skipped frames are still fully emulated.
+	void SetRenderInterval(uint32 renderInterval) { m_renderInterval = renderInterval; }
+	uint32 GetRenderInterval() const { return m_renderInterval; }
+
+	// Rasterizes scanlines on worker threads (see Ppu::SetDeferredRendering)
+	void SetDeferredRenderingEnabled(bool enabled) { m_ppu.SetDeferredRendering(enabled); }
+	bool IsDeferredRenderingEnabled() const { return m_ppu.IsDeferredRendering(); }
+
+	// Executes CPU instructions in translated blocks instead of one at a time (see Cpu::ExecuteBlock)
+	void SetCpuBlockExecutionEnabled(bool enabled) { m_cpuBlockExecution = enabled; }
+	bool IsCpuBlockExecutionEnabled() const { return m_cpuBlockExecution; }
+
+	// Skips iterations of CPU idle loops (e.g. polling $2002 for VBlank) up to the next PPU event (see Cpu::IsInIdleLoop)
+	void SetIdleLoopSkippingEnabled(bool enabled) { m_idleLoopSkipping = enabled; }
+	bool IsIdleLoopSkippingEnabled() const { return m_idleLoopSkipping; }
+
 	void SignalCpuNmi() { m_cpu.Nmi(); }
 	void SignalCpuIrq() { m_cpu.Irq(); }
 
 	float64 GetFps() const { return m_frameTimer.GetFps(); }
-	NameTableMirroring GetNameTableMirroring() const { return m_cartridge.GetNameTableMirroring(); }
+	float64 GetFrameTimeJitter() const { return m_frameTimer.GetJitter(); } // Seconds, see FrameTimer
+	size_t GetNumSkippedFrameUploads() const { return m_ppu.GetNumSkippedFrameUploads(); } // Frames identical to the previous one
+	uint32 GetFrameCount() const { return m_frameCount; }
+	uint32 GetNumWholeScanlines() const { return m_ppu.GetNumWholeScanlines(); } // See Ppu::GetNumWholeScanlines
 	void HACK_OnScanline() { m_cartridge.HACK_OnScanline(); }
+	uint32 GetScanlinesToMapperIrq() const { return m_cartridge.GetScanlinesToIrq(); }
+
+	// Returns CPU cycles executed since the PPU was last updated, and considers them taken by the PPU (see Ppu::CatchUp)
+	uint32 TakeUnsyncedCpuCycles();
+	uint32 GetUnsyncedCpuCycles() const { return m_unsyncedCpuCycles; }
 
 private:
 	friend class DebuggerImpl;
 
+	void SerializeHeader(StateSerializer& serializer);
+	void SerializeMachine(StateSerializer& serializer);
 	void ExecuteCpuAndPpuFrame();
+	void SkipIdleLoop();
+	uint32 GetCpuCyclesToNextPpuEvent() const;
 
 	FrameTimer m_frameTimer;
 	Cpu m_cpu;
@@ -42,6 +87,16 @@ private:
 	CpuMemoryBus m_cpuMemoryBus;
 	PpuMemoryBus m_ppuMemoryBus;
 
+	std::vector<uint8> m_expectedState; // Saved by LoadState to validate the size of the state to load
+
+	// The CPU runs ahead of the PPU until it reaches the next PPU event, or until it accesses a PPU or mapper
+	// register, which makes the PPU catch up first.
+	uint32 m_unsyncedCpuCycles;
+
 	float64 m_lastSaveRamTime;
 	bool m_turbo;
+	uint32 m_renderInterval;
+	uint32 m_frameCount;
+	bool m_cpuBlockExecution;
+	bool m_idleLoopSkipping;
 };
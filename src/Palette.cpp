@@ -0,0 +1,145 @@
+#include "Palette.h"
+#include "Renderer.h"
+#include "CpuFeatures.h"
+
+#if CPU_X86
+	#include <immintrin.h>
+#endif
+
+namespace
+{
+	using namespace Palette;
+
+	Color4 g_baseColors[kNumColors];
+	uint32 g_indexedColors[kNumIndexedColors]; // ARGB for each emphasis mode and color index
+
+	void InitBaseColors()
+	{
+		struct RGB { uint8 r, g, b; };
+
+	#define USE_PALETTE 2
+
+	#if USE_PALETTE == 1
+		// This palette seems more "accurate"
+		// 2C03 and 2C05 palettes (http://wiki.nesdev.com/w/index.php/PPU_palettes#2C03_and_2C05)
+		RGB dac3Palette[] =
+		{
+			{3,3,3},{0,1,4},{0,0,6},{3,2,6},{4,0,3},{5,0,3},{5,1,0},{4,2,0},{3,2,0},{1,2,0},{0,3,1},{0,4,0},{0,2,2},{0,0,0},{0,0,0},{0,0,0},
+			{5,5,5},{0,3,6},{0,2,7},{4,0,7},{5,0,7},{7,0,4},{7,0,0},{6,3,0},{4,3,0},{1,4,0},{0,4,0},{0,5,3},{0,4,4},{0,0,0},{0,0,0},{0,0,0},
+			{7,7,7},{3,5,7},{4,4,7},{6,3,7},{7,0,7},{7,3,7},{7,4,0},{7,5,0},{6,6,0},{3,6,0},{0,7,0},{2,7,6},{0,7,7},{0,0,0},{0,0,0},{0,0,0},
+			{7,7,7},{5,6,7},{6,5,7},{7,5,7},{7,4,7},{7,5,5},{7,6,4},{7,7,2},{7,7,3},{5,7,2},{4,7,3},{2,7,6},{4,6,7},{0,0,0},{0,0,0},{0,0,0}
+		};
+
+		for (uint8 i = 0; i < kNumColors; ++i)
+		{
+			const RGB& c = dac3Palette[i];
+			g_baseColors[i].SetRGBA((uint8(c.r/7.f*255.f)), ((uint8)(c.g/7.f*255.f)), ((uint8)(c.b/7.f*255.f)), 0xFF);
+		}
+	#elif USE_PALETTE == 2
+
+		// This palette seems closer to what fceux does by default
+		// http://nesdev.com/NESTechFAQ.htm#accuratepal
+
+		RGB palette[] =
+		{
+			{0x80,0x80,0x80}, {0x00,0x3D,0xA6}, {0x00,0x12,0xB0}, {0x44,0x00,0x96},
+			{0xA1,0x00,0x5E}, {0xC7,0x00,0x28}, {0xBA,0x06,0x00}, {0x8C,0x17,0x00},
+			{0x5C,0x2F,0x00}, {0x10,0x45,0x00}, {0x05,0x4A,0x00}, {0x00,0x47,0x2E},
+			{0x00,0x41,0x66}, {0x00,0x00,0x00}, {0x05,0x05,0x05}, {0x05,0x05,0x05},
+			{0xC7,0xC7,0xC7}, {0x00,0x77,0xFF}, {0x21,0x55,0xFF}, {0x82,0x37,0xFA},
+			{0xEB,0x2F,0xB5}, {0xFF,0x29,0x50}, {0xFF,0x22,0x00}, {0xD6,0x32,0x00},
+			{0xC4,0x62,0x00}, {0x35,0x80,0x00}, {0x05,0x8F,0x00}, {0x00,0x8A,0x55},
+			{0x00,0x99,0xCC}, {0x21,0x21,0x21}, {0x09,0x09,0x09}, {0x09,0x09,0x09},
+			{0xFF,0xFF,0xFF}, {0x0F,0xD7,0xFF}, {0x69,0xA2,0xFF}, {0xD4,0x80,0xFF},
+			{0xFF,0x45,0xF3}, {0xFF,0x61,0x8B}, {0xFF,0x88,0x33}, {0xFF,0x9C,0x12},
+			{0xFA,0xBC,0x20}, {0x9F,0xE3,0x0E}, {0x2B,0xF0,0x35}, {0x0C,0xF0,0xA4},
+			{0x05,0xFB,0xFF}, {0x5E,0x5E,0x5E}, {0x0D,0x0D,0x0D}, {0x0D,0x0D,0x0D},
+			{0xFF,0xFF,0xFF}, {0xA6,0xFC,0xFF}, {0xB3,0xEC,0xFF}, {0xDA,0xAB,0xEB},
+			{0xFF,0xA8,0xF9}, {0xFF,0xAB,0xB3}, {0xFF,0xD2,0xB0}, {0xFF,0xEF,0xA6},
+			{0xFF,0xF7,0x9C}, {0xD7,0xE8,0x95}, {0xA6,0xED,0xAF}, {0xA2,0xF2,0xDA},
+			{0x99,0xFF,0xFC}, {0xDD,0xDD,0xDD}, {0x11,0x11,0x11}, {0x11,0x11,0x11},
+		};
+
+		for (uint8 i = 0; i < kNumColors; ++i)
+		{
+			const RGB& c = palette[i];
+			g_baseColors[i].SetRGBA(c.r, c.g, c.b, 0xFF);
+		}
+	#endif
+	}
+
+	// Each emphasis bit darkens the other two color components. Emphasis mode bits are red, green, and blue
+	// (NTSC PPU, see http://wiki.nesdev.com/w/index.php/NTSC_video#Color_Tint_Bits).
+	void InitIndexedColors()
+	{
+		const float32 kAttenuation = 0.746f;
+
+		for (size_t emphasis = 0; emphasis < kNumEmphasisModes; ++emphasis)
+		{
+			const float32 r = (emphasis & (BIT(1)|BIT(2)))? kAttenuation : 1.f;
+			const float32 g = (emphasis & (BIT(0)|BIT(2)))? kAttenuation : 1.f;
+			const float32 b = (emphasis & (BIT(0)|BIT(1)))? kAttenuation : 1.f;
+
+			for (size_t i = 0; i < kNumColors; ++i)
+			{
+				const Color4& c = g_baseColors[i];
+				g_indexedColors[emphasis * kNumColors + i] =
+					Color4(uint8(c.R() * r), uint8(c.G() * g), uint8(c.B() * b), c.A()).argb;
+			}
+		}
+	}
+
+	typedef void (*ConvertToArgbFunc)(const IndexedColor* indexedColors, uint32* argbColors, size_t numPixels);
+
+	void ConvertToArgbScalar(const IndexedColor* indexedColors, uint32* argbColors, size_t numPixels)
+	{
+		for (size_t i = 0; i < numPixels; ++i)
+		{
+			argbColors[i] = g_indexedColors[indexedColors[i] & (kNumIndexedColors-1)];
+		}
+	}
+
+#if CPU_X86
+	// Gathers 8 colors at a time from the indexed color table
+	TARGET_AVX2
+	void ConvertToArgbAVX2(const IndexedColor* indexedColors, uint32* argbColors, size_t numPixels)
+	{
+		const __m256i indexMask = _mm256_set1_epi32(kNumIndexedColors-1);
+		const int* table = reinterpret_cast<const int*>(g_indexedColors);
+
+		size_t i = 0;
+		for ( ; i + 8 <= numPixels; i += 8)
+		{
+			const __m128i indices16 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indexedColors + i));
+			const __m256i indices = _mm256_and_si256(_mm256_cvtepu16_epi32(indices16), indexMask);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(argbColors + i), _mm256_i32gather_epi32(table, indices, 4));
+		}
+
+		ConvertToArgbScalar(indexedColors + i, argbColors + i, numPixels - i);
+	}
+#endif
+
+	ConvertToArgbFunc SelectConvertToArgb()
+	{
+	#if CPU_X86
+		if (CpuFeatures::HasAVX2())
+			return &ConvertToArgbAVX2;
+	#endif
+		return &ConvertToArgbScalar;
+	}
+}
+
+namespace Palette
+{
+	void Initialize()
+	{
+		InitBaseColors();
+		InitIndexedColors();
+	}
+
+	void ConvertToArgb(const IndexedColor* indexedColors, uint32* argbColors, size_t numPixels)
+	{
+		static const ConvertToArgbFunc func = SelectConvertToArgb();
+		func(indexedColors, argbColors, numPixels);
+	}
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "Base.h"
+
+// Frames are rendered by the PPU as indexed colors: 6-bit color index read from palette memory (bits 0-5),
+// and the color emphasis bits of $2001 (bits 6-8). They are only converted to ARGB for display.
+typedef uint16 IndexedColor;
+
+namespace Palette
+{
+	const size_t kNumColors = 64; // Technically 56 but there is space for 64 and some games access >= 56
+	const size_t kNumEmphasisModes = 8;
+	const size_t kNumIndexedColors = kNumColors * kNumEmphasisModes;
+
+	// Applies the grayscale (bit 0) and color emphasis (bits 5-7) bits of $2001 to a color index from palette
+	// memory. The index is masked to 6 bits, as some roms write values >= 64.
+	FORCEINLINE IndexedColor MakeIndexedColor(uint8 colorIndex, uint8 ppuControl2)
+	{
+		const uint8 colorMask = (ppuControl2 & BIT(0))? 0x30 : 0x3F;
+		return (TO16(ppuControl2 & 0xE0) << 1) | (colorIndex & colorMask);
+	}
+
+	// Builds the emphasis palette, must be called before ConvertToArgb
+	void Initialize();
+
+	// Converts indexed colors to ARGB, using the widest vector instructions supported by the CPU
+	void ConvertToArgb(const IndexedColor* indexedColors, uint32* argbColors, size_t numPixels);
+}
@@ -5,68 +5,23 @@
 #include "Bitfield.h"
 #include "MemoryMap.h"
 #include "Debugger.h"
+#include "PpuCompositor.h"
+#include "Palette.h"
+#include "CpuFeatures.h"
+#include "StateSerializer.h"
 #include <tuple>
+#include <algorithm>
+#include <cstring>
+
+#if CPU_X86
+	#include <emmintrin.h>
+#endif
+#if PLATFORM_WINDOWS && !defined(__GNUC__)
+	#include <intrin.h>
+#endif
 
 namespace
 {
-	const size_t kNumPaletteColors = 64; // Technically 56 but there is space for 64 and some games access >= 56
-	Color4 g_paletteColors[kNumPaletteColors] = {0};
-
-	void InitPaletteColors()
-	{
-		struct RGB { uint8 r, g, b; };
-
-	#define USE_PALETTE 2
-
-	#if USE_PALETTE == 1
-		// This palette seems more "accurate"
-		// 2C03 and 2C05 palettes (http://wiki.nesdev.com/w/index.php/PPU_palettes#2C03_and_2C05)
-		RGB dac3Palette[] =
-		{
-			{3,3,3},{0,1,4},{0,0,6},{3,2,6},{4,0,3},{5,0,3},{5,1,0},{4,2,0},{3,2,0},{1,2,0},{0,3,1},{0,4,0},{0,2,2},{0,0,0},{0,0,0},{0,0,0},
-			{5,5,5},{0,3,6},{0,2,7},{4,0,7},{5,0,7},{7,0,4},{7,0,0},{6,3,0},{4,3,0},{1,4,0},{0,4,0},{0,5,3},{0,4,4},{0,0,0},{0,0,0},{0,0,0},
-			{7,7,7},{3,5,7},{4,4,7},{6,3,7},{7,0,7},{7,3,7},{7,4,0},{7,5,0},{6,6,0},{3,6,0},{0,7,0},{2,7,6},{0,7,7},{0,0,0},{0,0,0},{0,0,0},
-			{7,7,7},{5,6,7},{6,5,7},{7,5,7},{7,4,7},{7,5,5},{7,6,4},{7,7,2},{7,7,3},{5,7,2},{4,7,3},{2,7,6},{4,6,7},{0,0,0},{0,0,0},{0,0,0}
-		};
-
-		for (uint8 i = 0; i < kNumPaletteColors; ++i)
-		{
-			const RGB& c = dac3Palette[i];
-			g_paletteColors[i].SetRGBA((uint8(c.r/7.f*255.f)), ((uint8)(c.g/7.f*255.f)), ((uint8)(c.b/7.f*255.f)), 0xFF);
-		}
-	#elif USE_PALETTE == 2
-
-		// This palette seems closer to what fceux does by default
-		// http://nesdev.com/NESTechFAQ.htm#accuratepal
-
-		RGB palette[] =
-		{
-			{0x80,0x80,0x80}, {0x00,0x3D,0xA6}, {0x00,0x12,0xB0}, {0x44,0x00,0x96},
-			{0xA1,0x00,0x5E}, {0xC7,0x00,0x28}, {0xBA,0x06,0x00}, {0x8C,0x17,0x00},
-			{0x5C,0x2F,0x00}, {0x10,0x45,0x00}, {0x05,0x4A,0x00}, {0x00,0x47,0x2E},
-			{0x00,0x41,0x66}, {0x00,0x00,0x00}, {0x05,0x05,0x05}, {0x05,0x05,0x05},
-			{0xC7,0xC7,0xC7}, {0x00,0x77,0xFF}, {0x21,0x55,0xFF}, {0x82,0x37,0xFA},
-			{0xEB,0x2F,0xB5}, {0xFF,0x29,0x50}, {0xFF,0x22,0x00}, {0xD6,0x32,0x00},
-			{0xC4,0x62,0x00}, {0x35,0x80,0x00}, {0x05,0x8F,0x00}, {0x00,0x8A,0x55},
-			{0x00,0x99,0xCC}, {0x21,0x21,0x21}, {0x09,0x09,0x09}, {0x09,0x09,0x09},
-			{0xFF,0xFF,0xFF}, {0x0F,0xD7,0xFF}, {0x69,0xA2,0xFF}, {0xD4,0x80,0xFF},
-			{0xFF,0x45,0xF3}, {0xFF,0x61,0x8B}, {0xFF,0x88,0x33}, {0xFF,0x9C,0x12},
-			{0xFA,0xBC,0x20}, {0x9F,0xE3,0x0E}, {0x2B,0xF0,0x35}, {0x0C,0xF0,0xA4},
-			{0x05,0xFB,0xFF}, {0x5E,0x5E,0x5E}, {0x0D,0x0D,0x0D}, {0x0D,0x0D,0x0D},
-			{0xFF,0xFF,0xFF}, {0xA6,0xFC,0xFF}, {0xB3,0xEC,0xFF}, {0xDA,0xAB,0xEB},
-			{0xFF,0xA8,0xF9}, {0xFF,0xAB,0xB3}, {0xFF,0xD2,0xB0}, {0xFF,0xEF,0xA6},
-			{0xFF,0xF7,0x9C}, {0xD7,0xE8,0x95}, {0xA6,0xED,0xAF}, {0xA2,0xF2,0xDA},
-			{0x99,0xFF,0xFC}, {0xDD,0xDD,0xDD}, {0x11,0x11,0x11}, {0x11,0x11,0x11},
-		};
-
-		for (uint8 i = 0; i < kNumPaletteColors; ++i)
-		{
-			const RGB& c = palette[i];
-			g_paletteColors[i].SetRGBA(c.r, c.g, c.b, 0xFF);
-		}
-	#endif
-	}
-
 	// EDC BA 98765 43210 *** NOTE bit 15 is missing because it's not used. PPU address space is 14 bits wide, but extra bit is used f or scrolling.
 	// yyy NN YYYYY XXXXX
 	// ||| || ||||| +++++-- coarse X scroll
@@ -171,6 +126,76 @@ namespace
 		return false;
 	}
 
+	FORCEINLINE bool HasAtLeast8BitsSet(uint64 value)
+	{
+		for (int i = 0; i < 7 && value != 0; ++i)
+		{
+			value &= value - 1; // Clear lowest set bit
+		}
+		return value != 0;
+	}
+
+	FORCEINLINE uint32 GetLowestBitIndex(uint64 value)
+	{
+		assert(value != 0);
+	#if defined(__GNUC__)
+		return __builtin_ctzll(value);
+	#elif defined(_M_X64)
+		unsigned long index;
+		_BitScanForward64(&index, value);
+		return index;
+	#else
+		unsigned long index;
+		if (_BitScanForward(&index, static_cast<uint32>(value)))
+			return index;
+		_BitScanForward(&index, static_cast<uint32>(value >> 32));
+		return index + 32;
+	#endif
+	}
+
+	// Returns mask of sprites in range of scanline y, given the Y coordinate of the 64 sprites in OAM.
+	// Same as testing (y >= spriteY && y < spriteY + spriteHeight && spriteY < 240) for each sprite.
+	uint64 GetSpritesInRangeScalar(const uint8* spriteYs, uint8 y, uint8 spriteHeight)
+	{
+		uint64 result = 0;
+		for (uint32 n = 0; n < 64; ++n)
+		{
+			const uint8 spriteY = spriteYs[n];
+			if (static_cast<uint8>(y - spriteY) < spriteHeight && spriteY < kScreenHeight)
+			{
+				result |= (1ull << n);
+			}
+		}
+		return result;
+	}
+
+#if CPU_X86
+	// Tests 16 sprites at a time: (y - spriteY) wraps around if spriteY > y, and spriteY + spriteHeight
+	// never wraps for a sprite at spriteY < 240, so a single unsigned compare tests both bounds.
+	uint64 GetSpritesInRangeSSE2(const uint8* spriteYs, uint8 y, uint8 spriteHeight)
+	{
+		const __m128i yy = _mm_set1_epi8(y);
+		const __m128i maxOffset = _mm_set1_epi8(spriteHeight - 1);
+		const __m128i maxSpriteY = _mm_set1_epi8(kScreenHeight - 1);
+
+		uint64 result = 0;
+		for (uint32 n = 0; n < 64; n += 16)
+		{
+			const __m128i spriteY = _mm_loadu_si128(reinterpret_cast<const __m128i*>(spriteYs + n));
+			const __m128i offset = _mm_sub_epi8(yy, spriteY);
+			const __m128i inRangeY = _mm_cmpeq_epi8(_mm_min_epu8(offset, maxOffset), offset);
+			const __m128i visible = _mm_cmpeq_epi8(_mm_min_epu8(spriteY, maxSpriteY), spriteY);
+			result |= static_cast<uint64>(_mm_movemask_epi8(_mm_and_si128(inRangeY, visible))) << n;
+		}
+		return result;
+	}
+#endif
+
+	const size_t kNumTotalScanlines = 262;
+	const size_t kNumHBlankAndBorderCycles = 85;
+	const size_t kNumScanlineCycles = kScreenWidth + kNumHBlankAndBorderCycles; // 256 + 85 = 341
+	const size_t kNumScreenCycles = kNumScanlineCycles * kNumTotalScanlines; // 89342 cycles per screen
+
 	FORCEINLINE uint32 YXtoPpuCycle(uint32 y, uint32 x)
 	{
 		return y * 341 + x;
@@ -180,6 +205,90 @@ namespace
 	{
 		return cpuCycles * 3;
 	}
+
+	// Scanlines that execute the same dots (see Ppu::ExecuteCycle)
+	namespace ScanlineType
+	{
+		enum Type
+		{
+			Visible,		// 0-238
+			LastVisible,	// 239, frame completes at dot 339
+			VBlankStart,	// 241, VBlank flag is set at dot 1
+			PreRender,		// 261
+			Idle,			// 240, 242-260
+			NumTypes
+		};
+	}
+
+	FORCEINLINE ScanlineType::Type GetScanlineType(uint32 y)
+	{
+		if (y < 239) return ScanlineType::Visible;
+		if (y == 239) return ScanlineType::LastVisible;
+		if (y == 241) return ScanlineType::VBlankStart;
+		if (y == 261) return ScanlineType::PreRender;
+		return ScanlineType::Idle;
+	}
+
+	// Returns true if Ppu::ExecuteCycle does anything on dot x of this type of scanline. Must be kept in sync with it.
+	bool IsDotExecuted(ScanlineType::Type type, bool renderingEnabled, uint32 x)
+	{
+		using namespace ScanlineType;
+
+		switch (type)
+		{
+		case Visible:
+		case LastVisible:
+		case PreRender:
+			if (type != PreRender && x < kScreenWidth) // Render pixel
+				return true;
+			
+			if (type == LastVisible && x == 339) // Frame complete
+				return true;
+			
+			if (type == PreRender && x == 1) // Clear flags
+				return true;
+
+			if (renderingEnabled)
+			{
+				if (x == 64 || x == 256 || x == 257 || x == 260 || x == 320) // OAM2 clear, sprite evaluation and fetch, etc.
+					return true;
+
+				if (type == PreRender && x >= 280 && x <= 304) // Vertical VRAM address copy
+					return true;
+
+				if ((x <= 256 || x >= 321) && x >= 8 && x % 8 == 0) // Background tile fetch
+					return true;
+			}
+			return false;
+
+		case VBlankStart:
+			return x == 1;
+
+		default:
+			return false;
+		}
+	}
+
+	// Next dot executed by Ppu::ExecuteCycle from dot x (included) of a scanline, or kNumScanlineCycles if none
+	uint16 g_nextExecutedDot[ScanlineType::NumTypes][2][kNumScanlineCycles + 1];
+
+	void InitNextExecutedDots()
+	{
+		for (int type = 0; type < ScanlineType::NumTypes; ++type)
+		{
+			for (int renderingEnabled = 0; renderingEnabled < 2; ++renderingEnabled)
+			{
+				uint16* nextDot = g_nextExecutedDot[type][renderingEnabled];
+				nextDot[kNumScanlineCycles] = static_cast<uint16>(kNumScanlineCycles);
+
+				for (int x = static_cast<int>(kNumScanlineCycles) - 1; x >= 0; --x)
+				{
+					const bool executed = IsDotExecuted(static_cast<ScanlineType::Type>(type), renderingEnabled != 0, x);
+					nextDot[x] = executed? static_cast<uint16>(x) : nextDot[x + 1];
+				}
+			}
+		}
+	}
 }
 
 namespace PpuControl1 // $2000 (W)
@@ -265,11 +374,22 @@ namespace
 Ppu::Ppu()
 	: m_ppuMemoryBus(nullptr)
 	, m_nes(nullptr)
-	, m_rendererHolder(new Renderer())
-	, m_renderer(m_rendererHolder.get())
+	, m_videoSinkHolder(new NullVideoSink())
+	, m_videoSink(m_videoSinkHolder.get())
+	, m_frameBuffer(kScreenWidth * kScreenHeight)
+	, m_scanlineLogs(kScreenHeight)
+	, m_deferredRendering(false)
+	, m_firstQueuedScanline(0)
+	, m_numQueuedScanlines(0)
 {
-	InitPaletteColors();
-	m_renderer->Create();
+	Palette::Initialize();
+	InitNextExecutedDots();
+}
+
+void Ppu::SetVideoSink(std::shared_ptr<VideoSink> videoSink)
+{
+	m_videoSinkHolder = videoSink;
+	m_videoSink = m_videoSinkHolder.get();
 }
 
 void Ppu::Initialize(PpuMemoryBus& ppuMemoryBus, Nes& nes)
@@ -282,6 +402,7 @@ void Ppu::Initialize(PpuMemoryBus& ppuMemoryBus, Nes& nes)
 	m_ppuRegisters.Initialize();
 	m_oam.Initialize();
 	m_oam2.Initialize();
+	m_skipRendering = false;
 
 	m_ppuControlReg1 = m_ppuRegisters.RawPtrAs<Bitfield8*>(MapCpuToPpuRegister(CpuMemory::kPpuControlReg1));
 	m_ppuControlReg2 = m_ppuRegisters.RawPtrAs<Bitfield8*>(MapCpuToPpuRegister(CpuMemory::kPpuControlReg2));
@@ -292,6 +413,8 @@ void Ppu::Reset()
 {
 	// See http://wiki.nesdev.com/w/index.php/PPU_power_up_state
 
+	WaitForRasterization();
+
 	WritePpuRegister(CpuMemory::kPpuControlReg1, 0);
 	WritePpuRegister(CpuMemory::kPpuControlReg2, 0);
 	WritePpuRegister(CpuMemory::kPpuVRamAddressReg1, 0);
@@ -304,141 +427,475 @@ void Ppu::Reset()
 	m_vramBufferedValue = 0xDD;
 
 	m_numSpritesToRender = 0;
+	m_spritesInRangeDirty = true;
+	memset(m_spriteLine, 0, sizeof(m_spriteLine));
+	memset(m_bgPixels, 0, sizeof(m_bgPixels));
+	memset(m_spritePixels, 0, sizeof(m_spritePixels));
+	m_renderedPixelsY = 0;
+	m_firstUnflushedPixel = 0;
+	m_numRenderedPixels = 0;
 
 	m_cycle = 0;
+	m_pendingCycles = 0;
 	m_evenFrame = true;
 	m_vblankFlagSetThisFrame = false;
+	m_cyclesToNextEvent = ComputeCyclesToNextEvent();
+	m_numWholeScanlines = 0;
+	m_statusUnchangedCycles = 0;
+}
+
+void Ppu::Serialize(StateSerializer& serializer)
+{
+	if (serializer.IsLoading())
+	{
+		// Queued scanlines were logged from the state being replaced
+		WaitForRasterization();
+	}
+
+	serializer.Memory(m_nameTables);
+	serializer.Memory(m_palette);
+	serializer.Memory(m_oam);
+	serializer.Memory(m_oam2);
+	serializer.Value(m_numSpritesToRender);
+	serializer.Value(m_renderSprite0);
+
+	// Register pointers (e.g. m_ppuControlReg1) point into m_ppuRegisters, so they remain valid
+	serializer.Memory(m_ppuRegisters);
+	serializer.Value(m_vramAndScrollFirstWrite);
+	serializer.Value(m_vramAddress);
+	serializer.Value(m_tempVRamAddress);
+	serializer.Value(m_fineX);
+	serializer.Value(m_vramBufferedValue);
+
+	serializer.Value(m_cycle);
+	serializer.Value(m_pendingCycles);
+	serializer.Value(m_cyclesToNextEvent);
+	serializer.Value(m_evenFrame);
+	serializer.Value(m_vblankFlagSetThisFrame);
+
+	for (size_t i = 0; i < ARRAYSIZE(m_bgTileFetchDataPipeline); ++i)
+	{
+		serializer.Value(m_bgTileFetchDataPipeline[i].pixels);
+		serializer.Value(m_bgTileFetchDataPipeline[i].paletteHighBits);
+	}
+	serializer.Value(m_spriteLine);
+
+	if (serializer.IsLoading())
+	{
+		m_spritesInRangeDirty = true;
+		m_statusUnchangedCycles = 0;
+		m_firstUnflushedPixel = 0; // Frame buffer isn't part of the state
+		m_numRenderedPixels = 0;
+	}
 }
 
 void Ppu::Execute(uint32 ppuCycles, bool& completedFrame)
 {
-	const size_t kNumTotalScanlines = 262;
-	const size_t kNumHBlankAndBorderCycles = 85;
-	const size_t kNumScanlineCycles = kScreenWidth + kNumHBlankAndBorderCycles; // 256 + 85 = 341
-	const size_t kNumScreenCycles = kNumScanlineCycles * kNumTotalScanlines; // 89342 cycles per screen
+	completedFrame = false;
+
+	// Cycles are only executed once we reach the next event, or when the CPU accesses the PPU (see CatchUp).
+	// Nothing can change PPU state in between, so deferred cycles can mostly be executed a scanline at a time.
+	m_pendingCycles += ppuCycles;
+	if (m_pendingCycles > m_cyclesToNextEvent)
+	{
+		ExecutePendingCycles(completedFrame);
+	}
+}
+
+void Ppu::CatchUp()
+{
+	// The CPU may have run ahead without updating us (see Nes::ExecuteCpuAndPpuFrame)
+	m_pendingCycles += CpuToPpuCycles(m_nes->TakeUnsyncedCpuCycles());
+
+	if (m_pendingCycles > 0)
+	{
+		bool completedFrame;
+		ExecutePendingCycles(completedFrame);
+		assert(!completedFrame && "Frame should only complete when reaching an event in Execute");
+	}
+}
 
+void Ppu::ExecutePendingCycles(bool& completedFrame)
+{
 	completedFrame = false;
 
 	const bool renderingEnabled = m_ppuControlReg2->Test(PpuControl2::RenderBackground|PpuControl2::RenderSprites);
 
-	for ( ; ppuCycles > 0; --ppuCycles)
+	uint32 ppuCycles = m_pendingCycles;
+	m_pendingCycles = 0;
+	m_statusUnchangedCycles = 0; // Counted from m_cycle
+
+	while (ppuCycles > 0)
 	{
 		const uint32 x = m_cycle % kNumScanlineCycles; // offset in current scanline
 		const uint32 y = m_cycle / kNumScanlineCycles; // scanline
 
-		if ( (y >= 0 && y <= 239) || y == 261 ) // Visible and Pre-render scanlines
+		// Execute whole visible scanlines at once when we can. The last visible scanline (where the frame completes and
+		// odd frames skip a cycle) is always executed one dot at a time.
+		if (x == 0 && ppuCycles >= kNumScanlineCycles && y < 239)
+		{
+			ExecuteVisibleScanline(y, renderingEnabled);
+			++m_numWholeScanlines;
+
+			m_cycle += kNumScanlineCycles;
+			ppuCycles -= kNumScanlineCycles;
+			continue;
+		}
+
+		// Skip over dots where nothing happens (e.g. HBlank and VBlank)
+		const uint32 idleCycles = GetCyclesToNextExecutedDot(ppuCycles, renderingEnabled);
+		if (idleCycles > 0)
 		{
-			if (renderingEnabled) //@TODO: Not sure about this
+			m_cycle = (m_cycle + idleCycles) % kNumScreenCycles;
+			ppuCycles -= idleCycles;
+			continue;
+		}
+
+		ExecuteCycle(x, y, renderingEnabled, completedFrame);
+
+		m_cycle = (m_cycle + 1) % kNumScreenCycles;
+		--ppuCycles;
+	}
+
+	m_cyclesToNextEvent = ComputeCyclesToNextEvent();
+}
+
+uint32 Ppu::GetCyclesToNextExecutedDot(uint32 maxCycles, bool renderingEnabled) const
+{
+	uint32 x = m_cycle % kNumScanlineCycles;
+	uint32 y = m_cycle / kNumScanlineCycles;
+	uint32 result = 0;
+
+	// Only idle scanlines have no executed dots, so this doesn't loop more than a VBlank's worth of scanlines
+	while (result < maxCycles)
+	{
+		const uint32 nextDot = g_nextExecutedDot[GetScanlineType(y)][renderingEnabled? 1 : 0][x];
+		result += nextDot - x;
+
+		if (nextDot < kNumScanlineCycles)
+			break;
+
+		x = 0;
+		y = (y + 1) % kNumTotalScanlines;
+	}
+
+	return std::min(result, maxCycles);
+}
+
+void Ppu::ExecuteCycle(uint32 x, uint32 y, bool renderingEnabled, bool& completedFrame)
+{
+	// Only called on dots where something happens (see IsDotExecuted)
+
+	if ( (y >= 0 && y <= 239) || y == 261 ) // Visible and Pre-render scanlines
+	{
+		if (renderingEnabled) //@TODO: Not sure about this
+		{
+			if (x == 64)
+			{
+				// Cycles 1-64: Clear secondary OAM to $FF
+				ClearOAM2();
+			}
+			else if (x == 256)
 			{
-				if (x == 64)
+				// Cycles 65-256: Sprite evaluation
+				PerformSpriteEvaluation(x, y);
+			}
+			else if (x == 260)
+			{
+				//@TODO: This is a dirty hack for Mapper4 (MMC3) and the like to get around the fact that
+				// my PPU implementation doesn't perform Sprite fetches as expected (must fetch even if no
+				// sprites found on scanline, and fetch each sprite separately like I do for tiles). For now
+				// this mostly works.
+				m_nes->HACK_OnScanline();
+			}
+		}
+
+		if (x >= 257 && x <= 320) // "HBlank" (idle cycles)
+		{
+			if (renderingEnabled)
+			{
+				if (x == 257)
 				{
-					// Cycles 1-64: Clear secondary OAM to $FF
-					ClearOAM2();
+					CopyVRamAddressHori(m_vramAddress, m_tempVRamAddress);
 				}
-				else if (x == 256)
+				else if (y == 261 && x >= 280 && x <= 304)
 				{
-					// Cycles 65-256: Sprite evaluation
-					PerformSpriteEvaluation(x, y);
+					//@TODO: could optimize by just doing this once on last cycle (x==304)
+					CopyVRamAddressVert(m_vramAddress, m_tempVRamAddress);
 				}
-				else if (x == 260)
+				else if (x == 320)
 				{
-					//@TODO: This is a dirty hack for Mapper4 (MMC3) and the like to get around the fact that
-					// my PPU implementation doesn't perform Sprite fetches as expected (must fetch even if no
-					// sprites found on scanline, and fetch each sprite separately like I do for tiles). For now
-					// this mostly works.
-					m_nes->HACK_OnScanline();
+					// Cycles 257-320: sprite data fetch for next scanline
+					FetchSpriteData(y);
 				}
 			}
+		}
+		else // Fetch and render cycles
+		{
+			assert(x <= 256 || (x >= 321 && x <= 340));
 
-			if (x >= 257 && x <= 320) // "HBlank" (idle cycles)
+			// Update VRAM address and fetch data
+			if (renderingEnabled)
 			{
-				if (renderingEnabled)
+				// PPU fetches 4 bytes every 8 cycles for a given tile (NT, AT, LowBG, and HighBG).
+				// We want to know when we're on the last cycle of the HighBG tile byte (see Ntsc_timing.jpg)
+				const bool lastFetchCycle = (x >= 8) && (x % 8 == 0);
+
+				if (lastFetchCycle)
 				{
-					if (x == 257)
-					{
-						CopyVRamAddressHori(m_vramAddress, m_tempVRamAddress);
-					}
-					else if (y == 261 && x >= 280 && x <= 304)
+					FetchBackgroundTileData();
+
+					// Data for v was just fetched, so we can now increment it
+					if (x != 256)
 					{
-						//@TODO: could optimize by just doing this once on last cycle (x==304)
-						CopyVRamAddressVert(m_vramAddress, m_tempVRamAddress);
+						IncHoriVRamAddress(m_vramAddress);
 					}
-					else if (x == 320)
+					else
 					{
-						// Cycles 257-320: sprite data fetch for next scanline
-						FetchSpriteData(y);
+						IncVertVRamAddress(m_vramAddress);
 					}
 				}
 			}
-			else // Fetch and render cycles
+
+			// Render pixel at x,y using pipelined fetch data. If rendering is disabled, will render background color.
+			if (x < kScreenWidth && y < kScreenHeight)
 			{
-				assert(x <= 256 || (x >= 321 && x <= 340));
+				RenderPixel(x, y);
+			}
 
-				// Update VRAM address and fetch data
-				if (renderingEnabled)
-				{
-					// PPU fetches 4 bytes every 8 cycles for a given tile (NT, AT, LowBG, and HighBG).
-					// We want to know when we're on the last cycle of the HighBG tile byte (see Ntsc_timing.jpg)
-					const bool lastFetchCycle = (x >= 8) && (x % 8 == 0);
+			// Clear flags on pre-render line at dot 1
+			if (y == 261 && x == 1)
+			{
+				m_ppuStatusReg->Clear(PpuStatus::InVBlank | PpuStatus::PpuHitSprite0 | PpuStatus::SpriteOverflow);
+			}
 
-					if (lastFetchCycle)
-					{
-						FetchBackgroundTileData();
-
-						// Data for v was just fetched, so we can now increment it
-						if (x != 256)
-						{
-							IncHoriVRamAddress(m_vramAddress);
-						}
-						else
-						{
-							IncVertVRamAddress(m_vramAddress);
-						}
-					}
-				}
+			// Present on (second to) last cycle of last visible scanline
+			//@TODO: Do this on last frame of post-render line?
+			if (y == 239 && x == 339)
+			{
+				completedFrame = true;
+				OnFrameComplete();
+			}
+		}
+	}
+	else // Post-render and VBlank 240-260
+	{
+		assert(y >= 240 && y <= 260);
 
-				// Render pixel at x,y using pipelined fetch data. If rendering is disabled, will render background color.
-				if (x < kScreenWidth && y < kScreenHeight)
-				{
-					RenderPixel(x, y);
-				}
+		if (y == 241 && x == 1)
+		{
+			SetVBlankFlag();
 
-				// Clear flags on pre-render line at dot 1
-				if (y == 261 && x == 1)
-				{
-					m_ppuStatusReg->Clear(PpuStatus::InVBlank | PpuStatus::PpuHitSprite0 | PpuStatus::SpriteOverflow);
-				}
+			if (m_ppuControlReg1->Test(PpuControl1::NmiOnVBlank))
+				m_nes->SignalCpuNmi();
+		}
+	}
+}
 
-				// Present on (second to) last cycle of last visible scanline
-				//@TODO: Do this on last frame of post-render line?
-				if (y == 239 && x == 339)
-				{
-					completedFrame = true;
-					OnFrameComplete();
-				}
-			}
+void Ppu::ExecuteVisibleScanline(uint32 y, bool renderingEnabled)
+{
+	// Same as executing cycles 0-340 of a visible scanline (except the last one) with ExecuteCycle
+	ScanlineLog& log = m_scanlineLogs[y];
+
+	if (!renderingEnabled)
+	{
+		log.ppuControl2 = m_ppuControlReg2->Value(); // Background not rendered, tiles aren't needed
+		ShiftSpriteLine(log.spriteLine);
+		RenderLine(y, log);
+		return;
+	}
+
+	// Cycles 0-255: fetch tiles and render pixels. If the frame won't be displayed, pixels are only needed
+	// to detect sprite 0 hit, otherwise only the VRAM address changes.
+	if (m_skipRendering && !m_renderSprite0)
+	{
+		for (uint32 x = 8; x < kScreenWidth; x += 8)
+		{
+			IncHoriVRamAddress(m_vramAddress);
 		}
-		else // Post-render and VBlank 240-260
+		memset(m_spriteLine, 0, sizeof(m_spriteLine));
+	}
+	else
+	{
+		FetchBackgroundLine(log);
+		ShiftSpriteLine(log.spriteLine);
+		RenderLine(y, log);
+	}
+
+	// Cycles 1-64 clear secondary OAM, and 65-256 perform sprite evaluation
+	ClearOAM2();
+	PerformSpriteEvaluation(256, y);
+
+	FetchBackgroundTileData();
+	IncVertVRamAddress(m_vramAddress);
+
+	// Cycles 257-320: sprite data fetch for next scanline
+	CopyVRamAddressHori(m_vramAddress, m_tempVRamAddress);
+	m_nes->HACK_OnScanline();
+	FetchSpriteData(y);
+
+	// Cycles 321-336: fetch first two tiles for next scanline
+	FetchBackgroundTileData();
+	IncHoriVRamAddress(m_vramAddress);
+	FetchBackgroundTileData();
+	IncHoriVRamAddress(m_vramAddress);
+}
+
+uint32 Ppu::ComputeCyclesToNextEvent() const
+{
+	auto CyclesUntil = [this] (uint32 cycle) -> uint32
+	{
+		return (cycle + kNumScreenCycles - m_cycle) % kNumScreenCycles;
+	};
+
+	// Frame completion and VBlank (NMI)
+	uint32 result = std::min(CyclesUntil(YXtoPpuCycle(239, 339)), CyclesUntil(YXtoPpuCycle(241, 1)));
+
+	// HACK_OnScanline clocks the mapper scanline counter at dot 260 of visible and pre-render scanlines. It's only an
+	// event on the clock that signals the mapper IRQ; other clocks are executed within whole scanlines. There are at
+	// most kScreenHeight + 1 clocks per frame, and frame completion is always less than a frame away.
+	const bool renderingEnabled = m_ppuControlReg2->Test(PpuControl2::RenderBackground|PpuControl2::RenderSprites);
+	const uint32 scanlinesToIrq = renderingEnabled? m_nes->GetScanlinesToMapperIrq() : Mapper::kNoIrq;
+	if (scanlinesToIrq <= kScreenHeight + 1)
+	{
+		const uint32 x = m_cycle % kNumScanlineCycles;
+		uint32 y = m_cycle / kNumScanlineCycles;
+
+		if (x > 260)
+			++y;
+
+		for (uint32 clock = 1; ; ++clock, ++y)
 		{
-			assert(y >= 240 && y <= 260);
+			if (y >= 240 && y < 261)
+				y = 261;
+			else if (y == kNumTotalScanlines)
+				y = 0;
 
-			if (y == 241 && x == 1)
-			{
-				SetVBlankFlag();
+			if (clock == scanlinesToIrq)
+				break;
+		}
 
-				if (m_ppuControlReg1->Test(PpuControl1::NmiOnVBlank))
-					m_nes->SignalCpuNmi();
-			}
+		result = std::min(result, CyclesUntil(YXtoPpuCycle(y, 260)));
+	}
+
+	return result;
+}
+
+void Ppu::UpdateCyclesToNextEvent()
+{
+	assert(m_pendingCycles == 0);
+	m_cyclesToNextEvent = ComputeCyclesToNextEvent();
+}
+
+bool Ppu::MayChangeStatus(uint32 ppuCycles)
+{
+	// Polling loops peek with increasing cycle counts, so only check cycles that weren't checked by a previous call
+	// since the PPU state last changed.
+	if (ppuCycles <= m_statusUnchangedCycles)
+		return false;
+
+	// Cycles in [m_cycle + m_statusUnchangedCycles, m_cycle + ppuCycles) are checked, less than a frame (see
+	// Nes::SkipIdleLoop)
+	const uint32 firstCycle = (m_cycle + m_statusUnchangedCycles) % kNumScreenCycles;
+	auto IsExecuted = [firstCycle, ppuCycles, this] (uint32 cycle) -> bool
+	{
+		return (cycle + kNumScreenCycles - firstCycle) % kNumScreenCycles < ppuCycles - m_statusUnchangedCycles;
+	};
+
+	// VBlank flag set, and all flags cleared on the pre-render scanline
+	if (IsExecuted(YXtoPpuCycle(241, 1)) || IsExecuted(YXtoPpuCycle(261, 1)))
+		return true;
+
+	if (!m_ppuControlReg2->Test(PpuControl2::RenderBackground|PpuControl2::RenderSprites))
+		return false;
+
+	const bool canHitSprite0 = m_ppuControlReg2->Test(PpuControl2::RenderBackground) && m_ppuControlReg2->Test(PpuControl2::RenderSprites)
+		&& !m_ppuStatusReg->Test(PpuStatus::PpuHitSprite0);
+	const bool canOverflow = !m_ppuStatusReg->Test(PpuStatus::SpriteOverflow);
+	if (!canHitSprite0 && !canOverflow)
+	{
+		m_statusUnchangedCycles = ppuCycles;
+		return false;
+	}
+
+	if (m_spritesInRangeDirty)
+	{
+		UpdateSpritesInRange();
+	}
+
+	// Sprites in range of scanline y are evaluated at dot 256 (may set overflow), and rendered on scanline y + 1 (may
+	// hit sprite 0). Sprites already fetched for the current and next scanline may predate an OAM change, so
+	// m_renderSprite0 is also checked for those.
+	const uint32 currY = m_cycle / kNumScanlineCycles;
+	uint32 cycle = firstCycle;
+	uint32 numCycles = ppuCycles - m_statusUnchangedCycles;
+	while (numCycles > 0)
+	{
+		const uint32 x = cycle % kNumScanlineCycles;
+		const uint32 y = cycle / kNumScanlineCycles;
+		const uint32 numLineCycles = std::min<uint32>(numCycles, kNumScanlineCycles - x); // Dots [x, x + numLineCycles)
+
+		if (y < kScreenHeight)
+		{
+			const bool isFetchedLine = (y + kNumTotalScanlines - currY) % kNumTotalScanlines < 2;
+			const bool sprite0OnLine = (y > 0 && (m_spritesInRange[y - 1] & 1) != 0) || (isFetchedLine && m_renderSprite0);
+			if (canHitSprite0 && x < kScreenWidth && sprite0OnLine)
+				return true;
+
+			if (canOverflow && x <= 256 && x + numLineCycles > 256 && HasAtLeast8BitsSet(m_spritesInRange[y]))
+				return true;
 		}
 
-		// Update cycle
-		m_cycle = (m_cycle + 1) % kNumScreenCycles;
+		cycle = (cycle + numLineCycles) % kNumScreenCycles;
+		numCycles -= numLineCycles;
 	}
+
+	m_statusUnchangedCycles = ppuCycles;
+	return false;
+}
+
+bool Ppu::PeekStatusRegister(uint8& value)
+{
+	// Catching up would execute cycles a scanline at a time for every peek (i.e. every skipped iteration of a polling
+	// loop), so the status is only peeked if it can't change before the cycle the CPU is at.
+	const uint32 ppuCycles = m_pendingCycles + CpuToPpuCycles(m_nes->GetUnsyncedCpuCycles());
+	if (MayChangeStatus(ppuCycles))
+		return false;
+
+	// Must match side effects of reading $2002 in HandleCpuRead
+	const uint32 currCycle = (m_cycle + ppuCycles) % kNumScreenCycles;
+	const uint32 kSetVBlankCycle = YXtoPpuCycle(241, 1);
+	if (currCycle < kSetVBlankCycle && (currCycle + CpuToPpuCycles(3) >= kSetVBlankCycle))
+		return false;
+
+	if (m_ppuStatusReg->Test(PpuStatus::InVBlank) || !m_vramAndScrollFirstWrite)
+		return false;
+
+	if (ReadPpuRegister(CpuMemory::kPpuVRamAddressReg1) != 0 || ReadPpuRegister(CpuMemory::kPpuVRamAddressReg2) != 0)
+		return false;
+
+	value = ReadPpuRegister(CpuMemory::kPpuStatusReg);
+	return true;
+}
+
+void Ppu::WriteSpriteMemory(const uint8* data)
+{
+	CatchUp();
+
+	// Writes start at OAMADDR and wrap around, so OAMADDR ends up unchanged
+	const uint8 spriteRamAddress = ReadPpuRegister(CpuMemory::kPpuSprRamAddressReg);
+	const size_t numBytesToEnd = kSpriteMemorySize - spriteRamAddress;
+	memcpy(m_oam.RawPtr(spriteRamAddress), data, numBytesToEnd);
+	memcpy(m_oam.RawPtr(), data + numBytesToEnd, spriteRamAddress);
+	m_spritesInRangeDirty = true;
+	m_statusUnchangedCycles = 0;
+
+	WritePpuRegister(CpuMemory::kPpuSprRamIoReg, data[kSpriteMemorySize - 1]);
 }
 
 void Ppu::RenderFrame()
 {
-	m_renderer->Present();
+	m_videoSink->OnFrameComplete(m_frameBuffer.data());
 }
 
 uint8 Ppu::HandleCpuRead(uint16 cpuAddress)
@@ -446,6 +903,8 @@ uint8 Ppu::HandleCpuRead(uint16 cpuAddress)
 	// CPU only has access to PPU memory-mapped registers
 	assert(cpuAddress >= CpuMemory::kPpuRegistersBase && cpuAddress < CpuMemory::kPpuRegistersEnd);
 
+	CatchUp();
+
 	// If debugger is reading, we don't want any register side-effects, so just return the value
 	if ( Debugger::IsExecuting() )
 	{
@@ -519,6 +978,15 @@ uint8 Ppu::HandleCpuRead(uint16 cpuAddress)
 
 void Ppu::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 {
+	CatchUp();
+
+	// Pixels rendered so far on this scanline are displayed with the current palette and $2001
+	if ((cpuAddress == CpuMemory::kPpuControlReg2 && value != m_ppuControlReg2->Value())
+		|| (cpuAddress == CpuMemory::kPpuVRamIoReg && m_vramAddress >= PpuMemory::kPalettesBase))
+	{
+		FlushPixels();
+	}
+
 	// Read old value
 	const uint16 registerAddress = MapCpuToPpuRegister(cpuAddress);
 	const uint8 oldValue = m_ppuRegisters.Read(registerAddress);
@@ -534,6 +1002,11 @@ void Ppu::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 
 			const Bitfield8* oldPpuControlReg1 = reinterpret_cast<const Bitfield8*>(&oldValue);
 
+			if (oldPpuControlReg1->Test(PpuControl1::SpriteSize8x16) != m_ppuControlReg1->Test(PpuControl1::SpriteSize8x16))
+			{
+				m_spritesInRangeDirty = true;
+			}
+
 			// The PPU pulls /NMI low if and only if both NMI_occurred and NMI_output are true. By toggling NMI_output ($2000 bit 7)
 			// during vertical blank without reading $2002, a program can cause /NMI to be pulled low multiple times, causing multiple
 			// NMIs to be generated. (http://wiki.nesdev.com/w/index.php/NMI)
@@ -550,6 +1023,10 @@ void Ppu::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 			// Write value to sprite ram at address in $2003 (OAMADDR) and increment address
 			const uint8 spriteRamAddress = ReadPpuRegister(CpuMemory::kPpuSprRamAddressReg);
 			m_oam.Write(spriteRamAddress, value);
+			if (spriteRamAddress % kSpriteDataSize == 0) // Y coordinate
+			{
+				m_spritesInRangeDirty = true;
+			}
 			WritePpuRegister(CpuMemory::kPpuSprRamAddressReg, spriteRamAddress + 1);
 		}
 		break;
@@ -608,17 +1085,10 @@ void Ppu::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 		}
 		break;
 	}
-}
-
-uint8 Ppu::HandlePpuRead(uint16 ppuAddress)
-{
-	//@NOTE: The palette can only be accessed directly by the PPU (no address lines go out to Cartridge)
-	return m_nameTables.Read(MapPpuToVRam(ppuAddress));
-}
 
-void Ppu::HandlePpuWrite(uint16 ppuAddress, uint8 value)
-{
-	m_nameTables.Write(MapPpuToVRam(ppuAddress), value);
+	// Enabling or disabling rendering changes which cycles are events, and when the status register may change
+	m_cyclesToNextEvent = ComputeCyclesToNextEvent();
+	m_statusUnchangedCycles = 0;
 }
 
 uint16 Ppu::MapCpuToPpuRegister(uint16 cpuAddress)
@@ -627,65 +1097,6 @@ uint16 Ppu::MapCpuToPpuRegister(uint16 cpuAddress)
 	return (cpuAddress - CpuMemory::kPpuRegistersBase ) % CpuMemory::kPpuRegistersSize;
 }
 
-uint16 Ppu::MapPpuToVRam(uint16 ppuAddress)
-{
-	assert(ppuAddress >= PpuMemory::kVRamBase); // Address may go into palettes (vram pointer)
-
-	const uint16 virtualVRamAddress = (ppuAddress - PpuMemory::kVRamBase) % PpuMemory::kVRamSize;
-	
-	uint16 physicalVRamAddress = 0;	
-	switch (m_nes->GetNameTableMirroring())
-	{
-	case NameTableMirroring::Vertical:
-		// Vertical mirroring (horizontal scrolling)
-		// A B
-		// A B
-		// Simplest case, just wrap >= 2K
-		physicalVRamAddress = virtualVRamAddress % NameTableMemory::kSize;
-		break;
-
-	case NameTableMirroring::Horizontal:
-		// Horizontal mirroring (vertical scrolling)
-		// A A
-		// B B		
-		if (virtualVRamAddress >= KB(3)) // 4th virtual page (B) maps to 2nd physical page
-		{
-			physicalVRamAddress = virtualVRamAddress - KB(2);
-		}
-		else if (virtualVRamAddress >= KB(2)) // 3rd virtual page (B) maps to 2nd physical page (B)
-		{
-			physicalVRamAddress = virtualVRamAddress - KB(1);
-		}
-		else if (virtualVRamAddress >= KB(1)) // 2nd virtual page (A) maps to 1st physical page (A)
-		{
-			physicalVRamAddress = virtualVRamAddress - KB(1);
-		}
-		else // 1st virtual page (A) maps to 1st physical page (A)
-		{
-			physicalVRamAddress = virtualVRamAddress;
-		}
-		break;
-
-	case NameTableMirroring::OneScreenUpper:
-		// A A
-		// A A
-		physicalVRamAddress = virtualVRamAddress % (NameTableMemory::kSize / 2);
-		break;
-
-	case NameTableMirroring::OneScreenLower:
-		// B B
-		// B B
-		physicalVRamAddress = (virtualVRamAddress % (NameTableMemory::kSize / 2)) + (NameTableMemory::kSize / 2);
-		break;
-
-	default:
-		assert(false);
-		break;
-	}
-
-	return physicalVRamAddress;
-}
-
 uint16 Ppu::MapPpuToPalette(uint16 ppuAddress)
 {
 	assert(ppuAddress >= PpuMemory::kPalettesBase && ppuAddress < PpuMemory::kPalettesEnd);
@@ -724,7 +1135,6 @@ void Ppu::FetchBackgroundTileData()
 	const uint16 tileOffset = TO16(tileIndex) * 16;
 	const uint8 fineY = GetVRamAddressFineY(v);
 	const uint16 byte1Address = patternTableAddress + tileOffset + fineY;
-	const uint16 byte2Address = byte1Address + 8;
 
 	// Load attribute byte then compute and store the high palette bits from it for this tile
 	// The high palette bits are 2 consecutive bits in the attribute byte. We need to shift it right
@@ -741,8 +1151,7 @@ void Ppu::FetchBackgroundTileData()
 	currTile = nextTile; // Shift pipelined data
 
 	// Push results at top of pipeline
-	nextTile.bmpLow = m_ppuMemoryBus->Read(byte1Address);
-	nextTile.bmpHigh = m_ppuMemoryBus->Read(byte2Address);
+	memcpy(nextTile.pixels, m_ppuMemoryBus->ReadDecodedChrRow(byte1Address, false), sizeof(nextTile.pixels));
 	nextTile.paletteHighBits = paletteHighBits;
 
 #if CONFIG_DEBUG
@@ -760,6 +1169,31 @@ void Ppu::ClearOAM2() // OAM2 = $FF
 	memset(m_oam2.RawPtr(), 0xFF, m_oam2.Size());
 }
 
+void Ppu::UpdateSpritesInRange() // OAM -> m_spritesInRange
+{
+	const uint8 spriteHeight = m_ppuControlReg1->Test(PpuControl1::SpriteSize8x16)? 16 : 8;
+
+	// Copy Y coordinates out of OAM so they can be tested together
+	uint8 spriteYs[kMaxSprites];
+	for (size_t n = 0; n < kMaxSprites; ++n)
+	{
+		spriteYs[n] = m_oam.Read(static_cast<uint16>(n * kSpriteDataSize));
+	}
+
+	auto GetSpritesInRange = &GetSpritesInRangeScalar;
+#if CPU_X86
+	if (CpuFeatures::HasSSE2())
+		GetSpritesInRange = &GetSpritesInRangeSSE2;
+#endif
+
+	for (uint32 y = 0; y < kScreenHeight; ++y)
+	{
+		m_spritesInRange[y] = GetSpritesInRange(spriteYs, static_cast<uint8>(y), spriteHeight);
+	}
+
+	m_spritesInRangeDirty = false;
+}
+
 void Ppu::PerformSpriteEvaluation(uint32 /*x*/, uint32 y) // OAM -> OAM2
 {
 	// See http://wiki.nesdev.com/w/index.php/PPU_sprite_evaluation
@@ -776,6 +1210,11 @@ void Ppu::PerformSpriteEvaluation(uint32 /*x*/, uint32 y) // OAM -> OAM2
 	m_numSpritesToRender = 0;
 	m_renderSprite0 = false;
 
+	if (m_spritesInRangeDirty)
+	{
+		UpdateSpritesInRange();
+	}
+
 	uint16 n = 0; // Sprite [0-63] in OAM
 	auto& n2 = m_numSpritesToRender; // Sprite [0-7] in OAM2
 
@@ -783,34 +1222,37 @@ void Ppu::PerformSpriteEvaluation(uint32 /*x*/, uint32 y) // OAM -> OAM2
 	SpriteData* oam = m_oam.RawPtrAs<SpriteData*>();
 	SpriteData* oam2 = m_oam2.RawPtrAs<SpriteData*>();
 
-	// Attempt to find up to 8 sprites on current scanline
-	while (n2 < 8)
+	// Attempt to find up to 8 sprites on current scanline. Instead of testing each sprite (1, 1a, 2),
+	// we take them from the precomputed mask. No sprites are in range of the pre-render scanline.
+	uint64 spritesInRange = (y < kScreenHeight)? m_spritesInRange[y] : 0;
+	while (spritesInRange != 0 && n2 < 8)
 	{
-		const uint8 spriteY = oam[n][0];
-		oam2[n2][0] = spriteY; // (1)
+		n = static_cast<uint16>(GetLowestBitIndex(spritesInRange));
+		spritesInRange &= spritesInRange - 1;
 
-		if (IsSpriteInRangeY(y, spriteY, spriteHeight)) // (1a)
-		{
-			oam2[n2][1] = oam[n][1];
-			oam2[n2][2] = oam[n][2];
-			oam2[n2][3] = oam[n][3];
+		memcpy(oam2[n2], oam[n], sizeof(SpriteData));
 
-			if (n == 0) // If we're going to render sprite 0, set flag so we can detect sprite 0 hit when we render
-			{
-				m_renderSprite0 = true;
-			}
-
-			++n2;
+		if (n == 0) // If we're going to render sprite 0, set flag so we can detect sprite 0 hit when we render
+		{
+			m_renderSprite0 = true;
 		}
 
-		++n; // (2)
-		if (n == 64) // (2a)
+		++n2;
+	}
+
+	if (n2 < 8)
+	{
+		// We didn't find 8 sprites, OAM2 contains what we've found so far, so we can bail. The PPU copies
+		// the Y coordinate of every sprite it tests to OAM2 (1), the last one being sprite 63.
+		if (n != kMaxSprites - 1)
 		{
-			// We didn't find 8 sprites, OAM2 contains what we've found so far, so we can bail
-			return;
+			oam2[n2][0] = oam[kMaxSprites - 1][0];
 		}
+		return;
 	}
 
+	++n; // (2) Sprite after the 8th one found
+	
 	// We found 8 sprites above. Let's see if there are any more so we can set sprite overflow flag.
 	uint16 m = 0; // Byte in sprite data [0-3]
 	
@@ -845,29 +1287,29 @@ void Ppu::PerformSpriteEvaluation(uint32 /*x*/, uint32 y) // OAM -> OAM2
 	}
 }
 
-void Ppu::FetchSpriteData(uint32 y) // OAM2 -> render (shift) registers
+void Ppu::FetchSpriteData(uint32 y) // OAM2 -> sprite line buffer
 {
 	// See http://wiki.nesdev.com/w/index.php/PPU_rendering#Cycles_257-320
 
-	static auto FlipBits = [] (uint8 v) -> uint8
-	{
-		return 
-			  ((v & BIT(0)) << 7)
-			| ((v & BIT(1)) << 5)
-			| ((v & BIT(2)) << 3)
-			| ((v & BIT(3)) << 1)
-			| ((v & BIT(4)) >> 1)
-			| ((v & BIT(5)) >> 3)
-			| ((v & BIT(6)) >> 5)
-			| ((v & BIT(7)) >> 7);
-	};
+	using namespace PpuCompositor;
 
 	typedef uint8 SpriteData[4];
 	SpriteData* oam2 = m_oam2.RawPtrAs<SpriteData*>();
 
 	const bool isSprite8x16 = m_ppuControlReg1->Test(PpuControl1::SpriteSize8x16);
 
-	for (uint8 n = 0; n < m_numSpritesToRender; ++n)
+	// Instead of loading shift registers that would be shifted for every pixel of the next scanline, we
+	// render the sprites to a line buffer once. Lower sprite indices have priority, so render them last.
+	memset(m_spriteLine, 0, sizeof(m_spriteLine));
+
+	// If the frame won't be displayed, we only need sprite 0 to detect sprite 0 hit (it's in front of other sprites)
+	int32 numSpritesToFetch = m_numSpritesToRender;
+	if (m_skipRendering)
+	{
+		numSpritesToFetch = m_renderSprite0? 1 : 0;
+	}
+
+	for (int32 n = numSpritesToFetch - 1; n >= 0; --n)
 	{
 		const uint8 spriteY = oam2[n][0];
 		const uint8 byte1 = oam2[n][1];
@@ -918,160 +1360,331 @@ void Ppu::FetchSpriteData(uint32 y) // OAM2 -> render (shift) registers
 		
 		const uint16 tileOffset = TO16(tileIndex) * 16;
 		const uint16 byte1Address = patternTableAddress + tileOffset + yOffset;
-		const uint16 byte2Address = byte1Address + 8;
 
-		auto& data = m_spriteFetchData[n];
-		data.bmpLow = m_ppuMemoryBus->Read(byte1Address);
-		data.bmpHigh = m_ppuMemoryBus->Read(byte2Address);
-		data.attributes = oam2[n][2];
-		data.x = oam2[n][3];
+		// Already flipped horizontally if required
+		const uint8* pixels = m_ppuMemoryBus->ReadDecodedChrRow(byte1Address, flipHorz);
+
+		uint8 spriteFlags = static_cast<uint8>(0x10 | (ReadBits(attribs, 0x3) << 2)); // Sprite palettes start at $3F10
+		if (TestBits(attribs, BIT(5)))
+		{
+			spriteFlags |= SpritePixel::BehindBackground;
+		}
+		if (m_renderSprite0 && (n == 0))
+		{
+			spriteFlags |= SpritePixel::Sprite0;
+		}
 
-		if (flipHorz)
+		const uint32 spriteX = oam2[n][3];
+		const uint32 numPixels = std::min<uint32>(8, kScreenWidth - spriteX);
+		for (uint32 i = 0; i < numPixels; ++i)
 		{
-			data.bmpLow = FlipBits(data.bmpLow);
-			data.bmpHigh = FlipBits(data.bmpHigh);
+			if (pixels[i] != 0)
+			{
+				m_spriteLine[spriteX + i] = spriteFlags | pixels[i];
+			}
 		}
 	}
 }
 
-void Ppu::RenderPixel(uint32 x, uint32 y)
+uint8 Ppu::GetBackgroundPixel(uint32 x) const
 {
-	// See http://wiki.nesdev.com/w/index.php/PPU_rendering
+	// At this point, the data for the current and next tile are in m_bgTileFetchDataPipeline
+	const auto& currTile = m_bgTileFetchDataPipeline[0];
+	const auto& nextTile = m_bgTileFetchDataPipeline[1];
+
+	// Shift registers hold current and next tile pixels, shifted every cycle, and the mux uses fine X to select
+	// a pixel. Instead of shifting, we compute the index of the selected pixel using the x value.
+	const uint8 pixelIndex = (x % 8) + m_fineX;
+	const auto& tile = (pixelIndex < 8)? currTile : nextTile;
+	const uint8 paletteLowBits = tile.pixels[pixelIndex % 8];
+
+	// Technically, the mux would index 2 8-bit registers containing replicated values for the current
+	// and next tile palette high bits (from attribute bytes), but this is faster.
+	return (paletteLowBits != 0)? (tile.paletteHighBits << 2) | paletteLowBits : 0;
+}
+
+void Ppu::FetchBackgroundLine(ScanlineLog& log)
+{
+	log.fineX = m_fineX;
+	log.ppuControl2 = m_ppuControlReg2->Value();
 
-	static auto GetBackgroundColor = [&] (Color4& color)
+	// First two tiles were fetched on the previous scanline, then one more every 8 pixels
+	log.tiles[0] = m_bgTileFetchDataPipeline[0];
+	log.tiles[1] = m_bgTileFetchDataPipeline[1];
+
+	for (uint32 i = 2; i < ARRAYSIZE(log.tiles); ++i)
 	{
-		color = g_paletteColors[m_palette.Read(0)]; // BG ($3F00)
-	};
+		FetchBackgroundTileData();
+		IncHoriVRamAddress(m_vramAddress);
+		log.tiles[i] = m_bgTileFetchDataPipeline[1];
+	}
+}
 
-	static auto GetPaletteColor = [&] (uint8 highBits, uint8 lowBits, uint16 paletteBaseAddress, Color4& color)
+void Ppu::ShiftSpriteLine(uint8* spriteLine)
+{
+	// Sprites are shifted out even where they are hidden, so the line buffer is consumed either way
+	if (m_ppuControlReg2->Test(PpuControl2::RenderSprites))
 	{
-		assert(lowBits != 0);
+		memcpy(spriteLine, m_spriteLine, kScreenWidth);
 
-		// Compute offset into palette memory that contains the palette index
-		const uint8 paletteOffset = (highBits << 2) | (lowBits & 0x3);
+		if (!m_ppuControlReg2->Test(PpuControl2::SpritesShowLeft8))
+		{
+			memset(spriteLine, 0, 8);
+		}
+	}
+	else
+	{
+		memset(spriteLine, 0, kScreenWidth);
+	}
 
-		//@NOTE: lowBits is never 0, so we don't have to worry about mapping every 4th byte to 0 (bg color) here.
-		// That case is handled specially in the multiplexer code.
-		const uint8 paletteIndex = m_palette.Read( MapPpuToPalette(paletteBaseAddress + paletteOffset) );
-		color = g_paletteColors[paletteIndex & (kNumPaletteColors-1)]; // Mask in only required bits, some roms write values > 64
-	};
+	memset(m_spriteLine, 0, sizeof(m_spriteLine));
+}
 
-	bool bgRenderingEnabled = m_ppuControlReg2->Test(PpuControl2::RenderBackground);
-	bool spriteRenderingEnabled = m_ppuControlReg2->Test(PpuControl2::RenderSprites);
-	
-	// Consider bg/sprites as disabled (for this pixel) if we're not supposed to render it in the left-most 8 pixels
-	if ( !m_ppuControlReg2->Test(PpuControl2::BackgroundShowLeft8) && x < 8 )
+IndexedColor Ppu::GetIndexedColor(uint8 paletteOffset)
+{
+	//@NOTE: Opaque pixels never have 0 low bits, so only the bg color ($3F00) is read for transparent pixels
+	const uint8 colorIndex = m_palette.Read( MapPpuToPalette(PpuMemory::kImagePalette + paletteOffset) );
+	return Palette::MakeIndexedColor(colorIndex, m_ppuControlReg2->Value());
+}
+
+void Ppu::GetPaletteColors(IndexedColor* colors)
+{
+	for (uint8 i = 0; i < PpuMemory::kPalettesSize; ++i)
 	{
-		bgRenderingEnabled = false;
+		colors[i] = GetIndexedColor(i);
 	}
+}
+
+void Ppu::RenderPixel(uint32 x, uint32 y)
+{
+	// See http://wiki.nesdev.com/w/index.php/PPU_rendering
+
+	// Consider bg/sprites as disabled (for this pixel) if we're not supposed to render it in the left-most 8 pixels
+	const bool bgRenderingEnabled = m_ppuControlReg2->Test(PpuControl2::RenderBackground)
+		&& (x >= 8 || m_ppuControlReg2->Test(PpuControl2::BackgroundShowLeft8));
+
+	const bool spriteRenderingEnabled = m_ppuControlReg2->Test(PpuControl2::RenderSprites)
+		&& (x >= 8 || m_ppuControlReg2->Test(PpuControl2::SpritesShowLeft8));
 
-	if ( !m_ppuControlReg2->Test(PpuControl2::SpritesShowLeft8) && x < 8 )
+	const uint8 spritePixel = spriteRenderingEnabled? m_spriteLine[x] : 0;
+	m_spriteLine[x] = 0; // Shift out pixel (see ShiftSpriteLine)
+
+	// If the frame won't be displayed, the pixel is only needed to detect sprite 0 hit, and only sprite 0 was fetched
+	// (see FetchSpriteData): the background pixel is only needed where sprite 0 is opaque.
+	if (m_skipRendering)
 	{
-		spriteRenderingEnabled = false;
+		if (spritePixel != 0 && bgRenderingEnabled && GetBackgroundPixel(x) != 0)
+		{
+			m_ppuStatusReg->Set(PpuStatus::PpuHitSprite0);
+		}
+		return;
 	}
-	
-	// Get the background pixel
-	uint8 bgPaletteHighBits = 0;
-	uint8 bgPaletteLowBits = 0;
-	if (bgRenderingEnabled)
-	{
-		// At this point, the data for the current and next tile are in m_bgTileFetchDataPipeline
-		const auto& currTile = m_bgTileFetchDataPipeline[0];
-		const auto& nextTile = m_bgTileFetchDataPipeline[1];
 
-		// Mux uses fine X to select a bit from shift registers
-		const uint16 muxMask = 1 << (7 - m_fineX);
+	const uint8 bgPixel = bgRenderingEnabled? GetBackgroundPixel(x) : 0;
 
-		// Instead of actually shifting every cycle, we rebuild the shift register values
-		// for the current cycle (using the x value)
-		//@TODO: Optimize by storing 16 bit values for low and high bitmap bytes and shifting every cycle
-		const uint8 xShift = x % 8;
-		const uint8 shiftRegLow = (currTile.bmpLow << xShift) | (nextTile.bmpLow >> (8 - xShift));
-		const uint8 shiftRegHigh = (currTile.bmpHigh << xShift) | (nextTile.bmpHigh >> (8 - xShift));
+	// Sprite 0 hit is visible to the CPU right away, the multiplexer itself runs on FlushPixels
+	if (bgPixel != 0 && TestBits(spritePixel, PpuCompositor::SpritePixel::Sprite0))
+	{
+		m_ppuStatusReg->Set(PpuStatus::PpuHitSprite0);
+	}
 
-		bgPaletteLowBits = (TestBits01(shiftRegHigh, muxMask) << 1) | (TestBits01(shiftRegLow, muxMask));
+	if (y != m_renderedPixelsY || x != m_numRenderedPixels) // New scanline, or state loaded mid-scanline
+	{
+		m_renderedPixelsY = y;
+		m_firstUnflushedPixel = x;
+		m_numRenderedPixels = x;
+	}
+
+	m_bgPixels[x] = bgPixel;
+	m_spritePixels[x] = spritePixel;
+	++m_numRenderedPixels;
 
-		// Technically, the mux would index 2 8-bit registers containing replicated values for the current
-		// and next tile palette high bits (from attribute bytes), but this is faster.
-		bgPaletteHighBits = (xShift + m_fineX < 8)? currTile.paletteHighBits : nextTile.paletteHighBits;
+	if (m_numRenderedPixels == kScreenWidth)
+	{
+		FlushPixels();
 	}
+}
 
-	// Get the potential sprite pixel
-	bool foundSprite = false;
-	bool spriteHasBgPriority = false;
-	bool isSprite0 = false;
-	uint8 sprPaletteHighBits = 0;
-	uint8 sprPaletteLowBits = 0;
-	if (spriteRenderingEnabled)
+void Ppu::FlushPixels()
+{
+	if (m_firstUnflushedPixel == m_numRenderedPixels)
+		return;
+
+	// CompositeLine works on multiples of 32 pixels, the ones outside of the unflushed range are discarded
+	const uint32 firstPixel = m_firstUnflushedPixel & ~31;
+	const uint32 endPixel = (m_numRenderedPixels + 31) & ~31;
+	uint8 paletteOffsets[kScreenWidth];
+	PpuCompositor::CompositeLine(m_bgPixels + firstPixel, m_spritePixels + firstPixel, paletteOffsets + firstPixel, endPixel - firstPixel);
+
+	// Short runs (the palette or $2001 changed mid-scanline) aren't worth converting the whole palette
+	IndexedColor* pixels = &m_frameBuffer[m_renderedPixelsY * kScreenWidth];
+	if (m_numRenderedPixels - m_firstUnflushedPixel < PpuMemory::kPalettesSize)
 	{
-		for (uint8 n = 0; n < m_numSpritesToRender; ++n)
+		for (uint32 x = m_firstUnflushedPixel; x < m_numRenderedPixels; ++x)
 		{
-			auto& spriteData = m_spriteFetchData[n];
+			pixels[x] = GetIndexedColor(paletteOffsets[x]);
+		}
+	}
+	else
+	{
+		IndexedColor colors[PpuMemory::kPalettesSize];
+		GetPaletteColors(colors);
 
-			if ( (x >= spriteData.x) && (x < (spriteData.x + 8u)) )
-			{
-				if (!foundSprite)
-				{
-					// Compose "sprite color" (0-3) from high bit in bitmap bytes
-					sprPaletteLowBits = (TestBits01(spriteData.bmpHigh, 0x80) << 1) | (TestBits01(spriteData.bmpLow, 0x80));
+		for (uint32 x = m_firstUnflushedPixel; x < m_numRenderedPixels; ++x)
+		{
+			pixels[x] = colors[paletteOffsets[x]];
+		}
+	}
 
-					// First non-transparent pixel moves on to multiplexer
-					if (sprPaletteLowBits != 0)
-					{
-						foundSprite = true;
-						sprPaletteHighBits = ReadBits(spriteData.attributes, 0x3); //@TODO: cache this in spriteData
-						spriteHasBgPriority = TestBits(spriteData.attributes, BIT(5));
-
-						if (m_renderSprite0 && (n == 0)) // Rendering pixel from sprite 0?
-						{
-							isSprite0 = true;
-						}
-					}
-				}
+	m_firstUnflushedPixel = m_numRenderedPixels;
+}
 
-				// Shift out high bits - do this for all (overlapping) sprites in range
-				spriteData.bmpLow <<= 1;
-				spriteData.bmpHigh <<= 1;
-			}
+void Ppu::RenderLine(uint32 y, ScanlineLog& log)
+{
+	// If the frame won't be displayed, only sprite 0 hit is needed (only sprite 0 was fetched, see FetchSpriteData)
+	if (m_skipRendering)
+	{
+		if (m_renderSprite0 && DetectSprite0Hit(log))
+		{
+			m_ppuStatusReg->Set(PpuStatus::PpuHitSprite0);
 		}
+		return;
 	}
 
-	// Multiplexer selects background or sprite pixel (see "Priority multiplexer decision table")
-	Color4 color;
+	// Palette and $2001 can't change during the scanline
+	GetPaletteColors(log.colors);
 
-	if (bgPaletteLowBits == 0)
+	// Sprite 0 hit must be detected now, so scanlines where sprite 0 is present are always rasterized here
+	if (m_deferredRendering && !m_renderSprite0)
 	{
-		if (!foundSprite || sprPaletteLowBits == 0)
+		QueueScanline(y);
+		return;
+	}
+
+	if (RasterizeScanline(log, &m_frameBuffer[y * kScreenWidth]))
+	{
+		m_ppuStatusReg->Set(PpuStatus::PpuHitSprite0);
+	}
+}
+
+bool Ppu::RasterizeScanline(const ScanlineLog& log, IndexedColor* pixels)
+{
+	// Only reads from log, as it may run on a worker thread
+	uint8 bgLine[kScreenWidth];
+	if (TestBits(log.ppuControl2, PpuControl2::RenderBackground))
+	{
+		for (uint32 x = 0; x < kScreenWidth; ++x)
 		{
-			// Background color 0
-			GetBackgroundColor(color);
+			const uint32 pixelIndex = x + log.fineX;
+			const auto& tile = log.tiles[pixelIndex / 8];
+			const uint8 paletteLowBits = tile.pixels[pixelIndex % 8];
+			bgLine[x] = (paletteLowBits != 0)? (tile.paletteHighBits << 2) | paletteLowBits : 0;
 		}
-		else
+
+		if (!TestBits(log.ppuControl2, PpuControl2::BackgroundShowLeft8))
 		{
-			// Sprite color
-			GetPaletteColor(sprPaletteHighBits, sprPaletteLowBits, PpuMemory::kSpritePalette, color);
+			memset(bgLine, 0, 8);
 		}
 	}
 	else
 	{
-		if (foundSprite && !spriteHasBgPriority)
-		{
-			// Sprite color
-			GetPaletteColor(sprPaletteHighBits, sprPaletteLowBits, PpuMemory::kSpritePalette, color);
-		}
-		else
+		memset(bgLine, 0, sizeof(bgLine));
+	}
+
+	uint8 paletteOffsets[kScreenWidth];
+	const bool sprite0Hit = PpuCompositor::CompositeLine(bgLine, log.spriteLine, paletteOffsets, kScreenWidth);
+
+	for (uint32 x = 0; x < kScreenWidth; ++x)
+	{
+		pixels[x] = log.colors[paletteOffsets[x]];
+	}
+
+	return sprite0Hit;
+}
+
+bool Ppu::DetectSprite0Hit(const ScanlineLog& log)
+{
+	if (!TestBits(log.ppuControl2, PpuControl2::RenderBackground))
+		return false;
+
+	// Sprite 0 hits where both its pixel and the background pixel are opaque
+	const uint32 firstX = TestBits(log.ppuControl2, PpuControl2::BackgroundShowLeft8)? 0 : 8;
+	for (uint32 x = firstX; x < kScreenWidth; ++x)
+	{
+		if (TestBits(log.spriteLine[x], PpuCompositor::SpritePixel::Sprite0))
 		{
-			// BG color
-			GetPaletteColor(bgPaletteHighBits, bgPaletteLowBits, PpuMemory::kImagePalette, color);
+			const uint32 pixelIndex = x + log.fineX;
+			if (log.tiles[pixelIndex / 8].pixels[pixelIndex % 8] != 0)
+				return true;
 		}
+	}
+	return false;
+}
+
+void Ppu::QueueScanline(uint32 y)
+{
+	// Consecutive scanlines are rasterized by the same job
+	const uint32 kMaxScanlinesPerJob = 16;
 
-		if (isSprite0)
+	if (m_numQueuedScanlines > 0 && y != m_firstQueuedScanline + m_numQueuedScanlines)
+	{
+		SubmitQueuedScanlines();
+	}
+
+	if (m_numQueuedScanlines == 0)
+	{
+		m_firstQueuedScanline = y;
+	}
+
+	if (++m_numQueuedScanlines == kMaxScanlinesPerJob)
+	{
+		SubmitQueuedScanlines();
+	}
+}
+
+void Ppu::SubmitQueuedScanlines()
+{
+	if (m_numQueuedScanlines == 0)
+		return;
+
+	const uint32 firstScanline = m_firstQueuedScanline;
+	const uint32 endScanline = m_firstQueuedScanline + m_numQueuedScanlines;
+	m_numQueuedScanlines = 0;
+
+	m_rasterizerPool.Submit([this, firstScanline, endScanline] ()
+	{
+		for (uint32 y = firstScanline; y < endScanline; ++y)
 		{
-			m_ppuStatusReg->Set(PpuStatus::PpuHitSprite0);
+			RasterizeScanline(m_scanlineLogs[y], &m_frameBuffer[y * kScreenWidth]);
 		}
+	});
+}
+
+void Ppu::WaitForRasterization()
+{
+	if (m_rasterizerPool.IsStarted())
+	{
+		SubmitQueuedScanlines();
+		m_rasterizerPool.Wait();
+	}
+}
+
+void Ppu::SetDeferredRendering(bool enabled)
+{
+	WaitForRasterization();
+
+	if (enabled && !m_rasterizerPool.IsStarted())
+	{
+		// Leave a core for the emulation thread
+		const size_t numCores = std::thread::hardware_concurrency();
+		m_rasterizerPool.Start(numCores > 2? numCores - 1 : 1);
+	}
+	else if (!enabled)
+	{
+		m_rasterizerPool.Stop();
 	}
 
-	m_renderer->DrawPixel(x, y, color);
+	m_deferredRendering = enabled;
 }
 
 void Ppu::SetVBlankFlag()
@@ -1085,6 +1698,8 @@ void Ppu::SetVBlankFlag()
 
 void Ppu::OnFrameComplete()
 {
+	WaitForRasterization();
+
 	const bool renderingEnabled = m_ppuControlReg2->Test(PpuControl2::RenderBackground|PpuControl2::RenderSprites);
 	
 	// For odd frames, the cycle at the end of the scanline (340,239) is skipped
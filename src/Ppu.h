@@ -2,11 +2,17 @@
 #include "Base.h"
 #include "Memory.h"
 #include "Bitfield.h"
+#include "Palette.h"
+#include "Renderer.h"
+#include "VideoSink.h"
+#include "WorkerPool.h"
 #include <memory>
+#include <array>
+#include <vector>
 
-class Renderer;
 class PpuMemoryBus;
 class Nes;
+class StateSerializer;
 
 class Ppu
 {
@@ -16,36 +22,110 @@ public:
 
 	void Reset();
 	void Execute(uint32 ppuCycles, bool& completedFrame);
+
+	// Executes cycles deferred by Execute. Must be called before anything outside the PPU changes state that
+	// affects rendering (e.g. mapper bank switches). Register accesses from the CPU call it automatically.
+	void CatchUp();
+
+	// Returns how many PPU cycles can be executed before reaching a cycle where the PPU may signal an
+	// interrupt or complete the frame. Register accesses from the CPU may change this result.
+	uint32 GetPpuCyclesToNextEvent() const { return m_cyclesToNextEvent - m_pendingCycles; }
+
+	// Call after something outside the PPU changes when the next event is (e.g. mapper IRQ enabled). Cycles must
+	// have been caught up.
+	void UpdateCyclesToNextEvent();
+
+	// Number of visible scanlines executed at once (see ExecuteVisibleScanline) since Reset, instead of one dot at a time
+	uint32 GetNumWholeScanlines() const { return m_numWholeScanlines; }
 	void RenderFrame(); // Call when Execute() sets completedFrame to true
+	size_t GetNumSkippedFrameUploads() const { return m_videoSink->GetNumSkippedFrames(); }
+
+	// Receives the frame buffer on RenderFrame. Frames are discarded until a sink is set.
+	void SetVideoSink(std::shared_ptr<VideoSink> videoSink);
+
+	// When set, the next frames are not rendered to the frame buffer, for frames that won't be displayed. The PPU
+	// still does everything that can be observed by the CPU or mapper (e.g. sprite 0 hit, sprite overflow).
+	void SetSkipRendering(bool skip) { m_skipRendering = skip; }
+
+	// When enabled, whole scanlines are rasterized by worker threads from a log of the PPU state recorded during the
+	// scanline. The emulation thread only rasterizes scanlines where it must detect sprite 0 hit, or that were not
+	// executed at once (e.g. CPU accessed the PPU mid-scanline). Writes within those aren't logged with their dot:
+	// such scanlines are rendered a dot at a time, which costs far more than compositing their pixels (see
+	// FlushPixels). Completes before Execute sets completedFrame.
+	void SetDeferredRendering(bool enabled);
+	bool IsDeferredRendering() const { return m_deferredRendering; }
+
+	// Last rendered frame (kScreenWidth x kScreenHeight), for consumers that don't need ARGB colors
+	const IndexedColor* GetFrameBuffer() const { return m_frameBuffer.data(); }
+
+	// Same as writing 256 bytes of data to $2004 (used for sprite DMA)
+	void WriteSpriteMemory(const uint8* data);
 
 	uint8 HandleCpuRead(uint16 cpuAddress);
+
+	// Sets value to what a CPU read of $2002 would return. Returns false if that read would modify the PPU state
+	// (e.g. clear the VBlank flag), in which case the read cannot be skipped (see Nes::SkipIdleLoop). Doesn't catch
+	// up with the CPU: also returns false if a status flag may change in the cycles not executed yet.
+	bool PeekStatusRegister(uint8& value);
 	void HandleCpuWrite(uint16 cpuAddress, uint8 value);
-	uint8 HandlePpuRead(uint16 ppuAddress);
-	void HandlePpuWrite(uint16 ppuAddress, uint8 value);
+
+	// Returns pointer to name table memory (CIRAM) at this offset, for PpuMemoryBus to map name tables
+	uint8* GetVRamPtr(uint16 vramOffset) { return m_nameTables.RawPtr(vramOffset); }
+
+	// Serializes memory, registers and the rendering pipeline, including cycles not executed yet (see Execute).
+	// The frame buffer is not serialized.
+	void Serialize(StateSerializer& serializer);
 
 private:
 	uint16 MapCpuToPpuRegister(uint16 cpuAddress);
-	uint16 MapPpuToVRam(uint16 ppuAddress);
 	uint16 MapPpuToPalette(uint16 ppuAddress);
 
 	uint8 ReadPpuRegister(uint16 cpuAddress);
 	void WritePpuRegister(uint16 cpuAddress, uint8 value);
 
+	void ExecutePendingCycles(bool& completedFrame);
+	uint32 GetCyclesToNextExecutedDot(uint32 maxCycles, bool renderingEnabled) const;
+	void ExecuteCycle(uint32 x, uint32 y, bool renderingEnabled, bool& completedFrame);
+	void ExecuteVisibleScanline(uint32 y, bool renderingEnabled);
+	uint32 ComputeCyclesToNextEvent() const;
+	bool MayChangeStatus(uint32 ppuCycles); // If executing ppuCycles cycles may change the status register ($2002)
+
 	void ClearBackground();
 	void FetchBackgroundTileData();
 	
 	void ClearOAM2(); // OAM2 = $FF
 	void PerformSpriteEvaluation(uint32 x, uint32 y); // OAM -> OAM2
-	void FetchSpriteData(uint32 y); // OAM2 -> render (shift) registers
+	void UpdateSpritesInRange(); // OAM -> m_spritesInRange
+	void FetchSpriteData(uint32 y); // OAM2 -> sprite line buffer
+
+	// Pixels are palette offsets from $3F00 (see PpuCompositor)
+	uint8 GetBackgroundPixel(uint32 x) const;
+	IndexedColor GetIndexedColor(uint8 paletteOffset);
+	void GetPaletteColors(IndexedColor* colors); // GetIndexedColor for each palette offset
+
+	struct ScanlineLog;
+	void FetchBackgroundLine(ScanlineLog& log); // Fetches tiles like cycles 0-255 of a visible scanline
+	void ShiftSpriteLine(uint8* spriteLine); // Shifts out the whole sprite line buffer
 
 	void RenderPixel(uint32 x, uint32 y);
+	void FlushPixels(); // Writes pixels rendered by RenderPixel to the frame buffer
+	void RenderLine(uint32 y, ScanlineLog& log);
+	static bool RasterizeScanline(const ScanlineLog& log, IndexedColor* pixels); // Returns true on sprite 0 hit
+	static bool DetectSprite0Hit(const ScanlineLog& log); // Same result as RasterizeScanline, without the pixels
+
+	void QueueScanline(uint32 y); // Rasterized by a worker thread
+	void SubmitQueuedScanlines();
+	void WaitForRasterization();
 	void SetVBlankFlag();
 	void OnFrameComplete();
 
 	PpuMemoryBus* m_ppuMemoryBus;
 	Nes* m_nes;
-	std::shared_ptr<Renderer> m_rendererHolder;
-	Renderer* m_renderer;
+	std::shared_ptr<VideoSink> m_videoSinkHolder;
+	VideoSink* m_videoSink;
+
+	std::vector<IndexedColor> m_frameBuffer; // Rendered by scanline, sent to video sink on RenderFrame
+	bool m_skipRendering;
 
 	// Memory used to store name/attribute tables (aka CIRAM)
 	typedef Memory<FixedSizeStorage<KB(2)>> NameTableMemory;
@@ -64,6 +144,11 @@ private:
 	ObjectAttributeMemory2 m_oam2;
 	uint8 m_numSpritesToRender;
 	bool m_renderSprite0;
+
+	// Bit n is set if OAM sprite n is in range of the visible scanline. Only recomputed when sprite Y
+	// coordinates or the sprite size change, which is usually once per frame (sprite DMA).
+	std::array<uint64, kScreenHeight> m_spritesInRange;
+	bool m_spritesInRangeDirty;
 	
 	// Memory mapped registers
 	typedef Memory<FixedSizeStorage<8>> PpuRegisterMemory; // $2000 - $2007
@@ -81,13 +166,16 @@ private:
 	uint8 m_vramBufferedValue;
 
 	uint32 m_cycle;
+	uint32 m_pendingCycles; // Cycles not executed yet (see Execute)
+	uint32 m_cyclesToNextEvent; // From m_cycle
+	uint32 m_numWholeScanlines;
+	uint32 m_statusUnchangedCycles; // Cycles from m_cycle known not to change the status register (see MayChangeStatus)
 	bool m_evenFrame;
 	bool m_vblankFlagSetThisFrame;
 
 	struct BgTileFetchData
 	{
-		uint8 bmpLow; //@TODO: rename bmpLow and bmpHigh
-		uint8 bmpHigh;
+		uint8 pixels[8]; // Palette low bits (0-3) of each pixel, decoded from pattern table
 		uint8 paletteHighBits;
 
 #if CONFIG_DEBUG
@@ -103,15 +191,32 @@ private:
 	};
 	BgTileFetchData m_bgTileFetchDataPipeline[2];
 
-	struct SpriteFetchData
+	// Everything needed to rasterize a whole scanline, recorded while executing it (see ExecuteVisibleScanline)
+	struct ScanlineLog
 	{
-		// Fetched from VRAM
-		uint8 bmpLow;
-		uint8 bmpHigh;
-		
-		// Copied from OAM2
-		uint8 attributes;
-		uint8 x;
+		BgTileFetchData tiles[kScreenWidth / 8 + 1]; // First pixel is pixel fineX of first tile
+		uint8 fineX;
+		uint8 ppuControl2;
+		uint8 spriteLine[kScreenWidth]; // See ShiftSpriteLine
+		IndexedColor colors[32]; // Palette memory ($3F00-$3F1F) snapshot
 	};
-	SpriteFetchData m_spriteFetchData[8];
+	std::vector<ScanlineLog> m_scanlineLogs; // One per visible scanline
+
+	bool m_deferredRendering;
+	WorkerPool m_rasterizerPool;
+	uint32 m_firstQueuedScanline;
+	uint32 m_numQueuedScanlines; // Not submitted to m_rasterizerPool yet
+
+	// Sprite pixels of the scanline being rendered (see PpuCompositor::SpritePixel), emulates the sprite shift
+	// registers. Rendered by FetchSpriteData, and cleared as pixels are shifted out.
+	uint8 m_spriteLine[kScreenWidth];
+
+	// Pixels rendered a dot at a time by RenderPixel, composited on FlushPixels: at the end of the scanline, or
+	// before a write changes the palette or $2001. Pixels [m_firstUnflushedPixel, m_numRenderedPixels) of
+	// m_renderedPixelsY aren't in the frame buffer yet.
+	uint8 m_bgPixels[kScreenWidth];
+	uint8 m_spritePixels[kScreenWidth];
+	uint32 m_renderedPixelsY;
+	uint32 m_firstUnflushedPixel;
+	uint32 m_numRenderedPixels;
 };
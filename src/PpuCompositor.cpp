@@ -0,0 +1,170 @@
+#include "PpuCompositor.h"
+#include "CpuFeatures.h"
+
+#if CPU_X86
+	#include <emmintrin.h>
+	#include <immintrin.h>
+#elif CPU_NEON
+	#include <arm_neon.h>
+#endif
+
+namespace
+{
+	using namespace PpuCompositor;
+
+	typedef bool (*CompositeLineFunc)(const uint8* bgLine, const uint8* spriteLine, uint8* outLine, size_t numPixels);
+
+	bool CompositeLineScalar(const uint8* bgLine, const uint8* spriteLine, uint8* outLine, size_t numPixels)
+	{
+		bool sprite0Hit = false;
+		for (size_t i = 0; i < numPixels; ++i)
+		{
+			outLine[i] = CompositePixel(bgLine[i], spriteLine[i], sprite0Hit);
+		}
+		return sprite0Hit;
+	}
+
+#if CPU_X86
+	// Per 16 pixels: the sprite pixel is hidden if it's transparent, or if it's behind an opaque bg pixel
+	bool CompositeLineSSE2(const uint8* bgLine, const uint8* spriteLine, uint8* outLine, size_t numPixels)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i offsetMask = _mm_set1_epi8(SpritePixel::PaletteOffsetMask);
+		const __m128i behindMask = _mm_set1_epi8(SpritePixel::BehindBackground);
+		const __m128i sprite0Mask = _mm_set1_epi8(SpritePixel::Sprite0);
+		__m128i hits = zero;
+
+		for (size_t i = 0; i < numPixels; i += 16)
+		{
+			const __m128i bg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgLine + i));
+			const __m128i spr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(spriteLine + i));
+
+			const __m128i bgTransparent = _mm_cmpeq_epi8(bg, zero);
+			const __m128i sprTransparent = _mm_cmpeq_epi8(spr, zero);
+			const __m128i sprBehind = _mm_cmpeq_epi8(_mm_and_si128(spr, behindMask), behindMask);
+			const __m128i sprite0 = _mm_cmpeq_epi8(_mm_and_si128(spr, sprite0Mask), sprite0Mask);
+
+			const __m128i sprHidden = _mm_or_si128(sprTransparent, _mm_andnot_si128(bgTransparent, sprBehind));
+			const __m128i result = _mm_or_si128(_mm_and_si128(sprHidden, bg), _mm_andnot_si128(sprHidden, _mm_and_si128(spr, offsetMask)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(outLine + i), result);
+
+			hits = _mm_or_si128(hits, _mm_andnot_si128(bgTransparent, sprite0));
+		}
+
+		return _mm_movemask_epi8(hits) != 0;
+	}
+
+	// Same as CompositeLineSSE2, 32 pixels at a time
+	TARGET_AVX2
+	bool CompositeLineAVX2(const uint8* bgLine, const uint8* spriteLine, uint8* outLine, size_t numPixels)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i offsetMask = _mm256_set1_epi8(SpritePixel::PaletteOffsetMask);
+		const __m256i behindMask = _mm256_set1_epi8(SpritePixel::BehindBackground);
+		const __m256i sprite0Mask = _mm256_set1_epi8(SpritePixel::Sprite0);
+		__m256i hits = zero;
+
+		for (size_t i = 0; i < numPixels; i += 32)
+		{
+			const __m256i bg = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bgLine + i));
+			const __m256i spr = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(spriteLine + i));
+
+			const __m256i bgTransparent = _mm256_cmpeq_epi8(bg, zero);
+			const __m256i sprTransparent = _mm256_cmpeq_epi8(spr, zero);
+			const __m256i sprBehind = _mm256_cmpeq_epi8(_mm256_and_si256(spr, behindMask), behindMask);
+			const __m256i sprite0 = _mm256_cmpeq_epi8(_mm256_and_si256(spr, sprite0Mask), sprite0Mask);
+
+			const __m256i sprHidden = _mm256_or_si256(sprTransparent, _mm256_andnot_si256(bgTransparent, sprBehind));
+			const __m256i result = _mm256_blendv_epi8(_mm256_and_si256(spr, offsetMask), bg, sprHidden);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(outLine + i), result);
+
+			hits = _mm256_or_si256(hits, _mm256_andnot_si256(bgTransparent, sprite0));
+		}
+
+		return _mm256_movemask_epi8(hits) != 0;
+	}
+#endif // CPU_X86
+
+#if CPU_NEON
+	// Same as CompositeLineSSE2
+	bool CompositeLineNEON(const uint8* bgLine, const uint8* spriteLine, uint8* outLine, size_t numPixels)
+	{
+		const uint8x16_t zero = vdupq_n_u8(0);
+		const uint8x16_t offsetMask = vdupq_n_u8(SpritePixel::PaletteOffsetMask);
+		const uint8x16_t behindMask = vdupq_n_u8(SpritePixel::BehindBackground);
+		const uint8x16_t sprite0Mask = vdupq_n_u8(SpritePixel::Sprite0);
+		uint8x16_t hits = zero;
+
+		for (size_t i = 0; i < numPixels; i += 16)
+		{
+			const uint8x16_t bg = vld1q_u8(bgLine + i);
+			const uint8x16_t spr = vld1q_u8(spriteLine + i);
+
+			const uint8x16_t bgTransparent = vceqq_u8(bg, zero);
+			const uint8x16_t sprTransparent = vceqq_u8(spr, zero);
+			const uint8x16_t sprBehind = vtstq_u8(spr, behindMask);
+			const uint8x16_t sprite0 = vtstq_u8(spr, sprite0Mask);
+
+			const uint8x16_t sprHidden = vorrq_u8(sprTransparent, vbicq_u8(sprBehind, bgTransparent));
+			vst1q_u8(outLine + i, vbslq_u8(sprHidden, bg, vandq_u8(spr, offsetMask)));
+
+			hits = vorrq_u8(hits, vbicq_u8(sprite0, bgTransparent));
+		}
+
+		const uint64x2_t hits64 = vreinterpretq_u64_u8(hits);
+		return (vgetq_lane_u64(hits64, 0) | vgetq_lane_u64(hits64, 1)) != 0;
+	}
+#endif // CPU_NEON
+
+	struct CompositeLineImpl
+	{
+		CompositeLineFunc func;
+		const char* name;
+	};
+
+	CompositeLineImpl SelectCompositeLineImpl()
+	{
+		CompositeLineImpl impl = { &CompositeLineScalar, "Scalar" };
+
+	#if CPU_X86
+		if (CpuFeatures::HasAVX2())
+		{
+			impl.func = &CompositeLineAVX2;
+			impl.name = "AVX2";
+		}
+		else if (CpuFeatures::HasSSE2())
+		{
+			impl.func = &CompositeLineSSE2;
+			impl.name = "SSE2";
+		}
+	#elif CPU_NEON
+		if (CpuFeatures::HasNEON())
+		{
+			impl.func = &CompositeLineNEON;
+			impl.name = "NEON";
+		}
+	#endif
+
+		return impl;
+	}
+
+	const CompositeLineImpl& GetCompositeLineImpl()
+	{
+		static const CompositeLineImpl impl = SelectCompositeLineImpl();
+		return impl;
+	}
+}
+
+namespace PpuCompositor
+{
+	bool CompositeLine(const uint8* bgLine, const uint8* spriteLine, uint8* outLine, size_t numPixels)
+	{
+		assert(numPixels % 32 == 0);
+		return GetCompositeLineImpl().func(bgLine, spriteLine, outLine, numPixels);
+	}
+
+	const char* GetImplementationName()
+	{
+		return GetCompositeLineImpl().name;
+	}
+}
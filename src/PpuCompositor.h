@@ -0,0 +1,51 @@
+#pragma once
+#include "Base.h"
+
+// Implements the PPU priority multiplexer, which selects either the background or the sprite pixel
+// (see http://wiki.nesdev.com/w/index.php/PPU_rendering#Preface). Pixels are offsets into palette
+// memory (from $3F00), 0 meaning transparent. Background pixels are in [0,15], and opaque sprite
+// pixels are in [16,31] along with the flags below.
+namespace PpuCompositor
+{
+	namespace SpritePixel
+	{
+		enum Type : uint8
+		{
+			PaletteOffsetMask	= 0x1F,
+			BehindBackground	= BIT(5), // Sprite priority (attribute bit 5)
+			Sprite0				= BIT(6), // Pixel comes from sprite 0
+		};
+	}
+
+	// Returns the palette offset of the pixel to display. Sets sprite0Hit if an opaque sprite 0
+	// pixel overlaps an opaque background pixel.
+	FORCEINLINE uint8 CompositePixel(uint8 bgPixel, uint8 spritePixel, bool& sprite0Hit)
+	{
+		if (spritePixel != 0)
+		{
+			if (bgPixel == 0)
+			{
+				return spritePixel & SpritePixel::PaletteOffsetMask;
+			}
+
+			if (TestBits(spritePixel, SpritePixel::Sprite0))
+			{
+				sprite0Hit = true;
+			}
+
+			if (!TestBits(spritePixel, SpritePixel::BehindBackground))
+			{
+				return spritePixel & SpritePixel::PaletteOffsetMask;
+			}
+		}
+		return bgPixel;
+	}
+
+	// Same as calling CompositePixel for each pixel, using the widest vector instructions supported
+	// by the CPU (checked once at runtime). numPixels must be a multiple of 32. Returns true on
+	// sprite 0 hit.
+	bool CompositeLine(const uint8* bgLine, const uint8* spriteLine, uint8* outLine, size_t numPixels);
+
+	// Returns the name of the implementation used by CompositeLine (e.g. "SSE2")
+	const char* GetImplementationName();
+}
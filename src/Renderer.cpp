@@ -1,6 +1,14 @@
 #include "Renderer.h"
 #define SDL_MAIN_HANDLED // Don't use SDL's main impl
 #include <SDL.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace
 {
@@ -14,46 +22,141 @@ namespace
 			m_width = width;
 			m_height = height;
 			m_backbufferTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
-			Lock();
+			m_backbuffer.resize(width * height);
+			m_lastFrame.resize(width * height);
+			m_lastFrameValid = false;
+			m_firstDirtyRow = 0;
+			m_numDirtyRows = 0;
+			m_numSkippedUploads = 0;
 		}
 
 		void Clear(const Color4& color)
 		{
-			auto pCurrRow = reinterpret_cast<Uint32*>(m_backbuffer);
-			for (int32 y = 0; y < m_height; ++y, pCurrRow += (m_pitch/4))
-			{
-				for (int32 x = 0; x < m_width; ++x)
-					pCurrRow[x] = color.argb;
-			}
+			std::fill(m_backbuffer.begin(), m_backbuffer.end(), color.argb);
+			m_lastFrameValid = false;
+			SetDirtyRows(0, m_height);
 		}
 
-		void Flip(SDL_Renderer* renderer)
+		// Returns true if the window was presented. If forcePresent is set, the window is presented even if the frame is
+		// unchanged, for when the window system needs it to be redrawn; the texture upload is still skipped.
+		bool Flip(SDL_Renderer* renderer, bool forcePresent = false)
 		{
-			Unlock();
+			if (m_numDirtyRows == 0)
+			{
+				// Frame is unchanged, texture already holds it
+				++m_numSkippedUploads;
+				if (!forcePresent)
+					return false;
+			}
+			else
+			{
+				// Only upload rows that changed
+				const SDL_Rect rect = { 0, m_firstDirtyRow, m_width, m_numDirtyRows };
+				SDL_UpdateTexture(m_backbufferTexture, &rect, &m_backbuffer[m_firstDirtyRow * m_width], static_cast<int>(m_width * sizeof(uint32)));
+				m_numDirtyRows = 0;
+			}
+
 			SDL_RenderCopy(renderer, m_backbufferTexture, NULL, NULL);
 			SDL_RenderPresent(renderer);
-			Lock();
+			return true;
 		}
 
-		FORCEINLINE Uint32& operator()(int32 x, int32 y)
+		void DrawFrame(const IndexedColor* frame)
 		{
-			assert(x < m_width && y < m_height);
-			return reinterpret_cast<Uint32&>(m_backbuffer[y * m_pitch + x * sizeof(Uint32)]);
+			// Only convert rows that differ from the last frame drawn
+			const size_t rowSize = m_width * sizeof(IndexedColor);
+			for (int32 y = 0; y < m_height; ++y)
+			{
+				const IndexedColor* row = frame + y * m_width;
+				IndexedColor* lastRow = &m_lastFrame[y * m_width];
+
+				if (m_lastFrameValid && memcmp(row, lastRow, rowSize) == 0)
+					continue;
+
+				memcpy(lastRow, row, rowSize);
+				Palette::ConvertToArgb(row, &m_backbuffer[y * m_width], m_width);
+				SetDirtyRows(y, y + 1);
+			}
+			m_lastFrameValid = true;
 		}
 
+		size_t GetNumSkippedUploads() const { return m_numSkippedUploads; }
+
 	private:
-		void Lock()
+		void SetDirtyRows(int32 firstRow, int32 endRow)
 		{
-			SDL_LockTexture(m_backbufferTexture, NULL, (void**)(&m_backbuffer), &m_pitch);
+			if (m_numDirtyRows > 0)
+			{
+				endRow = std::max(endRow, m_firstDirtyRow + m_numDirtyRows);
+				firstRow = std::min(firstRow, m_firstDirtyRow);
+			}
+			m_firstDirtyRow = firstRow;
+			m_numDirtyRows = endRow - firstRow;
 		}
-		void Unlock()
+
+		SDL_Texture* m_backbufferTexture;
+		std::vector<uint32> m_backbuffer; // Uploaded to texture on Flip
+		int32 m_width, m_height;
+
+		// Last frame drawn, to find rows that changed
+		std::vector<IndexedColor> m_lastFrame;
+		bool m_lastFrameValid;
+
+		// Rows of m_backbuffer not uploaded yet
+		int32 m_firstDirtyRow;
+		int32 m_numDirtyRows;
+
+		std::atomic<size_t> m_numSkippedUploads; // Read from emulation thread
+	};
+
+	// Triple buffered frames, handed off without locks from the emulation thread (writer) to the presentation
+	// thread (reader). Each side owns one buffer, and the third one holds the last completed frame. If the
+	// writer completes a frame before the reader took the previous one, the previous one is dropped. If the
+	// reader has no new frame to take, the last frame it took stays on screen.
+	class FrameQueue
+	{
+	public:
+		void Create(size_t numPixels)
 		{
-			SDL_UnlockTexture(m_backbufferTexture);
+			for (size_t i = 0; i < kNumBuffers; ++i)
+			{
+				m_buffers[i].resize(numPixels);
+			}
+			m_writeIndex = 0;
+			m_readIndex = 1;
+			m_completedState = 2; // No new frame
 		}
 
-		SDL_Texture* m_backbufferTexture;
-		Uint8* m_backbuffer;
-		int32 m_width, m_height, m_pitch;
+		IndexedColor* GetWriteBuffer() { return m_buffers[m_writeIndex].data(); }
+
+		// Writer: swaps the frame just written with the completed one
+		void PushFrame()
+		{
+			m_writeIndex = m_completedState.exchange(m_writeIndex | kNewFrameBit) & kIndexMask;
+		}
+
+		// Reader: swaps the frame last read with the completed one, if it's a new frame
+		bool PopFrame(const IndexedColor*& frame)
+		{
+			if ((m_completedState.load() & kNewFrameBit) == 0)
+				return false;
+
+			m_readIndex = m_completedState.exchange(m_readIndex) & kIndexMask;
+			frame = m_buffers[m_readIndex].data();
+			return true;
+		}
+
+		bool HasNewFrame() const { return (m_completedState.load() & kNewFrameBit) != 0; }
+
+	private:
+		static const size_t kNumBuffers = 3;
+		static const uint32 kIndexMask = 0x3;
+		static const uint32 kNewFrameBit = 0x4;
+
+		std::vector<IndexedColor> m_buffers[kNumBuffers];
+		uint32 m_writeIndex; // Only used by writer
+		uint32 m_readIndex; // Only used by reader
+		std::atomic<uint32> m_completedState; // Buffer index | kNewFrameBit
 	};
 }
 
@@ -62,14 +165,110 @@ struct Renderer::PIMPL
 	PIMPL()
 		: m_window(NULL)
 		, m_renderer(NULL)
+		, m_quit(false)
+		, m_redrawRequested(false)
 	{
 	}
 
+	void PresentThreadMain(std::promise<bool>* rendererCreated);
+
+	// SDL event watch, called from the thread that pumps events
+	static int SDLCALL OnEvent(void* userData, SDL_Event* event);
+
 	SDL_Window* m_window;
+	FrameQueue m_frameQueue;
+
+	// Owned by presentation thread
 	SDL_Renderer* m_renderer;
 	BackBuffer m_backbuffer;
+
+	std::thread m_presentThread;
+	std::atomic<bool> m_quit;
+	std::atomic<bool> m_redrawRequested; // Window contents were lost (e.g. exposed or restored), present even if unchanged
+
+	// Wakes up the presentation thread. The emulation thread only holds the mutex for an instant, in WakePresentThread.
+	std::mutex m_wakeMutex;
+	std::condition_variable m_wakeCondition;
+
+	void WakePresentThread()
+	{
+		// The predicate state (frame queue or quit flag) is changed without the mutex, so lock it before notifying: the
+		// presentation thread is then either before its predicate test (and sees the change), or already waiting (and
+		// gets the notification). Without it, the notification could be sent between the test and the wait, and lost.
+		{
+			std::lock_guard<std::mutex> lock(m_wakeMutex);
+		}
+		m_wakeCondition.notify_one();
+	}
 };
 
+void Renderer::PIMPL::PresentThreadMain(std::promise<bool>* rendererCreated)
+{
+	// SDL requires the renderer to only be used by the thread that created it
+	m_renderer = SDL_CreateRenderer(m_window, -1, SDL_RENDERER_ACCELERATED);
+	if (!m_renderer)
+	{
+		rendererCreated->set_value(false);
+		return;
+	}
+
+	m_backbuffer.Create(kScreenWidth, kScreenHeight, m_renderer);
+	m_backbuffer.Clear(Color4::Black());
+	m_backbuffer.Flip(m_renderer);
+	rendererCreated->set_value(true);
+
+	// Unchanged frames are still presented at this rate, in case the window contents were lost without an event
+	const std::chrono::milliseconds kRefreshInterval(250);
+	std::chrono::steady_clock::time_point lastPresentTime = std::chrono::steady_clock::now();
+
+	while (!m_quit)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_wakeMutex);
+			m_wakeCondition.wait_for(lock, std::chrono::milliseconds(100), [this] { return m_quit || m_redrawRequested || m_frameQueue.HasNewFrame(); });
+		}
+
+		const IndexedColor* frame;
+		const bool newFrame = m_frameQueue.PopFrame(frame);
+		if (newFrame)
+		{
+			m_backbuffer.DrawFrame(frame);
+		}
+
+		const std::chrono::steady_clock::time_point currTime = std::chrono::steady_clock::now();
+		const bool forcePresent = m_redrawRequested.exchange(false) || (currTime - lastPresentTime >= kRefreshInterval);
+
+		if ((newFrame || forcePresent) && m_backbuffer.Flip(m_renderer, forcePresent))
+		{
+			lastPresentTime = currTime;
+		}
+	}
+
+	SDL_DestroyRenderer(m_renderer);
+	m_renderer = NULL;
+}
+
+int SDLCALL Renderer::PIMPL::OnEvent(void* userData, SDL_Event* event)
+{
+	if (event->type == SDL_WINDOWEVENT)
+	{
+		switch (event->window.event)
+		{
+		case SDL_WINDOWEVENT_SHOWN:
+		case SDL_WINDOWEVENT_EXPOSED:
+		case SDL_WINDOWEVENT_RESTORED:
+		case SDL_WINDOWEVENT_SIZE_CHANGED:
+			{
+				PIMPL* impl = static_cast<PIMPL*>(userData);
+				impl->m_redrawRequested = true;
+				impl->WakePresentThread();
+			}
+			break;
+		}
+	}
+	return 1;
+}
+
 Renderer::Renderer()
 	: m_impl(nullptr)
 {
@@ -104,22 +303,34 @@ void Renderer::Create()
 	if (!m_impl->m_window)
 		FAIL("SDL_CreateWindow failed");
 
-	m_impl->m_renderer = SDL_CreateRenderer(m_impl->m_window, -1, SDL_RENDERER_ACCELERATED);
-	if (!m_impl->m_renderer)
-		FAIL("SDL_CreateRenderer failed");
-
-	m_impl->m_backbuffer.Create(kScreenWidth, kScreenHeight, m_impl->m_renderer);
+	m_impl->m_frameQueue.Create(kScreenWidth * kScreenHeight);
 
-	Clear();
+	std::promise<bool> rendererCreated;
+	m_impl->m_presentThread = std::thread(&PIMPL::PresentThreadMain, m_impl, &rendererCreated);
+	if (!rendererCreated.get_future().get())
+	{
+		m_impl->m_presentThread.join();
+		FAIL("SDL_CreateRenderer failed");
+	}
 
 	g_mainWindow = m_impl->m_window;
+
+	SDL_AddEventWatch(&PIMPL::OnEvent, m_impl);
 }
 
 void Renderer::Destroy()
 {
 	if (m_impl)
 	{
-		SDL_DestroyRenderer(m_impl->m_renderer);
+		SDL_DelEventWatch(&PIMPL::OnEvent, m_impl);
+
+		if (m_impl->m_presentThread.joinable())
+		{
+			m_impl->m_quit = true;
+			m_impl->WakePresentThread();
+			m_impl->m_presentThread.join();
+		}
+
 		SDL_DestroyWindow(m_impl->m_window);
 		delete m_impl;
 		m_impl = nullptr;
@@ -127,17 +338,20 @@ void Renderer::Destroy()
 	}
 }
 
-void Renderer::Clear(const Color4& color)
+void Renderer::DrawFrame(const IndexedColor* frame)
 {
-	m_impl->m_backbuffer.Clear(color);
+	memcpy(m_impl->m_frameQueue.GetWriteBuffer(), frame, kScreenWidth * kScreenHeight * sizeof(IndexedColor));
 }
 
-void Renderer::DrawPixel(int32 x, int32 y, const Color4& color)
+void Renderer::Present()
 {
-	m_impl->m_backbuffer(x, y) = color.argb;
+	m_impl->m_frameQueue.PushFrame();
+
+	// Doesn't wait for the frame to be displayed; the presentation thread converts and uploads it if it changed
+	m_impl->WakePresentThread();
 }
 
-void Renderer::Present()
+size_t Renderer::GetNumSkippedUploads() const
 {
-	m_impl->m_backbuffer.Flip(m_impl->m_renderer);
+	return m_impl->m_backbuffer.GetNumSkippedUploads();
 }
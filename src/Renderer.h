@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Base.h"
+#include "Palette.h"
 
 const size_t kScreenWidth = 256;
 const size_t kScreenHeight = 240;
@@ -39,14 +40,22 @@ public:
 
 	static void SetWindowTitle(const char* title);
 
+	// Creates the window, and a presentation thread that owns the SDL renderer
 	void Create();
 	void Destroy();
 
-	void Clear(const Color4& color = Color4::Black());
-	void DrawPixel(int32 x, int32 y, const Color4& color);
+	// Copies a kScreenWidth x kScreenHeight frame of indexed colors to the back buffer
+	void DrawFrame(const IndexedColor* frame);
 	
+	// Hands off the back buffer to the presentation thread without waiting for it to be displayed. The
+	// presentation thread only converts and uploads rows that changed since the last frame it displayed,
+	// and skips presenting unchanged frames, except when the window needs to be redrawn (e.g. exposed or restored) and
+	// at a low fixed rate. Frames completed faster than they are displayed are dropped.
 	void Present();
 
+	// Number of frames the presentation thread skipped because they were unchanged
+	size_t GetNumSkippedUploads() const;
+
 private:
 	struct PIMPL;
 	PIMPL* m_impl;
@@ -0,0 +1,252 @@
+#include "RewindBuffer.h"
+#include "Nes.h"
+#include "System.h"
+#include "CpuFeatures.h"
+#include <cstring>
+
+#if CPU_X86
+	#include <emmintrin.h>
+#endif
+
+// Delta format: pairs of (number of unchanged words, number of changed words) encoded as variable length integers,
+// each followed by the changed words XORed with the previous state, until all words are covered. The last
+// (state size % 8) bytes are stored XORed without encoding.
+
+namespace
+{
+	const size_t kWordSize = sizeof(uint64);
+
+	FORCEINLINE uint64 LoadWord(const uint8* data, size_t wordIndex)
+	{
+		uint64 word;
+		memcpy(&word, data + wordIndex * kWordSize, kWordSize);
+		return word;
+	}
+
+	// Returns index of the first word in [wordIndex, numWords) that differs between a and b, or numWords
+	size_t FindDifferentWordScalar(const uint8* a, const uint8* b, size_t wordIndex, size_t numWords)
+	{
+		while (wordIndex < numWords && LoadWord(a, wordIndex) == LoadWord(b, wordIndex))
+		{
+			++wordIndex;
+		}
+		return wordIndex;
+	}
+
+#if CPU_X86
+	// Compares 2 words at a time, which is where most time is spent as most of a state is unchanged
+	size_t FindDifferentWordSSE2(const uint8* a, const uint8* b, size_t wordIndex, size_t numWords)
+	{
+		for (; wordIndex + 2 <= numWords; wordIndex += 2)
+		{
+			const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + wordIndex * kWordSize));
+			const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + wordIndex * kWordSize));
+			const int equalMask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+			if (equalMask != 0xFFFF)
+			{
+				return (equalMask & 0xFF) != 0xFF? wordIndex : wordIndex + 1;
+			}
+		}
+		return FindDifferentWordScalar(a, b, wordIndex, numWords);
+	}
+#endif
+
+	size_t FindDifferentWord(const uint8* a, const uint8* b, size_t wordIndex, size_t numWords)
+	{
+	#if CPU_X86
+		if (CpuFeatures::HasSSE2())
+			return FindDifferentWordSSE2(a, b, wordIndex, numWords);
+	#endif
+		return FindDifferentWordScalar(a, b, wordIndex, numWords);
+	}
+
+	void WriteVarUInt(std::vector<uint8>& output, size_t value)
+	{
+		while (value >= 0x80)
+		{
+			output.push_back(static_cast<uint8>(value | 0x80));
+			value >>= 7;
+		}
+		output.push_back(static_cast<uint8>(value));
+	}
+
+	size_t ReadVarUInt(const uint8*& input)
+	{
+		size_t value = 0;
+		for (uint32 shift = 0; ; shift += 7)
+		{
+			const uint8 byte = *input++;
+			value |= static_cast<size_t>(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+				return value;
+		}
+	}
+
+	// Encodes newState XOR oldState, both of the given size
+	void EncodeDelta(const uint8* newState, const uint8* oldState, size_t size, std::vector<uint8>& output)
+	{
+		output.clear();
+
+		const size_t numWords = size / kWordSize;
+		size_t wordIndex = 0;
+		while (wordIndex < numWords)
+		{
+			const size_t changedStart = FindDifferentWord(newState, oldState, wordIndex, numWords);
+
+			// Changed words are usually few and close together, so they're compared one at a time
+			size_t changedEnd = changedStart;
+			while (changedEnd < numWords && LoadWord(newState, changedEnd) != LoadWord(oldState, changedEnd))
+			{
+				++changedEnd;
+			}
+
+			WriteVarUInt(output, changedStart - wordIndex);
+			WriteVarUInt(output, changedEnd - changedStart);
+
+			for (size_t i = changedStart; i < changedEnd; ++i)
+			{
+				const uint64 word = LoadWord(newState, i) ^ LoadWord(oldState, i);
+				const uint8* bytes = reinterpret_cast<const uint8*>(&word);
+				output.insert(output.end(), bytes, bytes + kWordSize);
+			}
+
+			wordIndex = changedEnd;
+		}
+
+		for (size_t i = numWords * kWordSize; i < size; ++i)
+		{
+			output.push_back(newState[i] ^ oldState[i]);
+		}
+	}
+
+	// XORs state with a delta encoded by EncodeDelta, turning one of the two states into the other
+	void ApplyDelta(uint8* state, size_t size, const uint8* delta)
+	{
+		const size_t numWords = size / kWordSize;
+		size_t wordIndex = 0;
+		while (wordIndex < numWords)
+		{
+			wordIndex += ReadVarUInt(delta);
+			const size_t numChangedWords = ReadVarUInt(delta);
+
+			for (size_t i = 0; i < numChangedWords; ++i, ++wordIndex, delta += kWordSize)
+			{
+				uint64 word = LoadWord(state, wordIndex) ^ LoadWord(delta, 0);
+				memcpy(state + wordIndex * kWordSize, &word, kWordSize);
+			}
+		}
+
+		for (size_t i = numWords * kWordSize; i < size; ++i)
+		{
+			state[i] ^= *delta++;
+		}
+	}
+}
+
+RewindBuffer::RewindBuffer()
+	: m_usedBytes(0)
+	, m_numCaptures(0)
+	, m_totalCaptureTicks(0)
+	, m_totalDeltaBytes(0)
+{
+}
+
+void RewindBuffer::Initialize(size_t capacityBytes)
+{
+	m_buffer.assign(capacityBytes, 0);
+	m_numCaptures = 0;
+	m_totalCaptureTicks = 0;
+	m_totalDeltaBytes = 0;
+	Clear();
+}
+
+void RewindBuffer::Clear()
+{
+	m_deltas.clear();
+	m_usedBytes = 0;
+	m_lastState.clear();
+}
+
+void RewindBuffer::Capture(Nes& nes)
+{
+	if (!IsEnabled())
+		return;
+
+	const System::Ticks startTicks = System::GetTicks();
+
+	nes.SaveState(m_newState);
+
+	// The delta restores the last state from the new one
+	if (m_lastState.size() == m_newState.size())
+	{
+		EncodeDelta(m_lastState.data(), m_newState.data(), m_newState.size(), m_encodedDelta);
+		PushDelta(m_encodedDelta);
+		m_totalDeltaBytes += m_encodedDelta.size();
+	}
+	else
+	{
+		Clear(); // No previous state, or from a different rom
+	}
+	m_lastState.swap(m_newState);
+
+	m_totalCaptureTicks += System::GetTicks() - startTicks;
+	++m_numCaptures;
+}
+
+bool RewindBuffer::Rewind(Nes& nes)
+{
+	if (m_deltas.empty())
+		return false;
+
+	const Delta& delta = m_deltas.back();
+	ApplyDelta(m_lastState.data(), m_lastState.size(), &m_buffer[delta.offset]);
+	m_usedBytes -= delta.size;
+	m_deltas.pop_back();
+
+	nes.LoadState(m_lastState);
+	return true;
+}
+
+void RewindBuffer::PushDelta(const std::vector<uint8>& delta)
+{
+	const size_t size = delta.size();
+	if (size > m_buffer.size())
+	{
+		Clear(); // Can't rewind past this state
+		return;
+	}
+
+	size_t offset = m_deltas.empty()? 0 : m_deltas.back().offset + m_deltas.back().size;
+	if (offset + size > m_buffer.size())
+	{
+		// Deltas between offset and the end of the buffer are the oldest ones, drop them and wrap around
+		while (!m_deltas.empty() && m_deltas.front().offset >= offset)
+		{
+			m_usedBytes -= m_deltas.front().size;
+			m_deltas.pop_front();
+		}
+		offset = 0;
+	}
+
+	// Drop the oldest deltas that would be overwritten
+	while (!m_deltas.empty() && m_deltas.front().offset >= offset && m_deltas.front().offset < offset + size)
+	{
+		m_usedBytes -= m_deltas.front().size;
+		m_deltas.pop_front();
+	}
+
+	memcpy(&m_buffer[offset], delta.data(), size);
+	Delta newDelta = { offset, size };
+	m_deltas.push_back(newDelta);
+	m_usedBytes += size;
+}
+
+float64 RewindBuffer::GetAverageCaptureTime() const
+{
+	return m_numCaptures == 0? 0.0 : System::TicksToSec(m_totalCaptureTicks) / m_numCaptures;
+}
+
+float64 RewindBuffer::GetAverageDeltaSize() const
+{
+	return m_numCaptures == 0? 0.0 : static_cast<float64>(m_totalDeltaBytes) / m_numCaptures;
+}
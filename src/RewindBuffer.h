@@ -0,0 +1,60 @@
+#pragma once
+#include "Base.h"
+#include <deque>
+#include <vector>
+
+class Nes;
+
+// Keeps a history of save states (see Nes::SaveState) in a fixed amount of memory, so emulation can be played
+// back in reverse one frame at a time. Only the last captured state is kept whole; every other state is stored as
+// the XOR of itself with the following state, in which runs of unchanged 8 byte words are compressed. Most of a
+// state doesn't change from one frame to the next, so deltas are a few hundred bytes. When the buffer is full,
+// the oldest deltas are dropped.
+class RewindBuffer
+{
+public:
+	RewindBuffer();
+
+	// Frees the history buffer if capacityBytes is 0
+	void Initialize(size_t capacityBytes);
+	bool IsEnabled() const { return !m_buffer.empty(); }
+
+	// Drops the whole history, must be called when a different rom is loaded
+	void Clear();
+
+	// Call once per emulated frame
+	void Capture(Nes& nes);
+
+	// Loads the state captured before the last one, which becomes the last one. Returns false if there
+	// is no history left.
+	bool Rewind(Nes& nes);
+
+	size_t GetNumFrames() const { return m_deltas.size(); } // Frames that can be rewound
+	size_t GetMemoryUsed() const { return m_usedBytes + m_lastState.size(); }
+	size_t GetCapacity() const { return m_buffer.size(); }
+
+	// Averages over all captures since Initialize
+	float64 GetAverageCaptureTime() const; // Seconds
+	float64 GetAverageDeltaSize() const; // Bytes
+
+private:
+	struct Delta
+	{
+		size_t offset; // In m_buffer
+		size_t size;
+	};
+
+	void PushDelta(const std::vector<uint8>& delta);
+
+	std::vector<uint8> m_buffer; // Ring buffer of deltas
+	std::deque<Delta> m_deltas; // Oldest first
+	size_t m_usedBytes;
+
+	std::vector<uint8> m_lastState;
+	std::vector<uint8> m_newState;
+	std::vector<uint8> m_encodedDelta;
+
+	uint64 m_numCaptures;
+	uint64 m_totalCaptureTicks;
+	uint64 m_totalDeltaBytes;
+};
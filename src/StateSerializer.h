@@ -0,0 +1,84 @@
+#pragma once
+#include "Base.h"
+#include "Memory.h"
+#include <cstring>
+#include <vector>
+
+// Saves or loads the state of emulated components to or from a binary buffer. Each component implements a single
+// Serialize(StateSerializer&) function that visits its state in a fixed order, used for both directions. Values are
+// copied as raw bytes, so the format depends on the host endianness.
+//
+// Only state that can't be recomputed is serialized: pointers (e.g. to memory mapped registers) and caches (e.g.
+// decoded instructions) are left untouched or rebuilt after loading. When the order or type of serialized values
+// changes, kVersion must be incremented.
+class StateSerializer
+{
+public:
+	static const uint32 kVersion = 2;
+
+	// For saving: values are appended to buffer
+	explicit StateSerializer(std::vector<uint8>& buffer)
+		: m_saveBuffer(&buffer)
+		, m_loadData(nullptr)
+		, m_loadSize(0)
+		, m_loadPos(0)
+	{
+	}
+
+	// For loading: values are read from data, which must have been saved with the same version
+	StateSerializer(const uint8* data, size_t size)
+		: m_saveBuffer(nullptr)
+		, m_loadData(data)
+		, m_loadSize(size)
+		, m_loadPos(0)
+	{
+	}
+
+	bool IsLoading() const { return m_loadData != nullptr; }
+	bool IsAtEnd() const { return !IsLoading() || m_loadPos == m_loadSize; }
+
+	void Bytes(void* data, size_t size)
+	{
+		if (IsLoading())
+		{
+			if (size > m_loadSize - m_loadPos)
+				FAIL("Save state is truncated");
+
+			memcpy(data, m_loadData + m_loadPos, size);
+			m_loadPos += size;
+		}
+		else
+		{
+			const uint8* bytes = reinterpret_cast<const uint8*>(data);
+			m_saveBuffer->insert(m_saveBuffer->end(), bytes, bytes + size);
+		}
+	}
+
+	// For integral types, bools, and plain structs or arrays of them
+	template <typename T>
+	void Value(T& value)
+	{
+		Bytes(&value, sizeof(T));
+	}
+
+	// Stores value as StoredType, for types that don't have the same size on all platforms (e.g. size_t, enums)
+	template <typename StoredType, typename T>
+	void ValueAs(T& value)
+	{
+		StoredType storedValue = static_cast<StoredType>(value);
+		Value(storedValue);
+		value = static_cast<T>(storedValue);
+	}
+
+	template <typename StorageType>
+	void Memory(::Memory<StorageType>& memory)
+	{
+		Bytes(memory.RawPtr(), memory.Size());
+	}
+
+private:
+	std::vector<uint8>* m_saveBuffer;
+	const uint8* m_loadData;
+	size_t m_loadSize;
+	size_t m_loadPos;
+};
@@ -6,6 +6,7 @@
 #define WIN32_LEAN_AND_MEAN
 #undef ARRAYSIZE // Already defined in a Windows header
 #include <Windows.h>
+#include <mmsystem.h>
 #include <commdlg.h>
 #include <conio.h>
 #include <cstdio>
@@ -13,9 +14,36 @@
 // Undef the macro in WinUser.h so we can use this name as our function. We invoke MessageBoxA directly.
 #undef MessageBox
 
+#pragma comment(lib, "winmm.lib") // timeBeginPeriod
+
+namespace
+{
+	// Sleep rounds up to the system timer resolution, 15.6 ms by default, which is about a whole frame (see FrameTimer)
+	class TimerResolution
+	{
+	public:
+		TimerResolution() : m_enabled(timeBeginPeriod(1) == TIMERR_NOERROR) {}
+
+		~TimerResolution()
+		{
+			if (m_enabled)
+			{
+				timeEndPeriod(1);
+			}
+		}
+
+	private:
+		bool m_enabled;
+	};
+}
+
 namespace System
 {
-	void Sleep(uint32 ms) { ::Sleep(ms); }
+	void Sleep(uint32 ms)
+	{
+		static TimerResolution timerResolution;
+		::Sleep(ms);
+	}
 
 	bool GetKeyPress(char& key)
 	{
@@ -104,6 +132,114 @@ namespace System
 }
 
 
+#elif PLATFORM_POSIX
+
+#include <csignal>
+#include <cstdio>
+#include <ctime>
+#include <sys/select.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace
+{
+	// Puts the terminal in non-canonical mode so key presses can be read without waiting for a new line,
+	// and restores it on exit
+	class RawTerminal
+	{
+	public:
+		RawTerminal() : m_enabled(false)
+		{
+			if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &m_oldSettings) == 0)
+			{
+				termios settings = m_oldSettings;
+				settings.c_lflag &= ~(ICANON | ECHO);
+				m_enabled = tcsetattr(STDIN_FILENO, TCSANOW, &settings) == 0;
+			}
+		}
+
+		~RawTerminal()
+		{
+			if (m_enabled)
+			{
+				tcsetattr(STDIN_FILENO, TCSANOW, &m_oldSettings);
+			}
+		}
+
+	private:
+		termios m_oldSettings;
+		bool m_enabled;
+	};
+}
+
+namespace System
+{
+	void Sleep(uint32 ms)
+	{
+		timespec ts;
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000;
+		nanosleep(&ts, nullptr);
+	}
+
+	bool GetKeyPress(char& key)
+	{
+		static RawTerminal rawTerminal;
+
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(STDIN_FILENO, &fds);
+		timeval timeout = {0, 0};
+		if (select(STDIN_FILENO + 1, &fds, nullptr, nullptr, &timeout) <= 0)
+			return false;
+
+		char c;
+		if (read(STDIN_FILENO, &c, 1) != 1)
+			return false;
+
+		key = c;
+		return true;
+	}
+
+	char WaitForKeyPress()
+	{
+		char key;
+		while (!GetKeyPress(key))
+		{
+			Sleep(1);
+		}
+		return key;
+	}
+
+	void DebugBreak()
+	{
+		raise(SIGTRAP);
+	}
+
+	void MessageBox(const char* title, const char* message)
+	{
+		printf("%s: %s\n", title, message);
+	}
+
+	bool OpenFileDialog(std::string& /*fileSelected*/, const char* /*title*/, const char* /*filter*/)
+	{
+		// No dialog, files must be passed on the command line
+		return false;
+	}
+
+	Ticks GetTicks()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<Ticks>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+	float64 TicksToSec(Ticks t1)
+	{
+		return static_cast<float64>(t1) / 1000000000.0;
+	}
+}
+
 #else
-#error "Implement for current platform
+#error "Implement for current platform"
 #endif
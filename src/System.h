@@ -1,10 +1,13 @@
 #pragma once
 #include "Base.h"
+#include <string>
 
 // Platform-specific system calls
 
 #if PLATFORM_WINDOWS
 	#define FILE_FILTER(name, types) name " (" types ")\0" types "\0"
+#else
+	#define FILE_FILTER(name, types) name " (" types ")"
 #endif
 
 namespace System
@@ -0,0 +1,70 @@
+#include "VideoSink.h"
+#include "Renderer.h"
+#include "FileStream.h"
+#include <vector>
+
+namespace
+{
+#if !CONFIG_HEADLESS
+	class SdlVideoSink : public VideoSink
+	{
+	public:
+		SdlVideoSink()
+		{
+			m_renderer.Create();
+		}
+
+		virtual void OnFrameComplete(const IndexedColor* frame)
+		{
+			m_renderer.DrawFrame(frame);
+			m_renderer.Present();
+		}
+
+		virtual size_t GetNumSkippedFrames() const { return m_renderer.GetNumSkippedUploads(); }
+
+	private:
+		Renderer m_renderer;
+	};
+#endif
+
+	class FileVideoSink : public VideoSink
+	{
+	public:
+		FileVideoSink(const char* fileName)
+			: m_file(fileName, "wb")
+			, m_argbFrame(kScreenWidth * kScreenHeight)
+		{
+		}
+
+		virtual void OnFrameComplete(const IndexedColor* frame)
+		{
+			Palette::ConvertToArgb(frame, m_argbFrame.data(), m_argbFrame.size());
+			m_file.Write(m_argbFrame.data(), m_argbFrame.size());
+		}
+
+	private:
+		FileStream m_file;
+		std::vector<uint32> m_argbFrame;
+	};
+}
+
+std::shared_ptr<VideoSink> CreateVideoSink(VideoSinkType::Type type, const char* fileName)
+{
+	switch (type)
+	{
+#if CONFIG_HEADLESS
+	case VideoSinkType::Sdl:	FAIL("Headless build can't display frames");
+#else
+	case VideoSinkType::Sdl:	return std::make_shared<SdlVideoSink>();
+#endif
+	case VideoSinkType::Null:	return std::make_shared<NullVideoSink>();
+	case VideoSinkType::Memory:	return std::make_shared<MemoryVideoSink>();
+	case VideoSinkType::File:
+		if (!fileName)
+			FAIL("File video sink requires a file name");
+		return std::make_shared<FileVideoSink>(fileName);
+	}
+
+	FAIL("Unknown video sink type: %d", type);
+	return nullptr;
+}
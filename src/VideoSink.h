@@ -0,0 +1,59 @@
+#pragma once
+#include "Base.h"
+#include "Palette.h"
+#include <memory>
+
+// Receives frames rendered by the PPU. Frames are kScreenWidth x kScreenHeight indexed colors (see Palette), passed
+// as a pointer to the PPU's frame buffer. The pointer is only valid until the PPU starts rendering the next frame,
+// so sinks that keep frames around must copy them.
+class VideoSink
+{
+public:
+	virtual ~VideoSink() {}
+
+	virtual void OnFrameComplete(const IndexedColor* frame) = 0;
+
+	// Number of frames not presented because they were identical to the previous one
+	virtual size_t GetNumSkippedFrames() const { return 0; }
+};
+
+// Discards frames, for runs where nothing is displayed
+class NullVideoSink : public VideoSink
+{
+public:
+	virtual void OnFrameComplete(const IndexedColor* /*frame*/) {}
+};
+
+// Keeps a pointer to the last frame, so it can be read between calls to Nes::ExecuteFrame without copying it
+class MemoryVideoSink : public VideoSink
+{
+public:
+	MemoryVideoSink() : m_lastFrame(nullptr), m_numFrames(0) {}
+
+	virtual void OnFrameComplete(const IndexedColor* frame)
+	{
+		m_lastFrame = frame;
+		++m_numFrames;
+	}
+
+	const IndexedColor* GetLastFrame() const { return m_lastFrame; } // nullptr until the first frame
+	size_t GetNumFrames() const { return m_numFrames; }
+
+private:
+	const IndexedColor* m_lastFrame;
+	size_t m_numFrames;
+};
+
+namespace VideoSinkType
+{
+	enum Type
+	{
+		Sdl, // Displays frames in a window (see Renderer), not available if CONFIG_HEADLESS
+		Null,
+		Memory,
+		File, // Appends frames to a file as raw 32-bit BGRA pixels (little endian ARGB)
+	};
+}
+
+// fileName is only used by VideoSinkType::File
+std::shared_ptr<VideoSink> CreateVideoSink(VideoSinkType::Type type, const char* fileName = nullptr);
@@ -0,0 +1,93 @@
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool()
+	: m_numPendingJobs(0)
+	, m_stopping(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	Stop();
+}
+
+void WorkerPool::Start(size_t numThreads)
+{
+	assert(!IsStarted());
+	assert(numThreads > 0);
+
+	m_stopping = false;
+	for (size_t i = 0; i < numThreads; ++i)
+	{
+		m_threads.push_back(std::thread(&WorkerPool::WorkerMain, this));
+	}
+}
+
+void WorkerPool::Stop()
+{
+	if (!IsStarted())
+		return;
+
+	Wait();
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_jobSubmitted.notify_all();
+
+	for (auto iter = m_threads.begin(); iter != m_threads.end(); ++iter)
+	{
+		iter->join();
+	}
+	m_threads.clear();
+}
+
+void WorkerPool::Submit(Job job)
+{
+	assert(IsStarted());
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(std::move(job));
+		++m_numPendingJobs;
+	}
+	m_jobSubmitted.notify_one();
+}
+
+void WorkerPool::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_numPendingJobs > 0)
+	{
+		m_jobsCompleted.wait(lock);
+	}
+}
+
+void WorkerPool::WorkerMain()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	for (;;)
+	{
+		while (m_jobs.empty() && !m_stopping)
+		{
+			m_jobSubmitted.wait(lock);
+		}
+
+		if (m_jobs.empty()) // Stopping
+			return;
+
+		Job job = std::move(m_jobs.front());
+		m_jobs.pop_front();
+
+		lock.unlock();
+		job();
+		lock.lock();
+
+		if (--m_numPendingJobs == 0)
+		{
+			m_jobsCompleted.notify_all();
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "Base.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs jobs on a fixed set of worker threads. Jobs are started in submission order, but may complete
+// in any order.
+class WorkerPool
+{
+public:
+	typedef std::function<void ()> Job;
+
+	WorkerPool();
+	~WorkerPool();
+
+	void Start(size_t numThreads);
+	void Stop(); // Waits for submitted jobs to complete
+	bool IsStarted() const { return !m_threads.empty(); }
+
+	void Submit(Job job);
+	void Wait(); // Blocks until all submitted jobs have completed
+
+private:
+	void WorkerMain();
+
+	std::vector<std::thread> m_threads;
+	std::deque<Job> m_jobs;
+	size_t m_numPendingJobs; // Queued or running
+	bool m_stopping;
+
+	std::mutex m_mutex;
+	std::condition_variable m_jobSubmitted;
+	std::condition_variable m_jobsCompleted;
+};
@@ -3,7 +3,12 @@
 #include "System.h"
 #include "Input.h"
 #include "Renderer.h"
+#include "VideoSink.h"
+#include "RewindBuffer.h"
 #include "Debugger.h"
+#include "PpuCompositor.h"
+#include <cstdlib>
+#include <cstring>
 
 #define kVersionMajor 1
 #define kVersionMinor 0
@@ -27,7 +32,7 @@ namespace
 		printf(text, kVersionString);
 	}
 
-	inline size_t BytesToKB(size_t bytes) { return bytes / 1024; }
+	inline int BytesToKB(size_t bytes) { return static_cast<int>(bytes / 1024); }
 
 	void PrintRomInfo(const char* romFile, const RomHeader& header)
 	{
@@ -40,12 +45,43 @@ namespace
 		printf("\n");
 	}
 
+	const int kDefaultRewindMB = CONFIG_HEADLESS? 0 : 16;
+
+	void PrintRewindStats(const RewindBuffer& rewindBuffer)
+	{
+		const float64 captureTime = rewindBuffer.GetAverageCaptureTime();
+		const float64 bytesPerSec = rewindBuffer.GetAverageDeltaSize() * kNtscFrameRate;
+		printf("Rewind: %d frames in %.1f KB, %.1f KB per second of history, capture takes %.1f us (%.2f%% of frame time)\n",
+			static_cast<int>(rewindBuffer.GetNumFrames()), rewindBuffer.GetMemoryUsed() / 1024.0, bytesPerSec / 1024.0,
+			captureTime * 1000000.0, captureTime * kNtscFrameRate * 100.0);
+	}
+
 	int ShowUsage(const char* appPath)
 	{
-		printf("Usage: %s <nes rom>\n\n", appPath);
+		printf("Usage: %s [options] <nes rom>\n", appPath);
+		printf("Options:\n");
+#if !CONFIG_HEADLESS
+		printf("  -video=sdl          Display frames in a window (default)\n");
+#endif
+		printf("  -video=null         Discard frames, without creating a window%s\n", CONFIG_HEADLESS? " (default)" : "");
+		printf("  -video=file:<file>  Write frames to file as raw 256x240 BGRA pixels, without creating a window\n");
+		printf("  -frames=<count>     Quit after emulating count frames\n");
+		printf("  -rewind=<MB>        Memory for rewind history, 0 to disable (default: %d)\n", kDefaultRewindMB);
+		printf("  -rendering=inline   Rasterize scanlines on the emulation thread (default)\n");
+		printf("  -rendering=deferred Rasterize scanlines on worker threads\n");
+		printf("\n");
 		return -1;
 	}
 
+	// Returns the value of an argument like "-name=value", or nullptr if arg is not named "name"
+	const char* GetOptionValue(const char* arg, const char* name)
+	{
+		const size_t nameLength = strlen(name);
+		if (arg[0] != '-' || strncmp(arg + 1, name, nameLength) != 0 || arg[nameLength + 1] != '=')
+			return nullptr;
+		return arg + nameLength + 2;
+	}
+
 	bool OpenRomFileDialog(std::string& fileSelected)
 	{
 		return System::OpenFileDialog(fileSelected, "Open NES rom", FILE_FILTER("NES Rom", "*.nes"));
@@ -54,13 +90,87 @@ namespace
 
 int main(int argc, char* argv[])
 {
+	int exitCode = 0;
+
 	try
 	{
 		PrintAppInfo();
 
 		std::string romFile;
+		VideoSinkType::Type videoSinkType = CONFIG_HEADLESS? VideoSinkType::Null : VideoSinkType::Sdl;
+		std::string videoFile;
+		uint32 maxFrames = 0; // No limit
+		int rewindMB = kDefaultRewindMB;
+		bool deferredRendering = false;
+
+		for (int i = 1; i < argc; ++i)
+		{
+			const char* value;
+			if ((value = GetOptionValue(argv[i], "video")) != nullptr)
+			{
+				if (strcmp(value, "sdl") == 0)
+				{
+					videoSinkType = VideoSinkType::Sdl;
+				}
+				else if (strcmp(value, "null") == 0)
+				{
+					videoSinkType = VideoSinkType::Null;
+				}
+				else if (strncmp(value, "file:", 5) == 0 && value[5] != '\0')
+				{
+					videoSinkType = VideoSinkType::File;
+					videoFile = value + 5;
+				}
+				else
+				{
+					ShowUsage(argv[0]);
+					FAIL("Invalid video option: %s", value);
+				}
+			}
+			else if ((value = GetOptionValue(argv[i], "frames")) != nullptr)
+			{
+				maxFrames = static_cast<uint32>(atoi(value));
+			}
+			else if ((value = GetOptionValue(argv[i], "rewind")) != nullptr)
+			{
+				rewindMB = std::max(atoi(value), 0);
+			}
+			else if ((value = GetOptionValue(argv[i], "rendering")) != nullptr)
+			{
+				if (strcmp(value, "inline") == 0)
+				{
+					deferredRendering = false;
+				}
+				else if (strcmp(value, "deferred") == 0)
+				{
+					deferredRendering = true;
+				}
+				else
+				{
+					ShowUsage(argv[0]);
+					FAIL("Invalid rendering option: %s", value);
+				}
+			}
+			else if (argv[i][0] != '-' && romFile.empty())
+			{
+				romFile = argv[i];
+			}
+			else
+			{
+				ShowUsage(argv[0]);
+				FAIL("Invalid argument: %s", argv[i]);
+			}
+		}
 
-		if (argc == 1)
+		// Without a window, nothing can stop emulation except a frame limit
+		const bool headless = (videoSinkType != VideoSinkType::Sdl);
+		if (headless && maxFrames == 0)
+		{
+			ShowUsage(argv[0]);
+			FAIL("-frames is required when not displaying frames");
+		}
+
+		if (romFile.empty() && !headless)
 		{
 			std::string fileSelected;
 			if (OpenRomFileDialog(fileSelected))
@@ -68,10 +178,6 @@ int main(int argc, char* argv[])
 				romFile = fileSelected;
 			}
 		}
-		else if (argc == 2)
-		{
-			romFile = argv[1];
-		}
 		
 		if (romFile.empty())
 		{
@@ -82,6 +188,8 @@ int main(int argc, char* argv[])
 		std::shared_ptr<Nes> nesHolder = std::make_shared<Nes>();
 		Nes* nes = nesHolder.get();
 		nes->Initialize();
+		nes->SetVideoSink(CreateVideoSink(videoSinkType, videoFile.c_str()));
+		nes->SetDeferredRenderingEnabled(deferredRendering);
 		
 		Debugger::Initialize(*nes);
 
@@ -92,6 +200,12 @@ int main(int argc, char* argv[])
 		bool quit = false;
 		bool paused = false;
 		bool stepOneFrame = false;
+		std::vector<uint8> savedState; // Quick save slot
+
+		RewindBuffer rewindBuffer;
+		rewindBuffer.Initialize(MB(static_cast<size_t>(rewindMB)));
+
+		const float64 startTime = System::GetTimeSec();
 
 		while (!quit)
 		{
@@ -99,9 +213,29 @@ int main(int argc, char* argv[])
 			
 			Debugger::Update();
 
+			// Steps back two frames, then emulates one so that the rewound frame is rendered
+			const bool rewind = Input::KeyDown(SDL_SCANCODE_BACKSPACE);
+			if (rewind && !paused && rewindBuffer.Rewind(*nes))
+			{
+				rewindBuffer.Rewind(*nes);
+			}
+
 			nes->ExecuteFrame(paused);
 
-			Renderer::SetWindowTitle( FormattedString<>("nes-emu %s [FPS: %2.2f] %s", kVersionString, nes->GetFps(), paused? "*PAUSED*" : "").Value() );
+			if (!paused)
+			{
+				rewindBuffer.Capture(*nes);
+			}
+
+			if (maxFrames != 0 && nes->GetFrameCount() >= maxFrames)
+			{
+				quit = true;
+			}
+
+#if !CONFIG_HEADLESS
+			Renderer::SetWindowTitle( FormattedString<>("nes-emu %s [FPS: %2.2f] [Jitter: %.2f ms] [Unchanged frames: %d] %s", kVersionString, nes->GetFps(),
+				nes->GetFrameTimeJitter() * 1000.0, static_cast<int>(nes->GetNumSkippedFrameUploads()), paused? "*PAUSED*" : "").Value() );
+#endif
 
 			if (Input::CtrlDown() && Input::KeyPressed(SDL_SCANCODE_O))
 			{
@@ -110,6 +244,8 @@ int main(int argc, char* argv[])
 				{
 					romFile = fileSelected;
 					romHeader = nes->LoadRom(romFile.c_str());
+					savedState.clear(); // Only valid for the rom it was saved with
+					rewindBuffer.Clear();
 					PrintRomInfo(romFile.c_str(), romHeader);
 					nes->Reset();
 				}
@@ -121,6 +257,18 @@ int main(int argc, char* argv[])
 				paused = false;
 			}
 
+			if (Input::KeyPressed(SDL_SCANCODE_F5))
+			{
+				nes->SaveState(savedState);
+				printf("State saved (%d bytes)\n", static_cast<int>(savedState.size()));
+			}
+
+			if (Input::KeyPressed(SDL_SCANCODE_F9) && !savedState.empty())
+			{
+				nes->LoadState(savedState);
+				printf("State loaded\n");
+			}
+
 			if (Input::AltDown() && Input::KeyPressed(SDL_SCANCODE_F4))
 			{
 				quit = true;
@@ -144,20 +292,65 @@ int main(int argc, char* argv[])
 				paused = false; // Unpause for one frame
 			}
 
-			const bool turbo = Input::KeyDown(SDL_SCANCODE_GRAVE); // tilde '~' key
+			if (Input::KeyPressed(SDL_SCANCODE_B))
+			{
+				nes->SetCpuBlockExecutionEnabled(!nes->IsCpuBlockExecutionEnabled());
+				printf("CPU block execution: %s\n", nes->IsCpuBlockExecutionEnabled()? "on" : "off");
+			}
+
+			if (Input::KeyPressed(SDL_SCANCODE_I))
+			{
+				nes->SetIdleLoopSkippingEnabled(!nes->IsIdleLoopSkippingEnabled());
+				printf("Idle loop skipping: %s\n", nes->IsIdleLoopSkippingEnabled()? "on" : "off");
+			}
+
+			if (Input::KeyPressed(SDL_SCANCODE_K)) // F is used by the debugger
+			{
+				// Cycle through 1, 2, 4, and 8
+				const uint32 renderInterval = nes->GetRenderInterval();
+				nes->SetRenderInterval((renderInterval >= 1 && renderInterval < 8)? renderInterval * 2 : 1);
+				printf("Render interval: 1 out of %d frames\n", nes->GetRenderInterval());
+			}
+
+			if (Input::KeyPressed(SDL_SCANCODE_M))
+			{
+				nes->SetDeferredRenderingEnabled(!nes->IsDeferredRenderingEnabled());
+				printf("Multi-threaded rendering: %s\n", nes->IsDeferredRenderingEnabled()? "on" : "off");
+			}
+
+			// Run as fast as possible when no one is watching
+			const bool turbo = headless || Input::KeyDown(SDL_SCANCODE_GRAVE); // tilde '~' key
 			nes->SetTurboEnabled(turbo);
 		}
+
+		if (headless)
+		{
+			const float64 elapsedTime = System::GetTimeSec() - startTime;
+			printf("Emulated %d frames in %.3f sec: %.2f FPS\n", nes->GetFrameCount(), elapsedTime, nes->GetFrameCount() / elapsedTime);
+
+			// Scanlines 0-238 can be executed at once (see Ppu::ExecuteVisibleScanline)
+			const float64 numWholeScanlinesPercent = 100.0 * nes->GetNumWholeScanlines() / std::max(nes->GetFrameCount() * 239.0, 1.0);
+			printf("Scanlines executed at once: %.1f%%\n", numWholeScanlinesPercent);
+			printf("Pixel compositing: %s\n", PpuCompositor::GetImplementationName());
+		}
+
+		if (rewindBuffer.IsEnabled())
+		{
+			PrintRewindStats(rewindBuffer);
+		}
 	}
 	catch (const std::exception& ex)
 	{
 		System::MessageBox("Exception", ex.what());
+		exitCode = -1;
 	}
 	catch (...)
 	{
 		System::MessageBox("Exception", "Unknown exception");
+		exitCode = -1;
 	}
 
 	Debugger::Shutdown();
 
-	return 0;
+	return exitCode;
 }